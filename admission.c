@@ -0,0 +1,110 @@
+#include <time.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "sepia_internal.h"
+
+/*
+  Admission control after CoDel. The queueing delay of a request is the time
+  between its arrival (accept or complete header, see sepia_new_request())
+  and the start of its handler. If the smallest delay of an interval is
+  above the target, the queue has not drained for a whole interval and the
+  server is overloaded. Until an interval ends with a small enough delay,
+  requests that waited longer than the target are shed.
+
+  The state is in shared memory, so the forked workers of sepia_start() and
+  sepia_start_prefork() feed one controller.
+*/
+
+struct admission {
+	int64_t target;
+	int64_t interval;
+
+	int64_t interval_end;
+	int64_t min_delay;
+	int overloaded;
+
+	size_t admitted;
+	size_t shed;
+};
+
+static struct admission * admission = NULL;
+
+// the headers of the 503 after the status, built once
+static bstring retry_header = NULL;
+
+int64_t sepia_now()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+int sepia_use_admission_control(int target_ms, int interval_ms, int retry_after)
+{
+	if (admission == NULL) {
+		admission = mmap(NULL, sizeof(struct admission), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (admission == MAP_FAILED) {
+			admission = NULL;
+			return SEPIA_ERROR_ADMISSION;
+		}
+	}
+
+	admission->target = (int64_t) target_ms * 1000;
+	admission->interval = (int64_t) interval_ms * 1000;
+	admission->interval_end = 0;
+	admission->min_delay = INT64_MAX;
+	admission->overloaded = 0;
+	admission->admitted = 0;
+	admission->shed = 0;
+
+	retry_header = bformat("Retry-After: %d\r\n\r\n", retry_after);
+	return SEPIA_OK;
+}
+
+int sepia_admit(int64_t arrival)
+{
+	if (admission == NULL || admission->target <= 0) {
+		return 1;
+	}
+
+	int64_t now = sepia_now();
+	int64_t delay = now - arrival;
+	int64_t end = __atomic_load_n(&admission->interval_end, __ATOMIC_RELAXED);
+
+	// the first request after the end of an interval decides about the next one
+	if (now >= end && __atomic_compare_exchange_n(&admission->interval_end, &end, now + admission->interval, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		int64_t min_delay = __atomic_exchange_n(&admission->min_delay, INT64_MAX, __ATOMIC_RELAXED);
+		__atomic_store_n(&admission->overloaded, min_delay != INT64_MAX && min_delay > admission->target, __ATOMIC_RELAXED);
+	}
+
+	int64_t min_delay = __atomic_load_n(&admission->min_delay, __ATOMIC_RELAXED);
+	while (delay < min_delay && !__atomic_compare_exchange_n(&admission->min_delay, &min_delay, delay, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	if (__atomic_load_n(&admission->overloaded, __ATOMIC_RELAXED) && delay > admission->target) {
+		__atomic_add_fetch(&admission->shed, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	__atomic_add_fetch(&admission->admitted, 1, __ATOMIC_RELAXED);
+	return 1;
+}
+
+const_bstring sepia_admission_header()
+{
+	return retry_header;
+}
+
+void sepia_admission_stats(struct sepia_admission_stats * stats)
+{
+	if (admission == NULL) {
+		stats->admitted = 0;
+		stats->shed = 0;
+		stats->overloaded = 0;
+		return;
+	}
+
+	stats->admitted = __atomic_load_n(&admission->admitted, __ATOMIC_RELAXED);
+	stats->shed = __atomic_load_n(&admission->shed, __ATOMIC_RELAXED);
+	stats->overloaded = __atomic_load_n(&admission->overloaded, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,144 @@
+#define _GNU_SOURCE
+
+#include <sched.h>
+#include <stdio.h>
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include "sepia_internal.h"
+
+#ifdef HAVE_LINUX_MEMPOLICY_H
+#include <linux/mempolicy.h>
+#endif
+
+/*
+  The placement of workers with cpu_affinity (see struct sepia_server_config).
+  The workers are distributed round robin over the CPUs the process may run
+  on, every worker is pinned to its CPU and its memory is taken from the
+  NUMA node of that CPU. The node is preferred, not enforced, so a worker
+  still gets memory when its node is full. The listening socket of a worker
+  asks the kernel for the connections that are processed on its CPU.
+
+  The node of a CPU is looked up in sysfs, on systems without NUMA every
+  CPU is on node 0.
+*/
+
+#ifndef SO_INCOMING_CPU
+#define SO_INCOMING_CPU 49
+#endif
+
+int sepia_worker_cpu(int index)
+{
+	cpu_set_t allowed;
+	int cpu, count;
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || (count = CPU_COUNT(&allowed)) == 0) {
+		return -1;
+	}
+
+	index %= count;
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET(cpu, &allowed) && index-- == 0) {
+			return cpu;
+		}
+	}
+
+	return -1;
+}
+
+int sepia_cpu_node(int cpu)
+{
+	char path[64];
+	struct dirent * entry;
+	int node = 0;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+	DIR * dir = opendir(path);
+	if (dir == NULL) {
+		return 0;
+	}
+
+	// the directory of a CPU links to its node as nodeN
+	while ((entry = readdir(dir)) != NULL) {
+		if (strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] >= '0' && entry->d_name[4] <= '9') {
+			node = atoi(entry->d_name + 4);
+			break;
+		}
+	}
+
+	closedir(dir);
+	return node;
+}
+
+int sepia_pin_to_cpu(int cpu)
+{
+	cpu_set_t set;
+
+	if (cpu < 0) {
+		return -1;
+	}
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+
+	// applies to the calling thread only
+	if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+		sepia_log(LOG_ERR, "Could not pin a worker to CPU %d.", cpu);
+		return -1;
+	}
+
+	int node = sepia_cpu_node(cpu);
+
+#if defined(HAVE_LINUX_MEMPOLICY_H) && defined(SYS_set_mempolicy)
+	unsigned long mask[4];
+	memset(mask, 0, sizeof(mask));
+
+	if (node < (int) (sizeof(mask) * 8)) {
+		mask[node / (sizeof(unsigned long) * 8)] = 1UL << (node % (sizeof(unsigned long) * 8));
+		if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, sizeof(mask) * 8) != 0) {
+			sepia_log(LOG_ERR, "Could not prefer the memory of NUMA node %d.", node);
+		}
+	}
+#endif
+
+	return node;
+}
+
+void sepia_socket_cpu(int socket, int cpu)
+{
+	if (cpu >= 0) {
+		setsockopt(socket, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu));
+	}
+}
+
+void sepia_log_placement(int workers)
+{
+	cpu_set_t allowed;
+	int i, cpus = 0, nodes = 0;
+	int seen[CPU_SETSIZE];
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+		memset(seen, 0, sizeof(seen));
+		for (i = 0; i < CPU_SETSIZE; i++) {
+			if (CPU_ISSET(i, &allowed)) {
+				int node = sepia_cpu_node(i);
+				if (node >= 0 && node < CPU_SETSIZE && !seen[node]) {
+					seen[node] = 1;
+					nodes++;
+				}
+				cpus++;
+			}
+		}
+	}
+
+	sepia_log(LOG_INFO, "Placing %d workers on %d CPUs of %d NUMA nodes.", workers, cpus, nodes);
+
+	for (i = 0; i < workers; i++) {
+		int cpu = sepia_worker_cpu(i);
+		sepia_log(LOG_INFO, "Worker %d runs on CPU %d of NUMA node %d.", i, cpu, cpu < 0 ? -1 : sepia_cpu_node(cpu));
+	}
+}
@@ -0,0 +1,236 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "sepia_internal.h"
+
+/*
+  Bodies that do not go through the heap. sepia_read_to_fd() moves the
+  body from the socket to a file descriptor with splice(), through a pipe
+  unless the target is one. The data that was received with the header is
+  written first, bodies the protocol has read already (FastCGI, chunked
+  HTTP, the EVENT model without coroutines) are written from memory.
+
+  With spill_size set, sepia_read_string() puts larger bodies into an
+  unlinked temporary file and maps it, the mapping is removed when the
+  body is collected.
+*/
+
+// the most that is moved with one splice()
+#define SPLICE_SIZE (1024 * 1024)
+
+int sepia_write_all(int fd, const char * data, size_t length)
+{
+	while (length > 0) {
+		ssize_t written = write(fd, data, length);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		data += written;
+		length -= written;
+	}
+
+	return 0;
+}
+
+// waits like sepia_connection_read() if the socket has nothing to splice, returns -1 if it timed out
+static int wait_readable(struct sepia_connection * conn)
+{
+	if (conn->wait != NULL && conn->wait(conn, 0) == 0) {
+		return 0;
+	}
+
+	// without a wait the socket is blocking and its receive timeout expired
+	sepia_connection_expired(conn);
+	errno = ETIMEDOUT;
+	return -1;
+}
+
+// splice() into a full pipe fails with EAGAIN as if the socket had nothing to read, then this waits until the pipe has room
+static int wait_pipe(struct sepia_connection * conn, int fd)
+{
+	struct pollfd socket_fd = { conn->socket, POLLIN, 0 };
+	struct pollfd pipe_fd = { fd, POLLOUT, 0 };
+
+	if (poll(&socket_fd, 1, 0) != 1 || poll(&pipe_fd, 1, 0) != 0) {
+		return -1;
+	}
+
+	// like write() to a pipe this waits as long as the reader needs
+	return poll(&pipe_fd, 1, -1) == 1 ? 0 : -1;
+}
+
+// moves length bytes from the socket into fd, returns the number of bytes moved or -1
+static ssize_t splice_body(struct sepia_connection * conn, int fd, size_t length)
+{
+	struct stat info;
+	int pipe_fd[2] = { -1, -1 };
+	size_t moved = 0;
+
+	// one end of splice() has to be a pipe
+	int direct = fstat(fd, &info) == 0 && S_ISFIFO(info.st_mode);
+	if (!direct && pipe2(pipe_fd, O_CLOEXEC) != 0) {
+		return -1;
+	}
+
+	while (moved < length && !conn->timed_out) {
+		size_t chunk = length - moved < SPLICE_SIZE ? length - moved : SPLICE_SIZE;
+		ssize_t spliced = splice(conn->socket, NULL, direct ? fd : pipe_fd[1], NULL, chunk, SPLICE_F_MOVE | SPLICE_F_MORE);
+
+		if (spliced < 0 && errno == EINTR) {
+			continue;
+		}
+		if (spliced < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			if ((direct && wait_pipe(conn, fd) == 0) || wait_readable(conn) == 0) {
+				continue;
+			}
+			break;
+		}
+		if (spliced <= 0) {
+			break;
+		}
+
+		// the pipe is drained before the socket is spliced again
+		ssize_t left = direct ? 0 : spliced;
+		while (left > 0) {
+			ssize_t out = splice(pipe_fd[0], NULL, fd, NULL, left, SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (out < 0 && errno == EINTR) {
+				continue;
+			}
+			if (out <= 0) {
+				break;
+			}
+			left -= out;
+		}
+		if (left > 0) {
+			break;
+		}
+
+		moved += spliced;
+	}
+
+	if (!direct) {
+		close(pipe_fd[0]);
+		close(pipe_fd[1]);
+	}
+
+	return moved == length ? (ssize_t) moved : -1;
+}
+
+ssize_t sepia_read_to_fd(struct sepia_request * request, int fd)
+{
+	struct sepia_connection * conn = request->conn;
+	size_t remaining = request->body_length > request->received_body_length ? request->body_length - request->received_body_length : 0;
+	size_t written = 0;
+
+	if (remaining == 0) {
+		return 0;
+	}
+
+	if (request->body != NULL || conn == NULL) {
+		if (request->body == NULL || sepia_write_all(fd, bdata(request->body) + request->received_body_length, remaining) != 0) {
+			return -1;
+		}
+		request->received_body_length += remaining;
+		return remaining;
+	}
+
+	// what came in with the header
+	if (conn->offset < conn->length) {
+		written = conn->length - conn->offset < remaining ? conn->length - conn->offset : remaining;
+		if (sepia_write_all(fd, conn->buffer + conn->offset, written) != 0) {
+			return -1;
+		}
+		conn->offset += written;
+		request->received_body_length += written;
+	}
+
+	if (written < remaining) {
+		ssize_t spliced = splice_body(conn, fd, remaining - written);
+		if (spliced < 0) {
+			// the rest of the body is lost, so the connection cannot be used again
+			conn->keep_alive = 0;
+			return -1;
+		}
+		request->received_body_length += spliced;
+		written += spliced;
+	}
+
+	return written;
+}
+
+static void unmap_body(void * body, void * data)
+{
+	struct tagbstring * string = body;
+
+	munmap(string->data, string->slen);
+}
+
+static int temporary_file()
+{
+	const char * dir = getenv("TMPDIR");
+	int fd;
+
+	if (dir == NULL || * dir == '\0') {
+		dir = "/tmp";
+	}
+
+#ifdef O_TMPFILE
+	// never has a name
+	fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+	if (fd >= 0) {
+		return fd;
+	}
+#endif
+
+	char name[strlen(dir) + 20];
+	strcpy(name, dir);
+	strcat(name, "/sepia-body-XXXXXX");
+
+	fd = mkostemp(name, O_CLOEXEC);
+	if (fd >= 0) {
+		unlink(name);
+	}
+
+	return fd;
+}
+
+bstring sepia_spill_body(struct sepia_request * request)
+{
+	size_t length = request->body_length - request->received_body_length;
+	int fd = temporary_file();
+
+	if (fd < 0) {
+		sepia_log(LOG_ERR, "Could not create a temporary file for a request body.");
+		return NULL;
+	}
+
+	if (sepia_read_to_fd(request, fd) != (ssize_t) length) {
+		close(fd);
+		return NULL;
+	}
+
+	void * data = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (data == MAP_FAILED) {
+		sepia_log(LOG_ERR, "Could not map the temporary file of a request body.");
+		return NULL;
+	}
+
+	struct tagbstring * body = GC_MALLOC(sizeof(struct tagbstring));
+	btfromblk(* body, data, length);
+	GC_REGISTER_FINALIZER(body, &unmap_body, NULL, NULL, NULL);
+
+	return body;
+}
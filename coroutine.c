@@ -0,0 +1,134 @@
+#include <pthread.h>
+#include <ucontext.h>
+
+#include "sepia_internal.h"
+
+/*
+  Coroutines on top of ucontext for the handlers of the epoll loop. The
+  stacks are allocated from the GC heap, so the pointers on the stacks of
+  suspended coroutines keep their objects alive. While a coroutine runs the
+  collector is told that its stack is the stack of the thread, see
+  GC_set_stackbottom().
+
+  Finished coroutines are kept with their stack for the next handler. Every
+  event loop thread runs its own coroutines, so only the pool is shared.
+*/
+
+#define MAX_POOLED 64
+
+struct sepia_coroutine {
+	ucontext_t context;
+	ucontext_t caller;
+	char * stack;
+	size_t stack_size;
+
+	void (* function)(void *);
+	void * data;
+	int finished;
+
+	struct sepia_coroutine * next;
+};
+
+// finished coroutines, reused with their stacks
+static struct sepia_coroutine * pool = NULL;
+static int pooled = 0;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// the running coroutine of the thread, it is also referenced by its connection
+static __thread struct sepia_coroutine * current = NULL;
+
+static __thread void * gc_thread = NULL;
+static __thread struct GC_stack_base thread_stack;
+
+static void * set_stackbottom(void * data)
+{
+	GC_set_stackbottom(gc_thread, (struct GC_stack_base *) data);
+	return NULL;
+}
+
+static void run()
+{
+	struct sepia_coroutine * coroutine = current;
+
+	coroutine->function(coroutine->data);
+	coroutine->finished = 1;
+	// returns to caller through uc_link
+}
+
+// switches into the coroutine until it yields or finishes
+static void switch_to(struct sepia_coroutine * coroutine)
+{
+	struct GC_stack_base stack;
+	stack.mem_base = coroutine->stack + coroutine->stack_size;
+
+	current = coroutine;
+	GC_call_with_alloc_lock(set_stackbottom, &stack);
+	swapcontext(&coroutine->caller, &coroutine->context);
+	GC_call_with_alloc_lock(set_stackbottom, &thread_stack);
+	current = NULL;
+
+	if (coroutine->finished) {
+		coroutine->function = NULL;
+		coroutine->data = NULL;
+
+		pthread_mutex_lock(&pool_lock);
+		if (pooled < MAX_POOLED) {
+			coroutine->next = pool;
+			pool = coroutine;
+			pooled++;
+		}
+		pthread_mutex_unlock(&pool_lock);
+	}
+}
+
+struct sepia_coroutine * sepia_coroutine_start(size_t stack_size, void (* function)(void *), void * data)
+{
+	if (gc_thread == NULL) {
+		gc_thread = GC_get_my_stackbottom(&thread_stack);
+	}
+
+	pthread_mutex_lock(&pool_lock);
+	struct sepia_coroutine * coroutine = pool;
+	if (coroutine != NULL) {
+		pool = coroutine->next;
+		pooled--;
+	}
+	pthread_mutex_unlock(&pool_lock);
+
+	// servers with other stack sizes share the pool, such a stack is dropped
+	if (coroutine == NULL || coroutine->stack_size != stack_size) {
+		coroutine = GC_MALLOC(sizeof(struct sepia_coroutine));
+		coroutine->stack = GC_MALLOC(stack_size);
+		coroutine->stack_size = stack_size;
+	}
+
+	getcontext(&coroutine->context);
+	coroutine->context.uc_stack.ss_sp = coroutine->stack;
+	coroutine->context.uc_stack.ss_size = stack_size;
+	coroutine->context.uc_link = &coroutine->caller;
+	makecontext(&coroutine->context, run, 0);
+
+	coroutine->function = function;
+	coroutine->data = data;
+	coroutine->finished = 0;
+	coroutine->next = NULL;
+
+	switch_to(coroutine);
+	return coroutine->finished ? NULL : coroutine;
+}
+
+int sepia_coroutine_resume(struct sepia_coroutine * coroutine)
+{
+	switch_to(coroutine);
+	return coroutine->finished;
+}
+
+int sepia_coroutine_running()
+{
+	return current != NULL;
+}
+
+void sepia_coroutine_yield()
+{
+	swapcontext(&current->context, &current->caller);
+}
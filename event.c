@@ -0,0 +1,650 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+#include "sepia_internal.h"
+
+/*
+  A single threaded server on top of epoll. Connections are non-blocking,
+  the header and the body of a request are collected per connection and the
+  handler is called when both are complete. The response is collected and
+  written out as the socket accepts it. Connections the protocol keeps alive
+  continue with the next request afterwards.
+
+  With sepia_use_coroutines(), handlers are started as coroutines when the
+  header is complete. They read the body and write the response on the
+  non-blocking socket themselves and are suspended until it is ready.
+
+  Connections with a deferred response (see sepia_mount_async()) are not
+  watched until the response is completed, which passes them back like
+  sepia_event_resume().
+
+  With a hand off function, the loop only collects requests and passes the
+  connection on to somebody else (see scheduler.c), who gives it back with
+  sepia_event_resume().
+
+  With sepia_use_timeouts(), every connection that waits for its socket has
+  a timer in a timer wheel, which is advanced after every epoll_wait(). The
+  header timeout runs from the first wait for a request until its header
+  is parsed, the body and write timeouts start again with every wait.
+
+  When accepting fails with an error like EMFILE, the listening socket
+  stays readable, so it is not watched until the backoff is over.
+*/
+
+#define MAX_EVENTS 64
+#define MAX_ACCEPT 256
+#define OUTPUT_BUFFER_SIZE 4096
+
+#define CONNECTION_READ  0
+#define CONNECTION_WRITE 1
+#define CONNECTION_AWAY  2
+#define CONNECTION_HANDLER 3
+
+struct event_loop;
+
+struct connection {
+	// first member, the requests point to it
+	struct sepia_connection base;
+	struct event_loop * loop;
+
+	int state;
+	uint32_t events;
+
+	// a request waiting for its body
+	struct sepia_request * request;
+	size_t written;
+
+	// the handler of a request, if it is suspended
+	struct sepia_coroutine * coroutine;
+	// the request being handled elsewhere or waiting for sepia_request_complete()
+	struct sepia_request * handled;
+
+	// the timeout of the current wait for the socket
+	struct sepia_timer timer;
+	// when the header of the next request has to be complete, 0 until the connection waits for it
+	int64_t header_deadline;
+};
+
+// the state of one loop, several servers can run a loop each in their own thread
+struct event_loop {
+	struct sepia_server * server;
+	int epoll;
+
+	// epoll only knows the file descriptor, so the connections have to stay reachable for the GC here
+	struct connection ** connections;
+	size_t connections_size;
+
+	void (* hand_off)(struct sepia_request *);
+	int coroutines;
+
+	// NULL if there are no timeouts
+	struct sepia_timer_wheel * wheel;
+
+	// when the listening socket is watched again, 0 while it is
+	int64_t accept_paused;
+	struct sepia_accept_backoff accept_backoff;
+
+	// connections given back by sepia_event_resume(), the loop is woken up by the eventfd
+	struct connection ** resumed;
+	size_t resumed_count;
+	size_t resumed_size;
+	pthread_mutex_t resumed_lock;
+	int wakeup;
+};
+
+static void set_connection(struct event_loop * loop, int socket, struct connection * conn)
+{
+	if (socket >= loop->connections_size) {
+		size_t size = loop->connections_size == 0 ? 1024 : loop->connections_size;
+		while (size <= socket) {
+			size *= 2;
+		}
+		loop->connections = GC_REALLOC(loop->connections, size * sizeof(struct connection *));
+		memset(loop->connections + loop->connections_size, 0, (size - loop->connections_size) * sizeof(struct connection *));
+		loop->connections_size = size;
+	}
+
+	loop->connections[socket] = conn;
+}
+
+static void complete_request(struct sepia_request * request)
+{
+	if (((struct connection *) request->conn)->loop->hand_off != NULL) {
+		// the socket is blocking while the connection is handed off, so the response is sent from here
+		sepia_finish_response(request);
+		request->deferred = 0;
+	}
+
+	sepia_event_resume(request->conn);
+}
+
+static struct connection * add_connection(struct event_loop * loop, int socket)
+{
+	struct connection * conn = GC_MALLOC(sizeof(struct connection));
+
+	sepia_init_connection(&conn->base, loop->server, socket, loop->server->config.read_buffer_size);
+	conn->loop = loop;
+	conn->base.output = bfromcstralloc(OUTPUT_BUFFER_SIZE, "");
+	conn->state = CONNECTION_READ;
+	conn->events = 0;
+	conn->request = NULL;
+	conn->written = 0;
+	conn->coroutine = NULL;
+	conn->handled = NULL;
+	conn->base.complete = complete_request;
+	sepia_timer_init(&conn->timer);
+	conn->header_deadline = 0;
+
+	// the handlers of a hand off write to the blocking socket
+	if (loop->hand_off != NULL && sepia_timeout(SEPIA_TIMEOUT_WRITE) > 0) {
+		sepia_socket_timeout(socket, SEPIA_TIMEOUT_WRITE);
+	}
+
+	set_connection(loop, socket, conn);
+	return conn;
+}
+
+static void cancel_timer(struct connection * conn)
+{
+	if (conn->loop->wheel != NULL) {
+		sepia_timer_cancel(conn->loop->wheel, &conn->timer);
+	}
+}
+
+static void close_connection(struct connection * conn)
+{
+	cancel_timer(conn);
+	conn->loop->connections[conn->base.socket] = NULL;
+	close(conn->base.socket);
+}
+
+// sets the timer of a connection that waits for its socket
+static void arm_timer(struct connection * conn, uint32_t events)
+{
+	int64_t deadline;
+	int phase = events & EPOLLOUT ? SEPIA_TIMEOUT_WRITE
+		: conn->request != NULL || conn->state == CONNECTION_HANDLER ? SEPIA_TIMEOUT_BODY : SEPIA_TIMEOUT_HEADER;
+	int timeout = sepia_timeout(phase);
+
+	if (timeout <= 0) {
+		sepia_timer_cancel(conn->loop->wheel, &conn->timer);
+		return;
+	}
+
+	deadline = sepia_now() + (int64_t) timeout * 1000;
+	if (phase == SEPIA_TIMEOUT_HEADER) {
+		if (conn->header_deadline == 0) {
+			conn->header_deadline = deadline;
+		}
+		deadline = conn->header_deadline;
+	}
+
+	sepia_timer_set(conn->loop->wheel, &conn->timer, deadline);
+}
+
+static void watch(struct connection * conn, uint32_t events)
+{
+	if (conn->loop->wheel != NULL) {
+		arm_timer(conn, events);
+	}
+
+	if (conn->events != events) {
+		struct epoll_event event;
+		event.events = events;
+		event.data.fd = conn->base.socket;
+		epoll_ctl(conn->loop->epoll, conn->events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, conn->base.socket, &event);
+		conn->events = events;
+	}
+}
+
+// returns 1 if everything is written, 0 if the socket is full and -1 on errors
+static int write_output(struct connection * conn)
+{
+	bstring output = conn->base.output;
+
+	while (conn->written < blength(output)) {
+		ssize_t sent = send(conn->base.socket, bdata(output) + conn->written, blength(output) - conn->written, MSG_NOSIGNAL);
+		if (sent >= 0) {
+			conn->written += sent;
+		} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			return 0;
+		} else if (errno != EINTR) {
+			return -1;
+		}
+	}
+
+	btrunc(output, 0);
+	conn->written = 0;
+	return 1;
+}
+
+static int body_complete(struct connection * conn)
+{
+	struct sepia_request * request = conn->request;
+
+	return request->body != NULL || request->body_length <= 0
+		|| conn->base.length - conn->base.offset >= request->body_length;
+}
+
+// suspends the handler of the connection until the socket is ready or the connection timed out
+static int wait_for_socket(struct sepia_connection * base, int writing)
+{
+	watch((struct connection *) base, writing ? EPOLLOUT : EPOLLIN);
+	sepia_coroutine_yield();
+	return base->timed_out ? -1 : 0;
+}
+
+static void run_handler(void * data)
+{
+	struct connection * conn = (struct connection *) data;
+
+	// what the protocol has collected so far goes first
+	bstring output = conn->base.output;
+	conn->base.output = NULL;
+	sepia_connection_send(&conn->base, bdata(output) + conn->written, blength(output) - conn->written);
+	conn->written = 0;
+
+	if (handle_request(conn->handled)) {
+		conn->handled = NULL;
+	}
+}
+
+// the response is deferred, the connection waits for sepia_request_complete()
+static void park(struct connection * conn, struct sepia_request * request)
+{
+	cancel_timer(conn);
+	if (conn->events != 0) {
+		epoll_ctl(conn->loop->epoll, EPOLL_CTL_DEL, conn->base.socket, NULL);
+		conn->events = 0;
+	}
+	conn->handled = request;
+	conn->state = CONNECTION_AWAY;
+}
+
+// returns 1 if the response is deferred
+static int handler_finished(struct connection * conn)
+{
+	conn->coroutine = NULL;
+	conn->base.wait = NULL;
+	conn->base.output = bfromcstralloc(OUTPUT_BUFFER_SIZE, "");
+
+	if (conn->handled != NULL) {
+		park(conn, conn->handled);
+		return 1;
+	}
+
+	conn->state = CONNECTION_WRITE;
+	return 0;
+}
+
+// returns 1 if the connection was handed off, its handler is suspended or the response is deferred
+static int dispatch(struct connection * conn)
+{
+	struct event_loop * loop = conn->loop;
+	struct sepia_request * request = conn->request;
+	int complete = body_complete(conn);
+	conn->request = NULL;
+
+	if (loop->coroutines && !complete) {
+		// the handler reads the body from the socket
+	} else if (request->body == NULL && request->body_length > 0) {
+		request->body = GC_MALLOC(sizeof(struct tagbstring));
+		blk2tbstr(* (request->body), conn->base.buffer + conn->base.offset, request->body_length);
+		conn->base.offset += request->body_length;
+	}
+
+	if (loop->hand_off != NULL) {
+		cancel_timer(conn);
+		epoll_ctl(loop->epoll, EPOLL_CTL_DEL, conn->base.socket, NULL);
+		fcntl(conn->base.socket, F_SETFL, fcntl(conn->base.socket, F_GETFL) & ~O_NONBLOCK);
+
+		// the handler writes to the socket directly, send what the protocol has collected so far
+		bstring output = conn->base.output;
+		conn->base.output = NULL;
+		sepia_connection_send(&conn->base, bdata(output) + conn->written, blength(output) - conn->written);
+		conn->written = 0;
+
+		conn->state = CONNECTION_AWAY;
+		conn->events = 0;
+		conn->handled = request;
+		loop->hand_off(request);
+		return 1;
+	}
+
+	if (loop->coroutines) {
+		conn->handled = request;
+		conn->base.wait = wait_for_socket;
+		conn->state = CONNECTION_HANDLER;
+		conn->coroutine = sepia_coroutine_start(loop->server->config.coroutine_stack_size, run_handler, conn);
+
+		if (conn->coroutine != NULL) {
+			return 1;
+		}
+		return handler_finished(conn);
+	}
+
+	if (!handle_request(request)) {
+		park(conn, request);
+		return 1;
+	}
+
+	conn->state = CONNECTION_WRITE;
+	return 0;
+}
+
+static void process(struct connection * conn)
+{
+	while (1) {
+		if (conn->state == CONNECTION_HANDLER) {
+			if (!sepia_coroutine_resume(conn->coroutine) || handler_finished(conn)) {
+				return;
+			}
+		}
+
+		if (conn->state == CONNECTION_WRITE) {
+			if (conn->base.timed_out) {
+				close_connection(conn);
+				return;
+			}
+
+			int written = write_output(conn);
+
+			if (written == 0) {
+				watch(conn, EPOLLOUT);
+				return;
+			}
+			if (written < 0 || !conn->base.keep_alive) {
+				if (written > 0) {
+					sepia_connection_discard(&conn->base);
+				}
+				close_connection(conn);
+				return;
+			}
+			conn->state = CONNECTION_READ;
+		}
+
+		if (conn->request == NULL) {
+			int error = 0;
+			conn->request = conn->base.protocol->parse(&conn->base, &error);
+			if (conn->request != NULL) {
+				conn->header_deadline = 0;
+			}
+
+			if (error || (conn->request != NULL && !sepia_request_valid(conn->request))) {
+				sepia_log(LOG_ERR, "Could not read a request.");
+				// an error status of the protocol is still sent, then the connection is closed
+				if (blength(conn->base.output) > 0) {
+					conn->request = NULL;
+					conn->base.keep_alive = 0;
+					conn->state = CONNECTION_WRITE;
+					continue;
+				}
+				close_connection(conn);
+				return;
+			}
+		}
+
+		if (conn->request != NULL) {
+			if (conn->loop->coroutines || body_complete(conn)) {
+				if (dispatch(conn)) {
+					return;
+				}
+				continue;
+			}
+
+			// a shed request is answered before its body is received, the connection is closed then
+			if (!sepia_admit_request(conn->request)) {
+				conn->request = NULL;
+				conn->state = CONNECTION_WRITE;
+				continue;
+			}
+			sepia_connection_reserve(&conn->base, conn->request->body_length);
+
+			// interim answers of the protocol, like HTTP 100 Continue
+			if (blength(conn->base.output) > 0 && write_output(conn) < 0) {
+				close_connection(conn);
+				return;
+			}
+
+		} else if (blength(conn->base.output) > 0) {
+			// the protocol has answered something on its own
+			conn->state = CONNECTION_WRITE;
+			continue;
+
+		} else if (conn->base.length - conn->base.offset >= conn->base.server->config.max_header_size) {
+			sepia_log(LOG_ERR, "Could not read a request.");
+			close_connection(conn);
+			return;
+		}
+
+		int received = sepia_connection_receive(&conn->base);
+
+		if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			watch(conn, EPOLLIN);
+			return;
+		} else if (received == 0 || (received < 0 && errno != EINTR)) {
+			close_connection(conn);
+			return;
+		}
+	}
+}
+
+void sepia_event_resume(struct sepia_connection * conn)
+{
+	struct event_loop * loop = ((struct connection *) conn)->loop;
+
+	pthread_mutex_lock(&loop->resumed_lock);
+
+	if (loop->resumed_count == loop->resumed_size) {
+		loop->resumed_size = loop->resumed_size == 0 ? 64 : loop->resumed_size * 2;
+		loop->resumed = GC_REALLOC(loop->resumed, loop->resumed_size * sizeof(struct connection *));
+	}
+	loop->resumed[loop->resumed_count++] = (struct connection *) conn;
+
+	pthread_mutex_unlock(&loop->resumed_lock);
+
+	uint64_t one = 1;
+	write(loop->wakeup, &one, sizeof(one));
+}
+
+static void resume_connections(struct event_loop * loop)
+{
+	uint64_t count;
+	read(loop->wakeup, &count, sizeof(count));
+
+	pthread_mutex_lock(&loop->resumed_lock);
+	size_t i, n = loop->resumed_count;
+	struct connection * list[n];
+	memcpy(list, loop->resumed, n * sizeof(struct connection *));
+	memset(loop->resumed, 0, n * sizeof(struct connection *));
+	loop->resumed_count = 0;
+	pthread_mutex_unlock(&loop->resumed_lock);
+
+	for (i = 0; i < n; i++) {
+		struct connection * conn = list[i];
+		struct sepia_request * request = conn->handled;
+		conn->handled = NULL;
+
+		if (conn->base.output == NULL) {
+			// back from the hand off
+			fcntl(conn->base.socket, F_SETFL, fcntl(conn->base.socket, F_GETFL) | O_NONBLOCK);
+			conn->base.output = bfromcstralloc(OUTPUT_BUFFER_SIZE, "");
+		}
+
+		if (request != NULL && request->deferred) {
+			sepia_finish_response(request);
+			request->deferred = 0;
+		}
+
+		// closes the connection if it is not kept alive
+		conn->state = CONNECTION_WRITE;
+		process(conn);
+	}
+}
+
+static void expire(struct sepia_timer * timer)
+{
+	struct connection * conn = (struct connection *) ((char *) timer - offsetof(struct connection, timer));
+
+	sepia_connection_expired(&conn->base);
+
+	if (conn->state == CONNECTION_HANDLER) {
+		// the suspended handler sees failing reads and sends and finishes
+		process(conn);
+	} else {
+		close_connection(conn);
+	}
+}
+
+static void accept_connections(struct event_loop * loop, int sock)
+{
+	int socket, i, n = 0;
+	struct connection * accepted[MAX_ACCEPT];
+
+	// accept the pending connections first, so the time they wait for the others counts as queueing delay
+	while (n < MAX_ACCEPT && (socket = accept4(sock, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+		accepted[n++] = add_connection(loop, socket);
+	}
+
+	if (n > 0) {
+		loop->accept_backoff.delay = 0;
+	}
+	if (n < MAX_ACCEPT && !sepia_accept_transient(errno)) {
+		loop->accept_paused = sepia_now() + sepia_accept_failed(&loop->accept_backoff, errno);
+		epoll_ctl(loop->epoll, EPOLL_CTL_DEL, sock, NULL);
+	}
+
+	for (i = 0; i < n; i++) {
+		process(accepted[i]);
+	}
+}
+
+static void watch_socket(struct event_loop * loop, int socket)
+{
+	struct epoll_event event;
+	event.events = EPOLLIN;
+	event.data.fd = socket;
+	epoll_ctl(loop->epoll, EPOLL_CTL_ADD, socket, &event);
+}
+
+// the timeout of epoll_wait() in milliseconds, -1 for none
+static int wait_timeout(struct event_loop * loop)
+{
+	// wake up every tick while there are timers
+	int timeout = loop->wheel != NULL && sepia_timer_count(loop->wheel) > 0 ? SEPIA_TIMER_TICK / 1000 : -1;
+
+	if (loop->accept_paused != 0) {
+		int64_t left = loop->accept_paused - sepia_now();
+		int paused = left > 0 ? (int) ((left + 999) / 1000) : 0;
+
+		if (timeout < 0 || paused < timeout) {
+			timeout = paused;
+		}
+	}
+
+	return timeout;
+}
+
+int sepia_event_loop(struct sepia_server * server, int sock, void (* handler)(struct sepia_request *))
+{
+	struct event_loop * loop = GC_MALLOC(sizeof(struct event_loop));
+
+	loop->epoll = epoll_create1(0);
+	if (loop->epoll < 0) {
+		return SEPIA_ERROR_SOCKET;
+	}
+
+	loop->wakeup = eventfd(0, EFD_NONBLOCK);
+	if (loop->wakeup < 0) {
+		close(loop->epoll);
+		return SEPIA_ERROR_SOCKET;
+	}
+
+	loop->server = server;
+	loop->connections = NULL;
+	loop->connections_size = 0;
+	loop->hand_off = handler;
+	loop->coroutines = handler == NULL && server->config.coroutine_stack_size > 0;
+	loop->wheel = NULL;
+	loop->accept_paused = 0;
+	memset(&loop->accept_backoff, 0, sizeof(loop->accept_backoff));
+	loop->resumed = NULL;
+	loop->resumed_count = 0;
+	loop->resumed_size = 0;
+	pthread_mutex_init(&loop->resumed_lock, NULL);
+
+	if (sepia_timeout(SEPIA_TIMEOUT_HEADER) > 0 || sepia_timeout(SEPIA_TIMEOUT_BODY) > 0 || sepia_timeout(SEPIA_TIMEOUT_WRITE) > 0) {
+		loop->wheel = sepia_timer_wheel_create(sepia_now());
+	}
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+
+	watch_socket(loop, sock);
+	watch_socket(loop, loop->wakeup);
+
+	struct epoll_event events[MAX_EVENTS];
+
+	while (1) {
+		int i, n = epoll_wait(loop->epoll, events, MAX_EVENTS, wait_timeout(loop));
+
+		if (n < 0 && errno != EINTR) {
+			sepia_log(LOG_ERR, "Waiting for events failed.");
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			int fd = events[i].data.fd;
+
+			if (fd == sock) {
+				accept_connections(loop, sock);
+			} else if (fd == loop->wakeup) {
+				resume_connections(loop);
+			} else if (fd < loop->connections_size && loop->connections[fd] != NULL) {
+				process(loop->connections[fd]);
+			}
+		}
+
+		if (loop->wheel != NULL) {
+			sepia_timer_advance(loop->wheel, sepia_now(), expire);
+		}
+
+		if (loop->accept_paused != 0 && sepia_now() >= loop->accept_paused) {
+			loop->accept_paused = 0;
+			watch_socket(loop, sock);
+		}
+	}
+
+	close(loop->wakeup);
+	close(loop->epoll);
+	pthread_mutex_destroy(&loop->resumed_lock);
+	return SEPIA_OK;
+}
+
+int sepia_run_event(struct sepia_server * server, char * ip, int port)
+{
+	int sock;
+	int result = sepia_open_socket(server, ip, port, 0, &sock);
+
+	if (result != SEPIA_OK) {
+		return result;
+	}
+
+#ifdef HAVE_LINUX_IO_URING_H
+	// the coroutines wait for the socket with epoll
+	result = server->config.coroutine_stack_size > 0 ? -1 : sepia_uring_loop(server, sock);
+	if (result < 0)
+#endif
+	result = sepia_event_loop(server, sock, NULL);
+
+	close(sock);
+	return result;
+}
@@ -0,0 +1,322 @@
+#include <string.h>
+
+#include "sepia_internal.h"
+
+/*
+  The FastCGI responder role. The records of a connection are read one after
+  another, the params and stdin streams are collected per request id and a
+  request is handled when its stdin stream is complete. So the requests of a
+  multiplexed connection are separated, but handled one after another. The
+  response is send in stdout records, the connection is kept open if the
+  webserver has asked for it with FCGI_KEEP_CONN. As the streams are kept
+  in memory, the connection is closed when they exceed max_header_size or
+  max_body_size, or when it opens more than FCGI_MAX_PENDING requests.
+*/
+
+#define FCGI_VERSION_1     1
+#define FCGI_HEADER_SIZE   8
+#define FCGI_MAX_CONTENT   65535
+
+// the requests of a connection of which not all records have been received yet
+#define FCGI_MAX_PENDING   16
+
+#define FCGI_BEGIN_REQUEST     1
+#define FCGI_ABORT_REQUEST     2
+#define FCGI_END_REQUEST       3
+#define FCGI_PARAMS            4
+#define FCGI_STDIN             5
+#define FCGI_STDOUT            6
+#define FCGI_GET_VALUES        9
+#define FCGI_GET_VALUES_RESULT 10
+#define FCGI_UNKNOWN_TYPE      11
+
+#define FCGI_KEEP_CONN  1
+#define FCGI_RESPONDER  1
+
+#define FCGI_REQUEST_COMPLETE 0
+#define FCGI_UNKNOWN_ROLE     3
+
+struct tagbstring FCGI_MAX_CONNS = bsStatic("FCGI_MAX_CONNS");
+struct tagbstring FCGI_MAX_REQS = bsStatic("FCGI_MAX_REQS");
+struct tagbstring FCGI_MPXS_CONNS = bsStatic("FCGI_MPXS_CONNS");
+
+// a request of which not all records have been received yet
+struct pending {
+	int id;
+	int keep_conn;
+	bstring params;
+	bstring body;
+	struct pending * next;
+};
+
+static void append_record(bstring records, int type, int id, const void * content, size_t length)
+{
+	unsigned char header[FCGI_HEADER_SIZE] = {
+		FCGI_VERSION_1, type, (id >> 8) & 0xff, id & 0xff, (length >> 8) & 0xff, length & 0xff, 0, 0
+	};
+
+	bcatblk(records, header, FCGI_HEADER_SIZE);
+	if (length > 0) {
+		bcatblk(records, content, length);
+	}
+}
+
+static void send_record(struct sepia_connection * conn, int type, int id, const void * content, size_t length)
+{
+	bstring record = bfromcstralloc(FCGI_HEADER_SIZE + length, "");
+	append_record(record, type, id, content, length);
+	sepia_connection_send(conn, bdata(record), blength(record));
+}
+
+static void send_end_request(struct sepia_connection * conn, int id, int protocol_status)
+{
+	unsigned char content[8] = { 0, 0, 0, 0, protocol_status, 0, 0, 0 };
+	send_record(conn, FCGI_END_REQUEST, id, content, sizeof(content));
+}
+
+// read a name or value length of a name-value pair, returns 0 if there is not enough data
+static int read_length(unsigned char ** p, unsigned char * end, size_t * length)
+{
+	if (* p >= end) {
+		return 0;
+	}
+
+	if ((** p & 0x80) == 0) {
+		* length = ** p;
+		(* p)++;
+		return 1;
+	}
+
+	if (end - * p < 4) {
+		return 0;
+	}
+
+	* length = ((size_t) ((* p)[0] & 0x7f) << 24) | ((* p)[1] << 16) | ((* p)[2] << 8) | (* p)[3];
+	* p += 4;
+	return 1;
+}
+
+static void append_length(bstring b, size_t length)
+{
+	if (length < 0x80) {
+		unsigned char c = length;
+		bcatblk(b, &c, 1);
+	} else {
+		unsigned char c[4] = { ((length >> 24) & 0x7f) | 0x80, (length >> 16) & 0xff, (length >> 8) & 0xff, length & 0xff };
+		bcatblk(b, c, 4);
+	}
+}
+
+// decode name-value pairs into a list of name, value, name, ...
+static struct bstrList * decode_pairs(const unsigned char * data, size_t length)
+{
+	unsigned char * p = (unsigned char *) data;
+	unsigned char * end = p + length;
+	struct bstrList * pairs = bstrListCreate();
+
+	while (p < end) {
+		size_t name_length, value_length;
+
+		if (!read_length(&p, end, &name_length) || !read_length(&p, end, &value_length)
+			|| end - p < name_length + value_length) {
+			return NULL;
+		}
+
+		if (pairs->qty + 2 > pairs->mlen) {
+			bstrListAlloc(pairs, pairs->mlen * 2 + 2);
+		}
+		pairs->entry[pairs->qty++] = blk2bstr(p, name_length);
+		pairs->entry[pairs->qty++] = blk2bstr(p + name_length, value_length);
+		p += name_length + value_length;
+	}
+
+	return pairs;
+}
+
+static void append_pair(bstring b, const_bstring name, const char * value)
+{
+	append_length(b, blength(name));
+	append_length(b, strlen(value));
+	bconcat(b, name);
+	bcatcstr(b, value);
+}
+
+static void send_values(struct sepia_connection * conn, const unsigned char * content, size_t length)
+{
+	size_t i;
+	struct bstrList * names = decode_pairs(content, length);
+	bstring values = bfromcstr("");
+
+	for (i = 0; names != NULL && i < names->qty; i += 2) {
+		if (biseq(names->entry[i], &FCGI_MAX_CONNS)) {
+			append_pair(values, &FCGI_MAX_CONNS, "1000");
+		} else if (biseq(names->entry[i], &FCGI_MAX_REQS)) {
+			append_pair(values, &FCGI_MAX_REQS, "1000");
+		} else if (biseq(names->entry[i], &FCGI_MPXS_CONNS)) {
+			append_pair(values, &FCGI_MPXS_CONNS, "1");
+		}
+	}
+
+	send_record(conn, FCGI_GET_VALUES_RESULT, 0, bdata(values), blength(values));
+}
+
+static struct pending * find_pending(struct sepia_connection * conn, int id, int * count)
+{
+	struct pending * p;
+
+	for (* count = 0, p = conn->state; p != NULL; p = p->next, (* count)++) {
+		if (p->id == id) {
+			return p;
+		}
+	}
+
+	return NULL;
+}
+
+static void remove_pending(struct sepia_connection * conn, struct pending * pending)
+{
+	struct pending ** p;
+
+	for (p = (struct pending **) &conn->state; * p != NULL; p = &(* p)->next) {
+		if (* p == pending) {
+			* p = pending->next;
+			return;
+		}
+	}
+}
+
+static struct sepia_request * create_request(struct sepia_connection * conn, struct pending * pending, int * error)
+{
+	struct bstrList * headers = decode_pairs((unsigned char *) bdata(pending->params), blength(pending->params));
+
+	if (headers == NULL) {
+		* error = 1;
+		return NULL;
+	}
+
+	struct sepia_request * request = sepia_new_request(conn, headers);
+	request->id = pending->id;
+	// the body is read from stdin, never from the connection
+	request->body = pending->body;
+	request->body_length = blength(pending->body);
+
+	conn->keep_alive = pending->keep_conn;
+	return request;
+}
+
+static struct sepia_request * fcgi_parse(struct sepia_connection * conn, int * error)
+{
+	while (conn->length - conn->offset >= FCGI_HEADER_SIZE) {
+		unsigned char * header = (unsigned char *) conn->buffer + conn->offset;
+		int type = header[1];
+		int id = (header[2] << 8) | header[3];
+		size_t length = (header[4] << 8) | header[5];
+		size_t record_length = FCGI_HEADER_SIZE + length + header[6];
+
+		if (header[0] != FCGI_VERSION_1) {
+			* error = 1;
+			return NULL;
+		}
+
+		if (conn->length - conn->offset < record_length) {
+			sepia_connection_reserve(conn, record_length);
+			return NULL;
+		}
+
+		const struct sepia_server_config * config = &conn->server->config;
+		unsigned char * content = header + FCGI_HEADER_SIZE;
+		int count;
+		struct pending * pending = find_pending(conn, id, &count);
+		conn->offset += record_length;
+
+		if (type == FCGI_BEGIN_REQUEST) {
+			if (length < 8 || pending != NULL || count >= FCGI_MAX_PENDING) {
+				* error = 1;
+				return NULL;
+			}
+			if (((content[0] << 8) | content[1]) != FCGI_RESPONDER) {
+				send_end_request(conn, id, FCGI_UNKNOWN_ROLE);
+				continue;
+			}
+			pending = GC_MALLOC(sizeof(struct pending));
+			pending->id = id;
+			pending->keep_conn = content[2] & FCGI_KEEP_CONN;
+			pending->params = bfromcstr("");
+			pending->body = NULL;
+			pending->next = conn->state;
+			conn->state = pending;
+
+		} else if (type == FCGI_ABORT_REQUEST) {
+			if (pending != NULL) {
+				remove_pending(conn, pending);
+				send_end_request(conn, id, FCGI_REQUEST_COMPLETE);
+			}
+
+		} else if (type == FCGI_PARAMS) {
+			if (pending != NULL) {
+				// the streams are collected in memory, so their limits are checked with every record
+				if ((size_t) blength(pending->params) + length > config->max_header_size) {
+					* error = 1;
+					return NULL;
+				}
+				bcatblk(pending->params, content, length);
+			}
+
+		} else if (type == FCGI_STDIN) {
+			if (pending == NULL) {
+				continue;
+			}
+			if (length > 0) {
+				size_t received = pending->body == NULL ? 0 : (size_t) blength(pending->body);
+				if (config->max_body_size > 0 && received + length > config->max_body_size) {
+					* error = 1;
+					return NULL;
+				}
+				if (pending->body == NULL) {
+					pending->body = bfromcstralloc(length, "");
+				}
+				bcatblk(pending->body, content, length);
+			} else {
+				remove_pending(conn, pending);
+				return create_request(conn, pending, error);
+			}
+
+		} else if (type == FCGI_GET_VALUES) {
+			send_values(conn, content, length);
+
+		} else if (id == 0) {
+			unsigned char unknown[8] = { type, 0, 0, 0, 0, 0, 0, 0 };
+			send_record(conn, FCGI_UNKNOWN_TYPE, 0, unknown, sizeof(unknown));
+		}
+	}
+
+	return NULL;
+}
+
+static void fcgi_flush(struct sepia_request * request, int last)
+{
+	bstring output = request->output;
+	size_t offset = 0, length = blength(output);
+	bstring records = bfromcstralloc(length + 3 * FCGI_HEADER_SIZE + 8, "");
+
+	while (offset < length) {
+		size_t chunk = length - offset > FCGI_MAX_CONTENT ? FCGI_MAX_CONTENT : length - offset;
+		append_record(records, FCGI_STDOUT, request->id, bdata(output) + offset, chunk);
+		offset += chunk;
+	}
+
+	if (last) {
+		unsigned char end[8] = { 0, 0, 0, 0, FCGI_REQUEST_COMPLETE, 0, 0, 0 };
+		append_record(records, FCGI_STDOUT, request->id, NULL, 0);
+		append_record(records, FCGI_END_REQUEST, request->id, end, sizeof(end));
+	}
+
+	sepia_connection_send(request->conn, bdata(records), blength(records));
+	btrunc(output, 0);
+}
+
+const struct sepia_protocol sepia_fcgi_protocol = {
+	fcgi_parse,
+	sepia_cgi_send_status,
+	fcgi_flush
+};
@@ -0,0 +1,186 @@
+#include "sepia_test.h"
+
+/*
+  The FastCGI records of fcgi.c: params and stdin collected per request id,
+  multiplexed requests, management records and the limits of the streams.
+*/
+
+#define FCGI_BEGIN_REQUEST     1
+#define FCGI_ABORT_REQUEST     2
+#define FCGI_END_REQUEST       3
+#define FCGI_PARAMS            4
+#define FCGI_STDIN             5
+#define FCGI_GET_VALUES        9
+#define FCGI_GET_VALUES_RESULT 10
+#define FCGI_UNKNOWN_TYPE      11
+
+static void record(bstring records, int type, int id, const void * content, size_t length)
+{
+	unsigned char header[8] = { 1, type, id >> 8, id & 0xff, length >> 8, length & 0xff, 0, 0 };
+
+	bcatblk(records, header, 8);
+	bcatblk(records, content, length);
+}
+
+static void begin(bstring records, int id, int keep_conn)
+{
+	unsigned char body[8] = { 0, 1, keep_conn, 0, 0, 0, 0, 0 };
+	record(records, FCGI_BEGIN_REQUEST, id, body, 8);
+}
+
+// one name-value pair with short lengths
+static void param(bstring records, int id, const char * name, const char * value)
+{
+	bstring pair = bfromcstr("");
+	unsigned char lengths[2] = { strlen(name), strlen(value) };
+
+	bcatblk(pair, lengths, 2);
+	bcatcstr(pair, name);
+	bcatcstr(pair, value);
+	record(records, FCGI_PARAMS, id, bdata(pair), blength(pair));
+}
+
+static struct sepia_request * parse(struct sepia_connection * conn, int * error)
+{
+	* error = 0;
+	return conn->protocol->parse(conn, error);
+}
+
+static void single_request()
+{
+	bstring records = bfromcstr("");
+	begin(records, 1, 1);
+	param(records, 1, "REQUEST_METHOD", "POST");
+	param(records, 1, "PATH_INFO", "/a/b");
+	record(records, FCGI_PARAMS, 1, NULL, 0);
+	record(records, FCGI_STDIN, 1, "hello ", 6);
+	record(records, FCGI_STDIN, 1, "world", 5);
+	record(records, FCGI_STDIN, 1, NULL, 0);
+
+	struct sepia_server * server = test_server(SEPIA_PROTOCOL_FCGI);
+	struct sepia_connection * conn = test_connection(server, -1, bdata(records), blength(records) - 1);
+	int error;
+
+	// the last byte is missing
+	CHECK(parse(conn, &error) == NULL && error == 0);
+
+	test_receive(conn, bdata(records) + blength(records) - 1, 1);
+	struct sepia_request * request = parse(conn, &error);
+
+	CHECK(request != NULL && error == 0);
+	CHECK(request->id == 1);
+	CHECK(conn->keep_alive);
+	CHECK_STRING(sepia_request_attr(request, SEPIA_ATTR_REQUEST_METHOD), "POST");
+	CHECK(request->path != NULL && request->path->qty == 3);
+	CHECK_STRING(sepia_read_string(request), "hello world");
+	CHECK(conn->offset == conn->length);
+}
+
+static void multiplexed()
+{
+	bstring records = bfromcstr("");
+	begin(records, 1, 0);
+	begin(records, 2, 0);
+	param(records, 2, "PATH_INFO", "/two");
+	param(records, 1, "PATH_INFO", "/one");
+	record(records, FCGI_PARAMS, 1, NULL, 0);
+	record(records, FCGI_PARAMS, 2, NULL, 0);
+	record(records, FCGI_STDIN, 2, "2", 1);
+	record(records, FCGI_STDIN, 1, "1", 1);
+	record(records, FCGI_STDIN, 2, NULL, 0);
+	record(records, FCGI_STDIN, 1, NULL, 0);
+
+	struct sepia_connection * conn = test_connection(test_server(SEPIA_PROTOCOL_FCGI), -1, bdata(records), blength(records));
+	int error;
+
+	// in the order their stdin is complete
+	struct sepia_request * request = parse(conn, &error);
+	CHECK(request != NULL && request->id == 2);
+	CHECK(request != NULL && biseqcstr(request->body, "2"));
+	CHECK(!conn->keep_alive);
+
+	request = parse(conn, &error);
+	CHECK(request != NULL && request->id == 1);
+	CHECK_STRING(sepia_request_attr(request, SEPIA_ATTR_PATH_INFO), "/one");
+
+	CHECK(parse(conn, &error) == NULL && error == 0);
+}
+
+static void management()
+{
+	struct tagbstring max_conns = bsStatic("FCGI_MAX_CONNS");
+	bstring records = bfromcstr("");
+	unsigned char names[] = { 14, 0, 'F', 'C', 'G', 'I', '_', 'M', 'A', 'X', '_', 'C', 'O', 'N', 'N', 'S' };
+	record(records, FCGI_GET_VALUES, 0, names, sizeof(names));
+	record(records, 99, 0, NULL, 0);
+
+	// an aborted request is ended, not handled
+	begin(records, 3, 1);
+	record(records, FCGI_ABORT_REQUEST, 3, NULL, 0);
+	record(records, FCGI_STDIN, 3, NULL, 0);
+
+	struct sepia_connection * conn = test_connection(test_server(SEPIA_PROTOCOL_FCGI), -1, bdata(records), blength(records));
+	int error;
+
+	CHECK(parse(conn, &error) == NULL && error == 0);
+
+	unsigned char * output = (unsigned char *) bdata(conn->output);
+	CHECK(blength(conn->output) >= 8 && output[1] == FCGI_GET_VALUES_RESULT);
+	CHECK(binstr(conn->output, 0, &max_conns) != BSTR_ERR);
+
+	size_t second = 8 + ((output[4] << 8) | output[5]) + output[6];
+	CHECK(blength(conn->output) > second + 8 && output[second + 1] == FCGI_UNKNOWN_TYPE && output[second + 8] == 99);
+
+	size_t third = second + 16;
+	CHECK(blength(conn->output) == third + 16 && output[third + 1] == FCGI_END_REQUEST && output[third + 3] == 3);
+}
+
+static void limits()
+{
+	struct sepia_server_config config;
+	sepia_server_config_init(&config);
+	config.protocol = SEPIA_PROTOCOL_FCGI;
+	config.max_header_size = 64;
+	config.max_body_size = 10;
+	struct sepia_server * server = sepia_server_create(&config);
+	char large[100];
+	int error, id;
+
+	memset(large, 'x', sizeof(large));
+
+	bstring records = bfromcstr("");
+	begin(records, 1, 0);
+	record(records, FCGI_PARAMS, 1, large, sizeof(large));
+	CHECK(parse(test_connection(server, -1, bdata(records), blength(records)), &error) == NULL && error != 0);
+
+	records = bfromcstr("");
+	begin(records, 1, 0);
+	record(records, FCGI_PARAMS, 1, NULL, 0);
+	record(records, FCGI_STDIN, 1, large, 6);
+	record(records, FCGI_STDIN, 1, large, 6);
+	CHECK(parse(test_connection(server, -1, bdata(records), blength(records)), &error) == NULL && error != 0);
+
+	// the requests of a connection that are not complete yet
+	records = bfromcstr("");
+	for (id = 1; id <= 17; id++) {
+		begin(records, id, 0);
+	}
+	CHECK(parse(test_connection(server, -1, bdata(records), blength(records)), &error) == NULL && error != 0);
+
+	records = bfromcstr("");
+	record(records, FCGI_STDIN, 1, NULL, 0);
+	bdata(records)[0] = 2;
+	CHECK(parse(test_connection(server, -1, bdata(records), blength(records)), &error) == NULL && error != 0);
+}
+
+int main()
+{
+	sepia_init();
+
+	single_request();
+	multiplexed();
+	management();
+	limits();
+
+	return test_result("fcgi");
+}
@@ -0,0 +1,254 @@
+#include <string.h>
+
+#include "jsonsl.h"
+#include "sepia_internal.h"
+
+/*
+  application/x-www-form-urlencoded bodies. Every read is percent-decoded
+  where it is, with the decoder of the query string, into one block that
+  holds the names and values, the body itself is never copied. Only an
+  escape cut off by the end of a read is kept for the next one. When the
+  body is complete, the pairs are appended to the BSON document, the
+  values of a name that occurs more than once as an array.
+*/
+
+struct form_pair {
+	size_t name;
+	size_t name_length;
+	size_t value;
+	size_t value_length;
+
+	// the next pair with the same name, 0 for none
+	size_t next;
+	// the number of pairs with the name, 0 if it is not the first of them
+	size_t count;
+};
+
+struct form_state {
+	// the decoded names and values, never longer than the body
+	char * text;
+	size_t used;
+
+	struct form_pair * pair;
+	size_t count;
+	size_t size;
+
+	// the current pair is in the value
+	int in_value;
+	int malformed;
+};
+
+static void begin_pair(struct form_state * state)
+{
+	if (state->count == state->size) {
+		size_t size = state->size == 0 ? 16 : state->size * 2;
+		struct form_pair * pair = GC_MALLOC_ATOMIC(size * sizeof(struct form_pair));
+		if (state->count > 0) {
+			memcpy(pair, state->pair, state->count * sizeof(struct form_pair));
+		}
+		state->pair = pair;
+		state->size = size;
+	}
+
+	struct form_pair * pair = &state->pair[state->count];
+	pair->name = state->used;
+	pair->name_length = 0;
+	pair->value = state->used;
+	pair->value_length = 0;
+	state->in_value = 0;
+}
+
+static void decode(struct form_state * state, const char * data, size_t length)
+{
+	struct form_pair * pair = &state->pair[state->count];
+	size_t decoded = sepia_url_decode(data, length, state->text + state->used, &state->malformed);
+
+	state->used += decoded;
+	if (state->in_value) {
+		pair->value_length += decoded;
+	} else {
+		pair->name_length += decoded;
+		pair->value = state->used;
+	}
+}
+
+// empty pairs, as in a&&b, are skipped
+static void end_pair(struct form_state * state)
+{
+	struct form_pair * pair = &state->pair[state->count];
+
+	if (pair->name_length > 0 || state->in_value) {
+		state->count++;
+	}
+	begin_pair(state);
+}
+
+// decodes data up to an escape that may go on in the next read, returns the number of bytes used
+static size_t feed(struct form_state * state, const char * data, size_t length, int last)
+{
+	const char * start = data, * end = data + length;
+
+	while (start < end) {
+		const char * next = start;
+
+		while (next < end && * next != '&' && (state->in_value || * next != '=')) {
+			next++;
+		}
+
+		if (next == end && !last) {
+			if (end - start >= 1 && end[-1] == '%') {
+				next = end - 1;
+			} else if (end - start >= 2 && end[-2] == '%') {
+				next = end - 2;
+			}
+			decode(state, start, next - start);
+			return next - data;
+		}
+
+		decode(state, start, next - start);
+		if (next == end) {
+			return length;
+		}
+
+		if (* next == '=') {
+			state->in_value = 1;
+		} else {
+			end_pair(state);
+		}
+		start = next + 1;
+	}
+
+	return length;
+}
+
+static int group_pairs(struct form_state * state)
+{
+	size_t i, size = 2;
+
+	while (size < state->count * 2) {
+		size *= 2;
+	}
+
+	// the first pair of every name, by the hash of the name
+	size_t * first = GC_MALLOC_ATOMIC(size * sizeof(size_t));
+	memset(first, 0xff, size * sizeof(size_t));
+
+	for (i = 0; i < state->count; i++) {
+		struct form_pair * pair = &state->pair[i];
+		const char * name = state->text + pair->name;
+		size_t slot = sepia_hash(name, pair->name_length) & (size - 1);
+
+		if (memchr(name, '\0', pair->name_length) != NULL) {
+			return JSONSL_ERROR_FOUND_NULL_BYTE;
+		}
+
+		pair->next = 0;
+		pair->count = 1;
+
+		while (first[slot] != (size_t) -1) {
+			struct form_pair * other = &state->pair[first[slot]];
+
+			if (other->name_length == pair->name_length && memcmp(state->text + other->name, name, pair->name_length) == 0) {
+				// appended to the chain of the first one
+				while (other->next != 0) {
+					other = &state->pair[other->next];
+				}
+				other->next = i;
+				state->pair[first[slot]].count++;
+				pair->count = 0;
+				break;
+			}
+			slot = (slot + 1) & (size - 1);
+		}
+
+		if (pair->count == 1) {
+			first[slot] = i;
+		}
+	}
+
+	return JSONSL_ERROR_SUCCESS;
+}
+
+static bson_t * to_bson(struct form_state * state)
+{
+	bson_t * bson = bson_new();
+	size_t i;
+
+	for (i = 0; i < state->count; i++) {
+		struct form_pair * pair = &state->pair[i];
+		const char * name = state->text + pair->name;
+
+		if (pair->count == 1) {
+			bson_append_utf8(bson, name, pair->name_length, state->text + pair->value, pair->value_length);
+		} else if (pair->count > 1) {
+			bson_t array;
+			uint32_t index = 0;
+			size_t next = i;
+
+			bson_append_array_begin(bson, name, pair->name_length, &array);
+			do {
+				struct form_pair * item = &state->pair[next];
+				const char * key;
+				char buffer[16];
+				size_t key_length = bson_uint32_to_string(index++, &key, buffer, sizeof(buffer));
+
+				bson_append_utf8(&array, key, key_length, state->text + item->value, item->value_length);
+				next = item->next;
+			} while (next != 0);
+			bson_append_array_end(bson, &array);
+		}
+	}
+
+	return bson;
+}
+
+bson_t * sepia_read_form(struct sepia_request * request, int * error)
+{
+	const struct sepia_server_config * config = &sepia_request_server(request)->config;
+	size_t length = request->body_length > request->received_body_length ? request->body_length - request->received_body_length : 0;
+	struct form_state state;
+	int result = JSONSL_ERROR_SUCCESS;
+	int complete;
+
+	memset(&state, 0, sizeof(state));
+	state.text = GC_MALLOC_ATOMIC(length + 1);
+	begin_pair(&state);
+
+	if (request->body != NULL) {
+		// a body in memory is decoded where it is
+		feed(&state, bdata(request->body) + request->received_body_length, length, 1);
+		request->received_body_length = request->body_length;
+		complete = 1;
+	} else {
+		char * buffer = GC_MALLOC_ATOMIC(config->read_buffer_size);
+		size_t kept = 0;
+		int read;
+
+		do {
+			read = sepia_read_data(request, buffer + kept, config->read_buffer_size - kept);
+			size_t available = kept + (read > 0 ? read : 0);
+			size_t used = feed(&state, buffer, available, read <= 0);
+
+			kept = available - used;
+			memmove(buffer, buffer + used, kept);
+		} while (read > 0);
+
+		complete = request->received_body_length == request->body_length;
+		if (read < 0) {
+			result = SEPIA_ERROR_READ;
+		}
+	}
+	end_pair(&state);
+
+	if (result == JSONSL_ERROR_SUCCESS && state.malformed) {
+		result = JSONSL_ERROR_PERCENT_BADHEX;
+	} else if (result == JSONSL_ERROR_SUCCESS) {
+		result = group_pairs(&state);
+	}
+
+	if (error != NULL) {
+		* error = result;
+	}
+
+	return complete && result == JSONSL_ERROR_SUCCESS ? to_bson(&state) : NULL;
+}
@@ -0,0 +1,184 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "jsonsl.h"
+#include "sepia_test.h"
+
+/*
+  The urlencoded forms of form.c as BSON documents, decoded from memory and
+  from a socket in reads that cut the escapes, with the values of repeated
+  names as arrays.
+*/
+
+static bson_bool_t visit_utf8(const bson_iter_t * iter, const char * key, size_t length, const char * value, void * data)
+{
+	bformata(data, "%s=", key);
+	bcatblk(data, value, length);
+	bcatcstr(data, ";");
+	return false;
+}
+
+static bson_bool_t visit_array(const bson_iter_t * iter, const char * key, const bson_t * array, void * data);
+
+static const bson_visitor_t visitor = { .visit_utf8 = visit_utf8, .visit_array = visit_array };
+
+static bson_bool_t visit_array(const bson_iter_t * iter, const char * key, const bson_t * array, void * data)
+{
+	bson_iter_t child;
+
+	bformata(data, "%s[", key);
+	if (bson_iter_init(&child, array)) {
+		bson_iter_visit_all(&child, &visitor, data);
+	}
+	bcatcstr(data, "];");
+	return false;
+}
+
+// the document as name=value; and name[0=value;1=value;];
+static bstring to_string(const bson_t * bson)
+{
+	bstring string = bfromcstr("");
+	bson_iter_t iter;
+
+	if (bson_iter_init(&iter, bson)) {
+		bson_iter_visit_all(&iter, &visitor, string);
+	}
+	return string;
+}
+
+// where the body of read_form() comes from
+#define MEMORY   0
+#define STREAMED 1
+#define OPEN     2
+
+struct writer {
+	int socket;
+	const char * body;
+	size_t length;
+};
+
+// one byte at a time, so that every escape is cut
+static void * write_body(void * data)
+{
+	struct writer * writer = data;
+	size_t i;
+
+	for (i = 0; i < writer->length; i++) {
+		sepia_write_all(writer->socket, writer->body + i, 1);
+		usleep(100);
+	}
+	close(writer->socket);
+	return NULL;
+}
+
+/*
+  Read a form of the given content length and return the document as a
+  string or NULL. The body is in memory, streamed from a socket that is
+  closed at its end or received by a non-blocking socket that stays
+  open.
+*/
+static bstring read_form(const char * body, size_t content_length, int mode, int * error)
+{
+	struct sepia_server_config config;
+	sepia_server_config_init(&config);
+	config.protocol = SEPIA_PROTOCOL_SCGI;
+	config.read_buffer_size = 8;
+	struct sepia_server * server = sepia_server_create(&config);
+	bstring length = bformat("%d", (int) content_length);
+	int sockets[2] = { -1, -1 };
+	struct writer writer;
+	pthread_t thread;
+
+	if (mode != MEMORY) {
+		socketpair(AF_UNIX, SOCK_STREAM, 0, sockets);
+	}
+	if (mode == OPEN) {
+		sepia_write_all(sockets[1], body, strlen(body));
+		fcntl(sockets[0], F_SETFL, O_NONBLOCK);
+	} else if (mode == STREAMED) {
+		writer.socket = sockets[1];
+		writer.body = body;
+		writer.length = strlen(body);
+		pthread_create(&thread, NULL, write_body, &writer);
+	}
+
+	struct sepia_connection * conn = test_connection(server, sockets[0], "", 0);
+	struct sepia_request * request = test_request(conn, "CONTENT_LENGTH", bdata(length), NULL);
+	if (mode == MEMORY) {
+		request->body = bfromcstr(body);
+	}
+
+	* error = -1;
+	bson_t * bson = sepia_read_form(request, error);
+
+	if (mode == STREAMED) {
+		pthread_join(thread, NULL);
+	} else if (mode == OPEN) {
+		close(sockets[1]);
+	}
+	if (mode != MEMORY) {
+		close(sockets[0]);
+	}
+
+	return bson == NULL ? NULL : to_string(bson);
+}
+
+static void check_form(const char * body, const char * expected)
+{
+	int mode, error;
+
+	for (mode = MEMORY; mode <= STREAMED; mode++) {
+		bstring form = read_form(body, strlen(body), mode, &error);
+		CHECK(error == JSONSL_ERROR_SUCCESS);
+		CHECK_STRING(form, expected);
+	}
+}
+
+static void check_error(const char * body, size_t content_length, int expected)
+{
+	int mode, error;
+
+	for (mode = MEMORY; mode <= STREAMED; mode++) {
+		CHECK(read_form(body, content_length, mode, &error) == NULL);
+		CHECK(error == expected);
+	}
+}
+
+static void forms()
+{
+	check_form("", "");
+	check_form("a=1&b=x+y%21", "a=1;b=x y!;");
+	check_form("&a&&b=&=c&", "a=;b=;=c;");
+	check_form("%61%62%63=%7e%7E&a%3Db=c%26d", "abc=~~;a=b=c&d;");
+	check_form("n=1&m=2&n=3&n=%34&m=", "n[0=1;1=3;2=4;];m[0=2;1=;];");
+
+	// longer than the read buffer, a name that is decoded across reads
+	check_form("long%20name=0123456789abcdef&long+name=%C3%A4", "long name[0=0123456789abcdef;1=\xc3\xa4;];");
+}
+
+static void errors()
+{
+	check_error("a=%zz", 5, JSONSL_ERROR_PERCENT_BADHEX);
+	check_error("a=%2", 4, JSONSL_ERROR_PERCENT_BADHEX);
+	check_error("a%00=1", 6, JSONSL_ERROR_FOUND_NULL_BYTE);
+
+	// a connection that is closed before the body is complete truncates it
+	int error;
+	CHECK(read_form("a=1&b=2", 20, STREAMED, &error) == NULL);
+	CHECK(error == JSONSL_ERROR_SUCCESS);
+
+	// the rest of the body does not arrive in time
+	CHECK(read_form("a=1&b=2", 20, OPEN, &error) == NULL);
+	CHECK(error == SEPIA_ERROR_READ);
+}
+
+int main()
+{
+	sepia_init();
+
+	forms();
+	errors();
+
+	return test_result("form");
+}
@@ -0,0 +1,523 @@
+#define _GNU_SOURCE
+
+#include <limits.h>
+#include <string.h>
+#include <strings.h>
+
+#include "sepia_internal.h"
+
+/*
+  A plain HTTP/1.1 front end. The request line and the header fields are
+  turned into the CGI attributes a webserver would send with SCGI, so the
+  mounts and handlers do not see a difference. Connections are persistent
+  unless the client says otherwise, pipelined requests are simply parsed
+  from the received data after the previous one is answered.
+
+  A chunked request body is decoded as it is received and the request is
+  handled once it is complete, with the decoded body and its length as
+  CONTENT_LENGTH. Requests that are not understood are answered with an
+  error status and the connection is closed.
+
+  The response gets a Content-Length if it is complete when it is flushed
+  for the first time, otherwise it is sent chunked (or, for HTTP/1.0
+  clients, delimited by closing the connection).
+*/
+
+struct tagbstring HTTP_CONTINUE = bsStatic("HTTP/1.1 100 Continue\r\n\r\n");
+struct tagbstring HTTP_END_OF_HEADERS = bsStatic("\r\n\r\n");
+
+struct tagbstring HTTP_BAD_REQUEST = bsStatic("400 Bad Request");
+struct tagbstring HTTP_LENGTH_REQUIRED = bsStatic("411 Length Required");
+struct tagbstring HTTP_PAYLOAD_TOO_LARGE = bsStatic("413 Payload Too Large");
+struct tagbstring HTTP_HEADER_TOO_LARGE = bsStatic("431 Request Header Fields Too Large");
+struct tagbstring HTTP_NOT_IMPLEMENTED = bsStatic("501 Not Implemented");
+
+// what is expected next of a chunked request body
+#define CHUNK_SIZE    0
+#define CHUNK_DATA    1
+#define CHUNK_END     2
+#define CHUNK_TRAILER 3
+
+// per connection, describes the request that is currently answered
+struct http_state {
+	int version;    // minor version, HTTP/1.0 or HTTP/1.1
+	int started;    // the header of the response is sent
+	int chunked;    // the body of the response is sent chunked
+
+	// a request whose chunked body is being received, NULL once it is handled
+	struct bstrList * headers;
+	bstring body;
+	int keep_alive;
+	int stage;         // one of the CHUNK_ values
+	size_t remaining;  // of the chunk data, or the size of the trailer so far
+};
+
+// answers a request that is not read, the connection is closed afterwards
+static struct sepia_request * reject(struct sepia_connection * conn, const_bstring status, int * error)
+{
+	bstring response = bformat("HTTP/1.1 %s\r\nContent-Length: 0\r\nConnection: close\r\n\r\n", bdata(status));
+
+	sepia_connection_send(conn, bdata(response), blength(response));
+	conn->keep_alive = 0;
+	* error = 1;
+	return NULL;
+}
+
+static void add_attribute(struct bstrList * headers, const char * name, size_t name_length, const char * value, size_t value_length)
+{
+	if (headers->qty + 2 > headers->mlen) {
+		bstrListAlloc(headers, headers->mlen * 2 + 2);
+	}
+	headers->entry[headers->qty++] = blk2bstr(name, name_length);
+	headers->entry[headers->qty++] = blk2bstr(value, value_length);
+}
+
+static int hex_value(char c)
+{
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+// PATH_INFO is decoded by webservers, so it is here too
+static void add_path(struct bstrList * headers, const char * path, size_t length)
+{
+	size_t i, n = 0;
+	char decoded[length];
+
+	for (i = 0; i < length; i++) {
+		if (path[i] == '%' && i + 2 < length && hex_value(path[i + 1]) >= 0 && hex_value(path[i + 2]) >= 0) {
+			decoded[n++] = hex_value(path[i + 1]) * 16 + hex_value(path[i + 2]);
+			i += 2;
+		} else {
+			decoded[n++] = path[i];
+		}
+	}
+
+	add_attribute(headers, "PATH_INFO", 9, decoded, n);
+}
+
+// Content-Type becomes CONTENT_TYPE, everything else HTTP_ and the name in upper case
+static void add_header(struct bstrList * headers, const char * name, size_t name_length, const char * value, size_t value_length)
+{
+	size_t i, offset = 5;
+	char attribute[name_length + 5];
+
+	// X_Foo would pass for X-Foo, so names with an underscore are dropped like webservers do
+	if (memchr(name, '_', name_length) != NULL) {
+		return;
+	}
+
+	if ((name_length == 12 && strncasecmp(name, "Content-Type", 12) == 0)
+		|| (name_length == 14 && strncasecmp(name, "Content-Length", 14) == 0)) {
+		offset = 0;
+	} else {
+		memcpy(attribute, "HTTP_", 5);
+	}
+
+	for (i = 0; i < name_length; i++) {
+		char c = name[i];
+		attribute[offset + i] = c == '-' ? '_' : (c >= 'a' && c <= 'z' ? c - 'a' + 'A' : c);
+	}
+
+	add_attribute(headers, attribute, offset + name_length, value, value_length);
+}
+
+static int is_digits(const char * value, size_t length)
+{
+	size_t i;
+
+	for (i = 0; i < length; i++) {
+		if (value[i] < '0' || value[i] > '9') {
+			return 0;
+		}
+	}
+
+	return length > 0;
+}
+
+static int has_token(const char * value, size_t length, const char * token)
+{
+	size_t token_length = strlen(token);
+	const char * end = value + length;
+
+	while (value < end) {
+		while (value < end && (* value == ' ' || * value == '\t' || * value == ',')) {
+			value++;
+		}
+		const char * start = value;
+		while (value < end && * value != ',') {
+			value++;
+		}
+		const char * last = value;
+		while (last > start && (last[-1] == ' ' || last[-1] == '\t')) {
+			last--;
+		}
+		if (last - start == token_length && strncasecmp(start, token, token_length) == 0) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+// the request of a complete chunked body, handled as if it came with a Content-Length
+static struct sepia_request * chunked_request(struct sepia_connection * conn, struct http_state * state)
+{
+	bstring length = bformat("%d", blength(state->body));
+	add_attribute(state->headers, "CONTENT_LENGTH", 14, bdata(length), blength(length));
+
+	struct sepia_request * request = sepia_new_request(conn, state->headers);
+	request->body = state->body;
+	request->body_length = blength(state->body);
+
+	conn->keep_alive = state->keep_alive;
+	state->headers = NULL;
+	state->body = NULL;
+	return request;
+}
+
+// decodes what is received of a chunked body, returns the request once the body is complete
+static struct sepia_request * read_chunked(struct sepia_connection * conn, struct http_state * state, int * error)
+{
+	const struct sepia_server_config * config = &conn->server->config;
+
+	while (conn->offset < conn->length) {
+		char * data = conn->buffer + conn->offset;
+		size_t available = conn->length - conn->offset;
+
+		if (state->stage == CHUNK_DATA) {
+			size_t length = available < state->remaining ? available : state->remaining;
+			bcatblk(state->body, data, length);
+			conn->offset += length;
+			state->remaining -= length;
+			if (state->remaining == 0) {
+				state->stage = CHUNK_END;
+			}
+			continue;
+		}
+
+		char * line_end = memmem(data, available, "\r\n", 2);
+		if (line_end == NULL) {
+			if (available >= config->max_header_size) {
+				return reject(conn, &HTTP_BAD_REQUEST, error);
+			}
+			return NULL;
+		}
+		conn->offset += line_end + 2 - data;
+
+		if (state->stage == CHUNK_END) {
+			if (line_end != data) {
+				return reject(conn, &HTTP_BAD_REQUEST, error);
+			}
+			state->stage = CHUNK_SIZE;
+
+		} else if (state->stage == CHUNK_SIZE) {
+			// the size in hex, chunk extensions after it are ignored
+			int64_t size = 0;
+			char * digit = data;
+			while (digit < line_end && hex_value(* digit) >= 0 && size <= INT_MAX) {
+				size = size * 16 + hex_value(* digit++);
+			}
+			if (size > INT_MAX - blength(state->body)
+				|| (config->max_body_size > 0 && (size_t) (blength(state->body) + size) > config->max_body_size)) {
+				return reject(conn, &HTTP_PAYLOAD_TOO_LARGE, error);
+			}
+			if (digit == data || (digit < line_end && * digit != ';' && * digit != ' ' && * digit != '\t')) {
+				return reject(conn, &HTTP_BAD_REQUEST, error);
+			}
+			state->remaining = size;
+			state->stage = size > 0 ? CHUNK_DATA : CHUNK_TRAILER;
+
+		} else if (line_end == data) {
+			// the trailer fields are not passed on
+			return chunked_request(conn, state);
+
+		} else {
+			state->remaining += line_end + 2 - data;
+			if (state->remaining > config->max_header_size) {
+				return reject(conn, &HTTP_HEADER_TOO_LARGE, error);
+			}
+		}
+	}
+
+	return NULL;
+}
+
+static struct sepia_request * http_parse(struct sepia_connection * conn, int * error)
+{
+	struct http_state * current = conn->state;
+
+	if (current != NULL && current->headers != NULL) {
+		return read_chunked(conn, current, error);
+	}
+
+	// empty lines before a request are allowed
+	while (conn->length - conn->offset >= 2 && conn->buffer[conn->offset] == '\r' && conn->buffer[conn->offset + 1] == '\n') {
+		conn->offset += 2;
+	}
+
+	char * start = conn->buffer + conn->offset;
+	size_t available = conn->length - conn->offset;
+	char * end = memmem(start, available, "\r\n\r\n", 4);
+
+	if (end == NULL || end + 4 - start > conn->server->config.max_header_size) {
+		if (end != NULL || available >= conn->server->config.max_header_size) {
+			return reject(conn, &HTTP_HEADER_TOO_LARGE, error);
+		}
+		return NULL;
+	}
+
+	// the request line, method SP target SP version
+	char * line_end = memchr(start, '\r', end - start + 1);
+	char * method_end = memchr(start, ' ', line_end - start);
+	char * target = method_end == NULL ? NULL : method_end + 1;
+	char * target_end = target == NULL ? NULL : memchr(target, ' ', line_end - target);
+	char * version = target_end == NULL ? NULL : target_end + 1;
+
+	if (version == NULL || method_end == start || target_end == target
+		|| line_end - version != 8 || strncmp(version, "HTTP/1.", 7) != 0 || version[7] < '0' || version[7] > '9') {
+		return reject(conn, &HTTP_BAD_REQUEST, error);
+	}
+
+	// absolute form, http://host/path
+	if (* target != '/') {
+		char * scheme = memmem(target, target_end - target, "://", 3);
+		if (scheme == NULL || scheme == target) {
+			return reject(conn, &HTTP_BAD_REQUEST, error);
+		}
+
+		char * path = scheme + 3;
+		while (path < target_end && * path != '/' && * path != '?') {
+			path++;
+		}
+
+		if (path < target_end && * path == '/') {
+			target = path;
+		} else {
+			// http://host and http://host?query have the path /
+			size_t length = target_end - path;
+			target = GC_MALLOC_ATOMIC(length + 1);
+			target[0] = '/';
+			memcpy(target + 1, path, length);
+			target_end = target + length + 1;
+		}
+	}
+
+	char * query = memchr(target, '?', target_end - target);
+	char * path_end = query == NULL ? target_end : query;
+
+	struct bstrList * headers = bstrListCreate();
+	add_attribute(headers, "REQUEST_METHOD", 14, start, method_end - start);
+	add_attribute(headers, "REQUEST_URI", 11, target, target_end - target);
+	add_path(headers, target, path_end - target);
+	if (query == NULL) {
+		add_attribute(headers, "QUERY_STRING", 12, "", 0);
+	} else {
+		add_attribute(headers, "QUERY_STRING", 12, query + 1, target_end - query - 1);
+	}
+	add_attribute(headers, "SERVER_PROTOCOL", 15, version, 8);
+
+	struct http_state * state = GC_MALLOC(sizeof(struct http_state));
+	state->version = version[7] - '0';
+	state->started = 0;
+	state->chunked = 0;
+	state->headers = NULL;
+	state->body = NULL;
+
+	int keep_alive = state->version >= 1;
+	int expect_continue = 0;
+	int chunked = 0;
+
+	// the header fields, name: value
+	char * line = line_end + 2;
+	const char * content_length = NULL;
+	size_t content_length_size = 0;
+	while (line < end + 2) {
+		line_end = memchr(line, '\r', end + 2 - line);
+		char * colon = memchr(line, ':', line_end - line);
+
+		// obsolete line folding and names with white space are not accepted
+		if (colon == NULL || colon == line || * line == ' ' || * line == '\t' || colon[-1] == ' ' || colon[-1] == '\t') {
+			return reject(conn, &HTTP_BAD_REQUEST, error);
+		}
+
+		char * value = colon + 1;
+		char * value_end = line_end;
+		while (value < value_end && (* value == ' ' || * value == '\t')) {
+			value++;
+		}
+		while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t')) {
+			value_end--;
+		}
+
+		size_t name_length = colon - line, value_length = value_end - value;
+
+		if (name_length == 10 && strncasecmp(line, "Connection", 10) == 0) {
+			if (has_token(value, value_length, "close")) {
+				keep_alive = 0;
+			} else if (has_token(value, value_length, "keep-alive")) {
+				keep_alive = 1;
+			}
+		} else if (name_length == 17 && strncasecmp(line, "Transfer-Encoding", 17) == 0) {
+			// only chunked is decoded, a body in another coding would need a Content-Length
+			if (chunked || value_length != 7 || strncasecmp(value, "chunked", 7) != 0) {
+				return reject(conn, &HTTP_NOT_IMPLEMENTED, error);
+			}
+			chunked = 1;
+			line = line_end + 2;
+			continue;
+		} else if (name_length == 6 && strncasecmp(line, "Expect", 6) == 0) {
+			expect_continue = has_token(value, value_length, "100-continue");
+		} else if (name_length == 14 && strncasecmp(line, "Content-Length", 14) == 0) {
+			// a length a proxy in front could read differently is never guessed at
+			if (!is_digits(value, value_length) || (content_length != NULL
+				&& (content_length_size != value_length || memcmp(content_length, value, value_length) != 0))) {
+				return reject(conn, &HTTP_BAD_REQUEST, error);
+			}
+			if (content_length != NULL) {
+				line = line_end + 2;
+				continue;
+			}
+			content_length = value;
+			content_length_size = value_length;
+		}
+
+		add_header(headers, line, name_length, value, value_length);
+		line = line_end + 2;
+	}
+
+	// a body whose length two parties could see differently is refused
+	if (chunked && (content_length != NULL || state->version == 0)) {
+		return reject(conn, content_length != NULL ? &HTTP_BAD_REQUEST : &HTTP_LENGTH_REQUIRED, error);
+	}
+
+	int64_t body_size;
+	size_t max_body_size = conn->server->config.max_body_size;
+	if (content_length != NULL && (!sepia_parse_int64(content_length, content_length_size, &body_size)
+		|| body_size > INT_MAX || (max_body_size > 0 && (size_t) body_size > max_body_size))) {
+		return reject(conn, &HTTP_PAYLOAD_TOO_LARGE, error);
+	}
+
+	conn->offset = end + 4 - conn->buffer;
+	conn->state = state;
+
+	if (chunked) {
+		state->headers = headers;
+		state->body = bfromcstr("");
+		state->keep_alive = keep_alive;
+		state->stage = CHUNK_SIZE;
+		state->remaining = 0;
+
+		// the connection stays open while the body is received, whatever is answered in between
+		conn->keep_alive = 1;
+		if (expect_continue && conn->offset == conn->length) {
+			sepia_connection_send(conn, bdata(&HTTP_CONTINUE), blength(&HTTP_CONTINUE));
+		}
+		return read_chunked(conn, state, error);
+	}
+
+	conn->keep_alive = keep_alive;
+
+	struct sepia_request * request = sepia_new_request(conn, headers);
+
+	// the body is only sent after the client is told to go on
+	if (expect_continue && state->version >= 1 && request->body_length > conn->length - conn->offset) {
+		sepia_connection_send(conn, bdata(&HTTP_CONTINUE), blength(&HTTP_CONTINUE));
+	}
+
+	return request;
+}
+
+void sepia_http_send_status(struct sepia_request * request, const_bstring status)
+{
+	bcatblk(request->output, "HTTP/1.1 ", 9);
+	bconcat(request->output, status);
+	bcatblk(request->output, "\r\n", 2);
+}
+
+static int has_content_length(const char * header, size_t length)
+{
+	const char * line = header;
+	const char * end = header + length;
+
+	while (line < end) {
+		if (end - line > 15 && strncasecmp(line, "Content-Length:", 15) == 0) {
+			return 1;
+		}
+		const char * next = memchr(line, '\n', end - line);
+		if (next == NULL) {
+			break;
+		}
+		line = next + 1;
+	}
+
+	return 0;
+}
+
+static void http_flush(struct sepia_request * request, int last)
+{
+	struct sepia_connection * conn = request->conn;
+	struct http_state * state = conn->state;
+	bstring output = request->output;
+	size_t body = 0, length = blength(output);
+	bstring response = bfromcstralloc(length + 64, "");
+
+	if (!state->started) {
+		int end = binstr(output, 0, &HTTP_END_OF_HEADERS);
+
+		if (end == BSTR_ERR) {
+			if (!last) {
+				return;
+			}
+			end = length - 2;
+		}
+
+		// up to and including the CRLF of the last header field
+		bcatblk(response, bdata(output), end + 2);
+
+		if (!has_content_length(bdata(output), end + 2)) {
+			if (last) {
+				bformata(response, "Content-Length: %d\r\n", (int) length - end - 4);
+			} else if (state->version >= 1) {
+				bcatcstr(response, "Transfer-Encoding: chunked\r\n");
+				state->chunked = 1;
+			} else {
+				conn->keep_alive = 0;
+			}
+		}
+
+		if (!conn->keep_alive) {
+			bcatcstr(response, "Connection: close\r\n");
+		} else if (state->version == 0) {
+			bcatcstr(response, "Connection: keep-alive\r\n");
+		}
+
+		bcatblk(response, "\r\n", 2);
+		body = end + 4;
+		state->started = 1;
+	}
+
+	if (state->chunked) {
+		if (length > body) {
+			bformata(response, "%x\r\n", (unsigned int) (length - body));
+			bcatblk(response, bdata(output) + body, length - body);
+			bcatblk(response, "\r\n", 2);
+		}
+		if (last) {
+			bcatblk(response, "0\r\n\r\n", 5);
+		}
+	} else if (length > body) {
+		bcatblk(response, bdata(output) + body, length - body);
+	}
+
+	sepia_connection_send(conn, bdata(response), blength(response));
+	btrunc(output, 0);
+}
+
+const struct sepia_protocol sepia_http_protocol = {
+	http_parse,
+	sepia_http_send_status,
+	http_flush
+};
@@ -0,0 +1,217 @@
+#include "sepia_test.h"
+
+/*
+  The HTTP/1.1 framing of http.c: the request line and header fields as CGI
+  attributes, pipelining, the bodies with a Content-Length or chunked, the
+  error statuses of requests that are refused and the framing of responses.
+*/
+
+static struct sepia_request * parse(struct sepia_connection * conn, int * error)
+{
+	* error = 0;
+	return conn->protocol->parse(conn, error);
+}
+
+static struct sepia_connection * connection(const char * data)
+{
+	return test_connection(test_server(SEPIA_PROTOCOL_HTTP), -1, data, strlen(data));
+}
+
+static const_bstring attribute(struct sepia_request * request, const char * name)
+{
+	struct tagbstring string;
+
+	btfromcstr(string, name);
+	return sepia_request_attribute(request, &string);
+}
+
+// the request is refused with the status and the connection is not kept alive
+static void check_refused(const char * data, const char * status)
+{
+	struct sepia_connection * conn = connection(data);
+	int error;
+
+	CHECK(parse(conn, &error) == NULL && error != 0);
+	CHECK(!conn->keep_alive);
+	CHECK(blength(conn->output) > 9 && strncmp(bdata(conn->output) + 9, status, 3) == 0);
+}
+
+static void request_line()
+{
+	struct sepia_connection * conn = connection(
+		"\r\nGET /a/%7e/b?x=1&y HTTP/1.1\r\nHost: example.com\r\nContent-Type: text/plain\r\nX-Custom-Name:  v a l  \r\n\r\n");
+	int error;
+	struct sepia_request * request = parse(conn, &error);
+
+	CHECK(request != NULL);
+	CHECK(conn->keep_alive);
+	CHECK_STRING(sepia_request_attr(request, SEPIA_ATTR_REQUEST_METHOD), "GET");
+	CHECK_STRING(sepia_request_attr(request, SEPIA_ATTR_REQUEST_URI), "/a/%7e/b?x=1&y");
+	CHECK_STRING(sepia_request_attr(request, SEPIA_ATTR_PATH_INFO), "/a/~/b");
+	CHECK_STRING(sepia_request_attr(request, SEPIA_ATTR_QUERY_STRING), "x=1&y");
+	CHECK_STRING(sepia_request_attr(request, SEPIA_ATTR_SERVER_PROTOCOL), "HTTP/1.1");
+	CHECK_STRING(sepia_request_attr(request, SEPIA_ATTR_CONTENT_TYPE), "text/plain");
+	CHECK_STRING(sepia_request_attr(request, SEPIA_ATTR_HTTP_HOST), "example.com");
+	CHECK_STRING(attribute(request, "HTTP_X_CUSTOM_NAME"), "v a l");
+	CHECK(conn->offset == conn->length);
+
+	// the absolute form, with and without a path
+	request = parse(connection("GET http://example.com/p?q HTTP/1.1\r\n\r\n"), &error);
+	CHECK(request != NULL && biseqcstr(sepia_request_attr(request, SEPIA_ATTR_PATH_INFO), "/p"));
+	request = parse(connection("GET http://example.com?q HTTP/1.1\r\n\r\n"), &error);
+	CHECK(request != NULL && biseqcstr(sepia_request_attr(request, SEPIA_ATTR_PATH_INFO), "/"));
+	CHECK(request != NULL && biseqcstr(sepia_request_attr(request, SEPIA_ATTR_QUERY_STRING), "q"));
+
+	// names with an underscore would pass for the ones with a dash
+	request = parse(connection("GET / HTTP/1.1\r\nX_Custom: 1\r\nX-Custom: 2\r\n\r\n"), &error);
+	CHECK(request != NULL && biseqcstr(attribute(request, "HTTP_X_CUSTOM"), "2"));
+}
+
+static void persistence()
+{
+	int error;
+	struct sepia_connection * conn = connection("GET / HTTP/1.0\r\n\r\n");
+
+	CHECK(parse(conn, &error) != NULL && !conn->keep_alive);
+	conn = connection("GET / HTTP/1.0\r\nConnection: Keep-Alive\r\n\r\n");
+	CHECK(parse(conn, &error) != NULL && conn->keep_alive);
+	conn = connection("GET / HTTP/1.1\r\nConnection: foo, close\r\n\r\n");
+	CHECK(parse(conn, &error) != NULL && !conn->keep_alive);
+
+	// pipelined requests and a header that is not complete
+	conn = connection("POST /1 HTTP/1.1\r\nContent-Length: 3\r\n\r\nabcGET /2 HTTP/1.1\r\n\r\nGET /3 HTTP/1.1\r\n");
+	struct sepia_request * request = parse(conn, &error);
+	CHECK(request != NULL && request->body_length == 3);
+	CHECK_STRING(sepia_read_string(request), "abc");
+	request = parse(conn, &error);
+	CHECK(request != NULL && biseqcstr(sepia_request_attr(request, SEPIA_ATTR_PATH_INFO), "/2"));
+	CHECK(parse(conn, &error) == NULL && error == 0);
+	test_receive(conn, "\r\n", 2);
+	CHECK(parse(conn, &error) != NULL);
+
+	// the client waits for 100 Continue before it sends the body
+	conn = connection("POST / HTTP/1.1\r\nContent-Length: 5\r\nExpect: 100-continue\r\n\r\n");
+	CHECK(parse(conn, &error) != NULL);
+	CHECK(biseqcstr(conn->output, "HTTP/1.1 100 Continue\r\n\r\n"));
+}
+
+static void chunked()
+{
+	const char * body = "4;name=value\r\nWiki\r\n5\r\npedia\r\nE\r\n in\r\n\r\nchunks.\r\n0\r\nX-Trailer: 1\r\n\r\n";
+	struct sepia_connection * conn = connection("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\nConnection: close\r\n\r\n");
+	struct sepia_request * request = NULL;
+	int error = 0;
+	size_t i;
+
+	// received one byte after the other
+	for (i = 0; body[i] != 0; i++) {
+		CHECK(request == NULL && error == 0);
+		test_receive(conn, body + i, 1);
+		request = parse(conn, &error);
+	}
+
+	CHECK(request != NULL);
+	CHECK(!conn->keep_alive);
+	CHECK(request != NULL && request->body_length == 23);
+	CHECK(request != NULL && biseqcstr(request->body, "Wikipedia in\r\n\r\nchunks."));
+	CHECK_STRING(sepia_request_attr(request, SEPIA_ATTR_CONTENT_LENGTH), "23");
+	CHECK(conn->offset == conn->length);
+
+	// the next request follows the chunked body
+	conn = connection("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n1\r\nx\r\n0\r\n\r\nGET /next HTTP/1.1\r\n\r\n");
+	request = parse(conn, &error);
+	CHECK(request != NULL && biseqcstr(request->body, "x") && conn->keep_alive);
+	request = parse(conn, &error);
+	CHECK(request != NULL && biseqcstr(sepia_request_attr(request, SEPIA_ATTR_PATH_INFO), "/next"));
+
+	check_refused("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\nx\r\n", "400");
+	check_refused("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n1\r\nab\r\n", "400");
+	check_refused("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\nFFFFFFFFF\r\n", "413");
+}
+
+static void refused()
+{
+	struct sepia_server_config config;
+	sepia_server_config_init(&config);
+	config.protocol = SEPIA_PROTOCOL_HTTP;
+	config.max_header_size = 64;
+	config.max_body_size = 100;
+	struct sepia_server * server = sepia_server_create(&config);
+	const char * large = "GET / HTTP/1.1\r\nX-Large: 0123456789012345678901234567890123456789\r\n\r\n";
+	int error;
+
+	check_refused("GET /\r\n\r\n", "400");
+	check_refused("GET / HTTP/2.0\r\n\r\n", "400");
+	check_refused("GET foo HTTP/1.1\r\n\r\n", "400");
+	check_refused("GET / HTTP/1.1\r\n folded\r\n\r\n", "400");
+	check_refused("GET / HTTP/1.1\r\nName : value\r\n\r\n", "400");
+	check_refused("POST / HTTP/1.1\r\nContent-Length: 1\r\nContent-Length: 2\r\n\r\n", "400");
+	check_refused("POST / HTTP/1.1\r\nContent-Length: -1\r\n\r\n", "400");
+	check_refused("POST / HTTP/1.1\r\nContent-Length: 99999999999\r\n\r\n", "413");
+	check_refused("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\nContent-Length: 1\r\n\r\n", "400");
+	check_refused("POST / HTTP/1.1\r\nTransfer-Encoding: gzip, chunked\r\n\r\n", "501");
+	check_refused("POST / HTTP/1.0\r\nTransfer-Encoding: chunked\r\n\r\n", "411");
+
+	struct sepia_connection * conn = test_connection(server, -1, large, strlen(large));
+	CHECK(parse(conn, &error) == NULL && error != 0 && strncmp(bdata(conn->output) + 9, "431", 3) == 0);
+	conn = test_connection(server, -1, large, 64);
+	CHECK(parse(conn, &error) == NULL && error != 0);
+	conn = test_connection(server, -1, large, 63);
+	CHECK(parse(conn, &error) == NULL && error == 0);
+
+	const char * body = "POST / HTTP/1.1\r\nContent-Length: 101\r\n\r\n";
+	conn = test_connection(server, -1, body, strlen(body));
+	CHECK(parse(conn, &error) == NULL && error != 0 && strncmp(bdata(conn->output) + 9, "413", 3) == 0);
+}
+
+// the complete response of a request, as the protocol sends it
+static bstring respond(const char * request, const char * output)
+{
+	struct sepia_connection * conn = connection(request);
+	int error;
+	struct sepia_request * parsed = parse(conn, &error);
+
+	bcatcstr(parsed->output, output);
+	conn->protocol->flush(parsed, 1);
+	return conn->output;
+}
+
+static void responses()
+{
+	CHECK(biseqcstr(respond("GET / HTTP/1.1\r\n\r\n", "HTTP/1.1 200 OK\r\nX: 1\r\n\r\nbody"),
+		"HTTP/1.1 200 OK\r\nX: 1\r\nContent-Length: 4\r\n\r\nbody"));
+
+	CHECK(biseqcstr(respond("GET / HTTP/1.1\r\nConnection: close\r\n\r\n", "HTTP/1.1 200 OK\r\n\r\n"),
+		"HTTP/1.1 200 OK\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"));
+
+	// flushed before it is complete
+	struct sepia_connection * conn = connection("GET / HTTP/1.1\r\n\r\n");
+	int error;
+	struct sepia_request * request = parse(conn, &error);
+	bcatcstr(request->output, "HTTP/1.1 200 OK\r\n\r\nab");
+	conn->protocol->flush(request, 0);
+	bcatcstr(request->output, "cde");
+	conn->protocol->flush(request, 1);
+	CHECK(biseqcstr(conn->output, "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n2\r\nab\r\n3\r\ncde\r\n0\r\n\r\n"));
+
+	// HTTP/1.0 has no chunks, the end of the body is the end of the connection
+	conn = connection("GET / HTTP/1.0\r\nConnection: keep-alive\r\n\r\n");
+	request = parse(conn, &error);
+	bcatcstr(request->output, "HTTP/1.1 200 OK\r\n\r\nab");
+	conn->protocol->flush(request, 0);
+	CHECK(!conn->keep_alive);
+	CHECK(biseqcstr(conn->output, "HTTP/1.1 200 OK\r\nConnection: close\r\n\r\nab"));
+}
+
+int main()
+{
+	sepia_init();
+
+	request_line();
+	persistence();
+	chunked();
+	refused();
+	responses();
+
+	return test_result("http");
+}
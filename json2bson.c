@@ -2,9 +2,7 @@
 #include <stdlib.h>
 
 #include "jsonsl.h"
-#include "json2bson.h"
-
-#define MAX_NESTING_LEVEL 1024
+#include "sepia_internal.h"
 
 struct bson_entry {
 	bstring key;
@@ -16,7 +14,8 @@ struct bson_state {
 	char * text;
 	int cur_entry;
 	jsonsl_error_t error;
-	struct bson_entry entry[MAX_NESTING_LEVEL];
+	// one per nesting level, see json_max_nesting of the server configuration
+	struct bson_entry * entry;
 };
 
 #define UTF8_2_BYTE_LIMIT 0x07FF
@@ -191,18 +190,20 @@ static int on_error(jsonsl_t parser, jsonsl_error_t error, struct jsonsl_state_s
 	return 0;
 }
 
-#define BUFFER_SIZE 1024
-
 bson_t * sepia_read_json(struct sepia_request * request, int * error)
 {
-	jsonsl_t parser = jsonsl_new(MAX_NESTING_LEVEL);
+	const struct sepia_server_config * config = &sepia_request_server(request)->config;
+	int nesting = config->json_max_nesting > 0 ? config->json_max_nesting : 1;
+
+	jsonsl_t parser = jsonsl_new(nesting);
 	jsonsl_enable_all_callbacks(parser);
 	parser->action_callback = on_stack_change;
 	parser->error_callback = on_error;
 
-	char * buffer = GC_MALLOC(BUFFER_SIZE);
+	char * buffer = GC_MALLOC(config->read_buffer_size);
 
 	struct bson_state state;
+	state.entry = GC_MALLOC(nesting * sizeof(struct bson_entry));
 	state.cur_entry = -1;
 	state.error = JSONSL_ERROR_SUCCESS;
 	state.entry[0].bson = NULL;
@@ -211,10 +212,17 @@ bson_t * sepia_read_json(struct sepia_request * request, int * error)
 
 	int read;
 	do {
-		read = sepia_read_data(request, buffer, BUFFER_SIZE);
-		jsonsl_feed(parser, buffer, read);
+		read = sepia_read_data(request, buffer, config->read_buffer_size);
+		if (read > 0) {
+			jsonsl_feed(parser, buffer, read);
+		}
 	} while (read > 0);
 
+	// a timeout or a closed connection, the document is incomplete
+	if (read < 0) {
+		state.error = SEPIA_ERROR_READ;
+	}
+
 	if (error != NULL) {
 		* error = state.error;
 	}
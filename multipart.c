@@ -0,0 +1,328 @@
+#include <string.h>
+#include <strings.h>
+
+#include "sepia_internal.h"
+
+/*
+  A streaming multipart parser. The body is read into one buffer, the
+  delimiters are searched with Boyer-Moore-Horspool, and the content in
+  front of them is passed on right away. Only the bytes at the end of the
+  buffer that may be the start of a delimiter are kept for the next read,
+  so the memory used does not depend on the size of the body. A body that
+  is in memory already is parsed where it is.
+
+  Content that goes to a file descriptor is written from the buffer, not
+  spliced from the socket like sepia_read_to_fd() does: the delimiter can
+  only be found in data that has been read, and then it is in the buffer
+  already.
+*/
+
+// the least the buffer holds, a header line of a part has to fit into it
+#define MULTIPART_BUFFER_SIZE (16 * 1024)
+
+// RFC 2046
+#define MAX_BOUNDARY 70
+
+#define STATE_FIRST     0
+#define STATE_PREAMBLE  1
+#define STATE_DELIMITER 2
+#define STATE_HEADERS   3
+#define STATE_CONTENT   4
+
+// what step() returns
+#define STEP_NEXT 0
+#define STEP_NEED_DATA 1
+#define STEP_DONE 2
+#define STEP_STOP 3
+
+struct multipart {
+	const struct sepia_multipart_handler * handler;
+	void * data;
+
+	// "\r\n--" and the boundary, with the Horspool shifts of its bytes
+	char delimiter[MAX_BOUNDARY + 4];
+	size_t length;
+	size_t shift[256];
+
+	char * buffer;
+	size_t size;
+	size_t start;
+	size_t end;
+
+	int state;
+	int fd;
+
+	// what sepia_read_multipart() returns after STEP_STOP
+	int result;
+};
+
+static struct tagbstring MULTIPART = bsStatic("multipart/");
+
+// finds the boundary parameter of the content type
+static int boundary(struct multipart * mp, const_bstring content_type)
+{
+	const char * data = (const char *) content_type->data;
+	const char * end = data + content_type->slen;
+	const char * param;
+
+	if (content_type->slen < MULTIPART.slen || strncasecmp(data, (char *) MULTIPART.data, MULTIPART.slen) != 0) {
+		return 0;
+	}
+
+	for (param = memchr(data, ';', end - data); param != NULL; param = memchr(param, ';', end - param)) {
+		param++;
+		while (param < end && (* param == ' ' || * param == '\t')) {
+			param++;
+		}
+		if (end - param > 9 && strncasecmp(param, "boundary=", 9) == 0) {
+			const char * value = param + 9, * value_end;
+
+			if (* value == '"') {
+				value++;
+				value_end = memchr(value, '"', end - value);
+			} else {
+				for (value_end = value; value_end < end && * value_end != ';' && * value_end != ' ' && * value_end != '\t'; value_end++);
+			}
+			if (value_end == NULL || value_end == value || value_end - value > MAX_BOUNDARY) {
+				return 0;
+			}
+
+			memcpy(mp->delimiter, "\r\n--", 4);
+			memcpy(mp->delimiter + 4, value, value_end - value);
+			mp->length = 4 + (value_end - value);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static void init_shift(struct multipart * mp)
+{
+	size_t i;
+
+	for (i = 0; i < 256; i++) {
+		mp->shift[i] = mp->length;
+	}
+	for (i = 0; i + 1 < mp->length; i++) {
+		mp->shift[(unsigned char) mp->delimiter[i]] = mp->length - 1 - i;
+	}
+}
+
+// Boyer-Moore-Horspool, the position of the first delimiter in data or NULL
+static const char * find_delimiter(const struct multipart * mp, const char * data, size_t length)
+{
+	size_t i = 0, last = mp->length - 1;
+
+	while (i + mp->length <= length) {
+		unsigned char c = data[i + last];
+		if (c == (unsigned char) mp->delimiter[last] && memcmp(data + i, mp->delimiter, last) == 0) {
+			return data + i;
+		}
+		i += mp->shift[c];
+	}
+
+	return NULL;
+}
+
+static int content(struct multipart * mp, const char * data, size_t length)
+{
+	if (length == 0) {
+		return SEPIA_OK;
+	}
+	// the parser has seen these bytes, so they are written from where they are
+	if (mp->fd >= 0) {
+		return sepia_write_all(mp->fd, data, length) == 0 ? SEPIA_OK : SEPIA_ERROR_MULTIPART;
+	}
+	return mp->handler->content != NULL ? mp->handler->content(mp->data, data, length) : SEPIA_OK;
+}
+
+static int header(struct multipart * mp, const char * line, size_t length)
+{
+	const char * colon = memchr(line, ':', length);
+	const char * value, * end = line + length;
+	struct tagbstring name_string, value_string;
+
+	if (colon == NULL || colon == line) {
+		return SEPIA_ERROR_MULTIPART;
+	}
+
+	for (value = colon + 1; value < end && (* value == ' ' || * value == '\t'); value++);
+	while (end > value && (end[-1] == ' ' || end[-1] == '\t')) {
+		end--;
+	}
+
+	if (mp->handler->header == NULL) {
+		return SEPIA_OK;
+	}
+
+	btfromblk(name_string, line, colon - line);
+	btfromblk(value_string, value, end - value);
+	return mp->handler->header(mp->data, &name_string, &value_string);
+}
+
+// stops the parser unless result is SEPIA_OK
+static int stop_unless_ok(struct multipart * mp, int result, int next)
+{
+	if (result != SEPIA_OK) {
+		mp->result = result;
+		return STEP_STOP;
+	}
+	return next;
+}
+
+// parses what is in the buffer, returns STEP_NEED_DATA when it needs more
+static int step(struct multipart * mp)
+{
+	const char * data = mp->buffer + mp->start;
+	size_t available = mp->end - mp->start;
+	size_t length;
+	const char * found;
+
+	switch (mp->state) {
+		case STATE_FIRST:
+			// the first delimiter has no line break in front of it if there is no preamble
+			if (available < mp->length - 2) {
+				return STEP_NEED_DATA;
+			}
+			if (memcmp(data, mp->delimiter + 2, mp->length - 2) == 0) {
+				mp->start += mp->length - 2;
+				mp->state = STATE_DELIMITER;
+			} else {
+				mp->state = STATE_PREAMBLE;
+			}
+			return STEP_NEXT;
+
+		case STATE_PREAMBLE:
+			found = find_delimiter(mp, data, available);
+			if (found == NULL) {
+				if (available >= mp->length) {
+					mp->start = mp->end - (mp->length - 1);
+				}
+				return STEP_NEED_DATA;
+			}
+			mp->start += found - data + mp->length;
+			mp->state = STATE_DELIMITER;
+			return STEP_NEXT;
+
+		case STATE_DELIMITER:
+			if (available < 2) {
+				return STEP_NEED_DATA;
+			}
+			// the close delimiter, the epilogue is left to sepia_skip_data()
+			if (data[0] == '-' && data[1] == '-') {
+				return STEP_DONE;
+			}
+			found = memchr(data, '\n', available);
+			if (found == NULL) {
+				return STEP_NEED_DATA;
+			}
+			mp->start += found - data + 1;
+			mp->state = STATE_HEADERS;
+
+			// transport padding
+			for (; data < found && (* data == ' ' || * data == '\t' || * data == '\r'); data++);
+			return stop_unless_ok(mp, data == found ? SEPIA_OK : SEPIA_ERROR_MULTIPART, STEP_NEXT);
+
+		case STATE_HEADERS:
+			found = memchr(data, '\n', available);
+			if (found == NULL) {
+				return STEP_NEED_DATA;
+			}
+			mp->start += found - data + 1;
+
+			length = found - data;
+			if (length > 0 && data[length - 1] == '\r') {
+				length--;
+			}
+			if (length > 0) {
+				return stop_unless_ok(mp, header(mp, data, length), STEP_NEXT);
+			}
+
+			mp->fd = -1;
+			mp->state = STATE_CONTENT;
+			return stop_unless_ok(mp, mp->handler->part != NULL ? mp->handler->part(mp->data, &mp->fd) : SEPIA_OK, STEP_NEXT);
+
+		case STATE_CONTENT:
+			found = find_delimiter(mp, data, available);
+			if (found == NULL) {
+				// the end could be the start of a delimiter
+				if (available < mp->length) {
+					return STEP_NEED_DATA;
+				}
+				length = available - (mp->length - 1);
+				mp->start += length;
+				return stop_unless_ok(mp, content(mp, data, length), STEP_NEED_DATA);
+			}
+			mp->start += found - data + mp->length;
+			mp->state = STATE_DELIMITER;
+
+			if (stop_unless_ok(mp, content(mp, data, found - data), STEP_NEXT) == STEP_STOP) {
+				return STEP_STOP;
+			}
+			return stop_unless_ok(mp, mp->handler->end != NULL ? mp->handler->end(mp->data) : SEPIA_OK, STEP_NEXT);
+	}
+
+	return stop_unless_ok(mp, SEPIA_ERROR_MULTIPART, STEP_NEXT);
+}
+
+int sepia_read_multipart(struct sepia_request * request, const struct sepia_multipart_handler * handler, void * data)
+{
+	const_bstring content_type = sepia_request_attr(request, SEPIA_ATTR_CONTENT_TYPE);
+	struct multipart mp;
+	int result;
+
+	if (content_type == NULL || !boundary(&mp, content_type)) {
+		return SEPIA_ERROR_MULTIPART;
+	}
+	init_shift(&mp);
+
+	mp.handler = handler;
+	mp.data = data;
+	mp.state = STATE_FIRST;
+	mp.fd = -1;
+	mp.start = 0;
+
+	// a body in memory is parsed as a whole, even after sepia_read_string()
+	int in_memory = request->body != NULL;
+	if (in_memory) {
+		mp.buffer = (char *) bdata(request->body);
+		mp.size = mp.end = blength(request->body);
+		request->received_body_length = request->body_length;
+	} else {
+		size_t size = sepia_request_server(request)->config.read_buffer_size;
+		mp.size = size > MULTIPART_BUFFER_SIZE ? size : MULTIPART_BUFFER_SIZE;
+		mp.buffer = GC_MALLOC_ATOMIC(mp.size);
+		mp.end = 0;
+	}
+
+	while ((result = step(&mp)) != STEP_DONE) {
+		if (result == STEP_STOP) {
+			return mp.result;
+		}
+		if (result == STEP_NEED_DATA) {
+			if (in_memory) {
+				return SEPIA_ERROR_MULTIPART;
+			}
+
+			if (mp.start > 0) {
+				memmove(mp.buffer, mp.buffer + mp.start, mp.end - mp.start);
+				mp.end -= mp.start;
+				mp.start = 0;
+			}
+
+			// a header line that does not fit
+			if (mp.end == mp.size) {
+				return SEPIA_ERROR_MULTIPART;
+			}
+
+			int read = sepia_read_data(request, mp.buffer + mp.end, mp.size - mp.end);
+			if (read <= 0) {
+				return SEPIA_ERROR_MULTIPART;
+			}
+			mp.end += read;
+		}
+	}
+
+	return SEPIA_OK;
+}
@@ -0,0 +1,216 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "sepia_test.h"
+
+/*
+  The multipart parser of multipart.c, with bodies in memory and streamed
+  from a socket through its bounded buffer, delimiters cut by the reads and
+  content that looks like the start of one.
+*/
+
+#define CONTENT_TYPE "multipart/form-data; boundary=\"b0undary\""
+
+// what the callbacks have seen, the content of the parts as C[...]
+struct parts {
+	bstring log;
+	int stop_at;
+	int to_file;
+	FILE * file;
+};
+
+static int header(void * data, const_bstring name, const_bstring value)
+{
+	struct parts * parts = data;
+	// views into the buffer, not terminated
+	bcatcstr(parts->log, "H[");
+	bconcat(parts->log, name);
+	bcatcstr(parts->log, "=");
+	bconcat(parts->log, value);
+	bcatcstr(parts->log, "]");
+	return SEPIA_OK;
+}
+
+static int part(void * data, int * fd)
+{
+	struct parts * parts = data;
+	bcatcstr(parts->log, "P");
+	if (parts->to_file) {
+		parts->file = tmpfile();
+		* fd = fileno(parts->file);
+	}
+	return --parts->stop_at == 0 ? 42 : SEPIA_OK;
+}
+
+static int content(void * data, const char * buffer, size_t length)
+{
+	struct parts * parts = data;
+	bcatcstr(parts->log, "C[");
+	bcatblk(parts->log, buffer, length);
+	bcatcstr(parts->log, "]");
+	return SEPIA_OK;
+}
+
+static int end(void * data)
+{
+	struct parts * parts = data;
+	char buffer[4096];
+	size_t read;
+
+	if (parts->file != NULL) {
+		bcatcstr(parts->log, "F[");
+		rewind(parts->file);
+		while ((read = fread(buffer, 1, sizeof(buffer), parts->file)) > 0) {
+			bcatblk(parts->log, buffer, read);
+		}
+		bcatcstr(parts->log, "]");
+		fclose(parts->file);
+		parts->file = NULL;
+	}
+	bcatcstr(parts->log, "E");
+	return SEPIA_OK;
+}
+
+static const struct sepia_multipart_handler handler = { header, part, content, end };
+
+struct writer {
+	int socket;
+	const_bstring body;
+};
+
+static void * write_body(void * data)
+{
+	struct writer * writer = data;
+
+	sepia_write_all(writer->socket, bdata(writer->body), blength(writer->body));
+	close(writer->socket);
+	return NULL;
+}
+
+// parses the body from memory or from a socket, the log merges the pieces of content
+static int parse(const char * content_type, const_bstring body, int streamed, struct parts * parts)
+{
+	struct sepia_server * server = test_server(SEPIA_PROTOCOL_SCGI);
+	bstring length = bformat("%d", blength(body));
+	int sockets[2] = { -1, -1 };
+	pthread_t thread;
+	struct writer writer;
+	int result;
+
+	if (streamed) {
+		socketpair(AF_UNIX, SOCK_STREAM, 0, sockets);
+		writer.socket = sockets[1];
+		writer.body = body;
+		pthread_create(&thread, NULL, write_body, &writer);
+	}
+
+	struct sepia_connection * conn = test_connection(server, sockets[0], "", 0);
+	struct sepia_request * request = test_request(conn, "CONTENT_TYPE", content_type, "CONTENT_LENGTH", bdata(length), NULL);
+	if (!streamed) {
+		request->body = (bstring) body;
+	}
+
+	parts->log = bfromcstr("");
+	parts->file = NULL;
+	result = sepia_read_multipart(request, &handler, parts);
+
+	if (streamed) {
+		pthread_join(thread, NULL);
+		close(sockets[0]);
+	}
+
+	// the content is passed in pieces that depend on the reads
+	struct tagbstring separator = bsStatic("]C[");
+	int found;
+	while ((found = binstr(parts->log, 0, &separator)) != BSTR_ERR) {
+		bstring rest = bmidstr(parts->log, found + 3, blength(parts->log));
+		btrunc(parts->log, found);
+		bconcat(parts->log, rest);
+	}
+
+	return result;
+}
+
+static void check_parts(const char * body, const char * expected)
+{
+	struct tagbstring string;
+	struct parts parts = { NULL, 0, 0, NULL };
+	int streamed;
+
+	btfromcstr(string, body);
+	for (streamed = 0; streamed < 2; streamed++) {
+		CHECK(parse(CONTENT_TYPE, &string, streamed, &parts) == SEPIA_OK);
+		CHECK(biseqcstr(parts.log, expected));
+	}
+}
+
+static void parts()
+{
+	check_parts("--b0undary\r\nContent-Disposition: form-data; name=\"a\"\r\n\r\nvalue a\r\n"
+		"--b0undary  \r\nContent-Type: text/plain\r\nX:y\r\n\r\n\r\n--b0undar\r\n--b0undary--\r\nepilogue",
+		"H[Content-Disposition=form-data; name=\"a\"]PC[value a]EH[Content-Type=text/plain]H[X=y]PC[\r\n--b0undar]E");
+
+	check_parts("preamble\r\n--b0undary\r\n\r\n\r\n--b0undary\r\n\r\nx\r\n--b0undary--",
+		"PEPC[x]E");
+}
+
+// content larger than the buffer, full of near delimiters
+static void large()
+{
+	bstring body = bfromcstr("--b0undary\r\n\r\n");
+	bstring expected = bfromcstr("PC[");
+	int i;
+
+	srand(1);
+	for (i = 0; i < 200000; i++) {
+		const char * pieces[] = { "\r", "\n", "-", "b0undar", "\r\n--b0undar", "x" };
+		const char * piece = pieces[rand() % 6];
+		bcatcstr(body, piece);
+		bcatcstr(expected, piece);
+	}
+	bcatcstr(body, "\r\n--b0undary--");
+	bcatcstr(expected, "]E");
+
+	struct parts parts = { NULL, 0, 0, NULL };
+	CHECK(parse(CONTENT_TYPE, body, 1, &parts) == SEPIA_OK);
+	CHECK(biseq(parts.log, expected));
+
+	parts.to_file = 1;
+	CHECK(parse(CONTENT_TYPE, body, 1, &parts) == SEPIA_OK);
+	bstring file = bstrcpy(expected);
+	file->data[1] = 'F';
+	CHECK(biseq(parts.log, file));
+}
+
+static void errors()
+{
+	struct tagbstring body = bsStatic("--b0undary\r\n\r\none\r\n--b0undary\r\n\r\ntwo\r\n--b0undary--");
+	struct tagbstring truncated = bsStatic("--b0undary\r\n\r\none\r\n--b0und");
+	struct tagbstring padding = bsStatic("--b0undary  x\r\n\r\none\r\n--b0undary--");
+	struct parts parts = { NULL, 0, 0, NULL };
+	int streamed;
+
+	for (streamed = 0; streamed < 2; streamed++) {
+		CHECK(parse("multipart/form-data", &body, streamed, &parts) == SEPIA_ERROR_MULTIPART);
+		CHECK(parse("text/plain; boundary=b0undary", &body, streamed, &parts) == SEPIA_ERROR_MULTIPART);
+		CHECK(parse(CONTENT_TYPE, &truncated, streamed, &parts) == SEPIA_ERROR_MULTIPART);
+		CHECK(parse(CONTENT_TYPE, &padding, streamed, &parts) == SEPIA_ERROR_MULTIPART);
+
+		// the value of the callback that stops the parser
+		parts.stop_at = 2;
+		CHECK(parse(CONTENT_TYPE, &body, streamed, &parts) == 42);
+		CHECK(biseqcstr(parts.log, "PC[one]EP"));
+	}
+}
+
+int main()
+{
+	sepia_init();
+
+	parts();
+	large();
+	errors();
+
+	return test_result("multipart");
+}
@@ -0,0 +1,228 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "sepia_internal.h"
+
+/*
+  The parameters of the query string. On the first lookup the name=value
+  pairs are indexed as views of the query string, in one block together
+  with a buffer of its length. A value is percent-decoded and terminated
+  in that buffer the first time it is asked for, the others are never
+  touched. A parameter without = has the empty value.
+*/
+
+struct query_param {
+	struct tagbstring name;
+	struct tagbstring value;
+	int decoded;
+};
+
+struct sepia_query {
+	size_t count;
+
+	// the decoded names and values, never more than the query string with a zero per value
+	char * buffer;
+	size_t used;
+
+	struct query_param param[];
+};
+
+static int hex_value(unsigned char c)
+{
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	}
+	c |= 0x20;
+	return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+size_t sepia_url_decode(const char * data, size_t length, char * out, int * malformed)
+{
+	size_t i, n = 0;
+
+	for (i = 0; i < length; i++) {
+		int high, low;
+
+		if (data[i] == '+') {
+			out[n++] = ' ';
+		} else if (data[i] == '%' && i + 2 < length && (high = hex_value(data[i + 1])) >= 0 && (low = hex_value(data[i + 2])) >= 0) {
+			out[n++] = (char) (high << 4 | low);
+			i += 2;
+		} else {
+			// a malformed escape is kept as it is
+			if (data[i] == '%' && malformed != NULL) {
+				* malformed = 1;
+			}
+			out[n++] = data[i];
+		}
+	}
+
+	return n;
+}
+
+static int needs_decoding(const_bstring string)
+{
+	return memchr(string->data, '%', string->slen) != NULL || memchr(string->data, '+', string->slen) != NULL;
+}
+
+// decodes string into the buffer of the query if it has to be or if terminate is set
+static void decode(struct sepia_query * query, struct tagbstring * string, int terminate)
+{
+	if (terminate || needs_decoding(string)) {
+		char * out = query->buffer + query->used;
+		size_t length = sepia_url_decode((char *) string->data, string->slen, out, NULL);
+
+		if (terminate) {
+			out[length] = '\0';
+			query->used++;
+		}
+		query->used += length;
+		btfromblk(* string, out, length);
+	}
+}
+
+static struct sepia_query * index_query(const_bstring query_string)
+{
+	const char * data = bdata(query_string);
+	size_t length = blength(query_string);
+	size_t i, count = 1;
+
+	for (i = 0; i < length; i++) {
+		count += data[i] == '&';
+	}
+
+	char * block = GC_MALLOC(sizeof(struct sepia_query) + count * sizeof(struct query_param) + length + count);
+	struct sepia_query * query = (struct sepia_query *) block;
+	query->buffer = block + sizeof(struct sepia_query) + count * sizeof(struct query_param);
+	query->used = 0;
+	query->count = 0;
+
+	const char * start = data, * end = data + length;
+	while (start < end) {
+		const char * next = memchr(start, '&', end - start);
+		const char * equals;
+
+		if (next == NULL) {
+			next = end;
+		}
+
+		// empty pairs, as in a&&b, are skipped
+		if (next > start) {
+			struct query_param * param = &query->param[query->count++];
+
+			equals = memchr(start, '=', next - start);
+			if (equals == NULL) {
+				btfromblk(param->name, start, next - start);
+				btfromblk(param->value, next, 0);
+			} else {
+				btfromblk(param->name, start, equals - start);
+				btfromblk(param->value, equals + 1, next - equals - 1);
+			}
+			param->decoded = 0;
+
+			// the names have to be decoded to be found
+			decode(query, &param->name, 0);
+		}
+
+		start = next + 1;
+	}
+
+	return query;
+}
+
+const_bstring sepia_query_param_n(struct sepia_request * request, const_bstring name, size_t n)
+{
+	size_t i;
+
+	if (name == NULL) {
+		return NULL;
+	}
+	if (request->query == NULL) {
+		if (request->query_string == NULL) {
+			return NULL;
+		}
+		request->query = index_query(request->query_string);
+	}
+
+	for (i = 0; i < request->query->count; i++) {
+		struct query_param * param = &request->query->param[i];
+
+		if (param->name.slen == blength(name) && memcmp(param->name.data, name->data, name->slen) == 0 && n-- == 0) {
+			if (!param->decoded) {
+				decode(request->query, &param->value, 1);
+				param->decoded = 1;
+			}
+			return &param->value;
+		}
+	}
+
+	return NULL;
+}
+
+const_bstring sepia_query_param(struct sepia_request * request, const_bstring name)
+{
+	return sepia_query_param_n(request, name, 0);
+}
+
+size_t sepia_query_param_count(struct sepia_request * request, const_bstring name)
+{
+	size_t n = 0;
+
+	while (sepia_query_param_n(request, name, n) != NULL) {
+		n++;
+	}
+
+	return n;
+}
+
+int64_t sepia_query_param_int64(struct sepia_request * request, const_bstring name, int64_t otherwise)
+{
+	const_bstring value = sepia_query_param(request, name);
+	int64_t result;
+
+	if (value == NULL || !sepia_parse_int64(bdata(value), blength(value), &result)) {
+		return otherwise;
+	}
+
+	return result;
+}
+
+static struct tagbstring TRUE_VALUES[] = { bsStatic(""), bsStatic("1"), bsStatic("true"), bsStatic("yes"), bsStatic("on") };
+static struct tagbstring FALSE_VALUES[] = { bsStatic("0"), bsStatic("false"), bsStatic("no"), bsStatic("off") };
+
+int sepia_query_param_bool(struct sepia_request * request, const_bstring name, int otherwise)
+{
+	const_bstring value = sepia_query_param(request, name);
+	size_t i;
+
+	if (value == NULL) {
+		return otherwise;
+	}
+
+	for (i = 0; i < sizeof(TRUE_VALUES) / sizeof(TRUE_VALUES[0]); i++) {
+		if (biseqcaseless(value, &TRUE_VALUES[i]) == 1) {
+			return 1;
+		}
+	}
+	for (i = 0; i < sizeof(FALSE_VALUES) / sizeof(FALSE_VALUES[0]); i++) {
+		if (biseqcaseless(value, &FALSE_VALUES[i]) == 1) {
+			return 0;
+		}
+	}
+
+	return otherwise;
+}
+
+double sepia_query_param_double(struct sepia_request * request, const_bstring name, double otherwise)
+{
+	const_bstring value = sepia_query_param(request, name);
+	char * end;
+
+	if (value == NULL || blength(value) == 0) {
+		return otherwise;
+	}
+
+	// the values are terminated, but may contain a decoded zero
+	double result = strtod((char *) value->data, &end);
+	return end == (char *) value->data + blength(value) ? result : otherwise;
+}
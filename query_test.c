@@ -0,0 +1,97 @@
+#include "sepia_test.h"
+
+/*
+  The query string parameters of query.c: found by their decoded names,
+  repeated, without a value and converted to numbers and booleans.
+*/
+
+static struct sepia_request * query(const char * query_string)
+{
+	struct sepia_connection * conn = test_connection(test_server(SEPIA_PROTOCOL_SCGI), -1, "", 0);
+
+	if (query_string == NULL) {
+		return test_request(conn, "REQUEST_METHOD", "GET", NULL);
+	}
+	return test_request(conn, "QUERY_STRING", query_string, NULL);
+}
+
+static const_bstring param(struct sepia_request * request, const char * name)
+{
+	struct tagbstring string;
+
+	btfromcstr(string, name);
+	return sepia_query_param(request, &string);
+}
+
+static void lookup()
+{
+	struct sepia_request * request = query("a=1&b=x+y%21&&c&d=&%6e%61me=v%2&e=%zz&a=2&f=%00z");
+	struct tagbstring a = bsStatic("a"), none = bsStatic("none");
+
+	CHECK_STRING(param(request, "a"), "1");
+	CHECK_STRING(param(request, "b"), "x y!");
+	CHECK_STRING(param(request, "c"), "");
+	CHECK_STRING(param(request, "d"), "");
+	CHECK_STRING(param(request, "name"), "v%2");
+	CHECK_STRING(param(request, "e"), "%zz");
+	CHECK(param(request, "none") == NULL);
+	CHECK(param(request, "") == NULL);
+	CHECK(sepia_query_param(request, NULL) == NULL);
+
+	// the values are terminated, a decoded zero is part of the value
+	const_bstring value = param(request, "f");
+	CHECK(value != NULL && blength(value) == 2 && bdata(value)[0] == 0 && bdata(value)[1] == 'z' && bdata(value)[2] == 0);
+	value = param(request, "b");
+	CHECK(value != NULL && bdata(value)[blength(value)] == 0);
+
+	// the same value again, decoded once
+	CHECK(param(request, "b") == value);
+
+	CHECK(sepia_query_param_count(request, &a) == 2);
+	CHECK_STRING(sepia_query_param_n(request, &a, 1), "2");
+	CHECK(sepia_query_param_n(request, &a, 2) == NULL);
+	CHECK(sepia_query_param_count(request, &none) == 0);
+
+	CHECK(param(query(NULL), "a") == NULL);
+	CHECK(param(query(""), "a") == NULL);
+	CHECK_STRING(param(query("a"), "a"), "");
+	CHECK_STRING(param(query("=x&a=y"), "a"), "y");
+}
+
+static void conversions()
+{
+	struct sepia_request * request = query("i=-42&big=9223372036854775808&min=-9223372036854775808&x=4x&t=TRUE&y=yes&o=off&e&m=maybe&d=2.5e1&n=");
+	struct tagbstring i = bsStatic("i"), big = bsStatic("big"), min = bsStatic("min"), x = bsStatic("x"), t = bsStatic("t"),
+		y = bsStatic("y"), o = bsStatic("o"), e = bsStatic("e"), m = bsStatic("m"), d = bsStatic("d"), n = bsStatic("n"),
+		none = bsStatic("none");
+
+	CHECK(sepia_query_param_int64(request, &i, 0) == -42);
+	CHECK(sepia_query_param_int64(request, &big, 7) == 7);
+	CHECK(sepia_query_param_int64(request, &min, 0) == INT64_MIN);
+	CHECK(sepia_query_param_int64(request, &x, 7) == 7);
+	CHECK(sepia_query_param_int64(request, &e, 7) == 7);
+	CHECK(sepia_query_param_int64(request, &none, 7) == 7);
+
+	CHECK(sepia_query_param_bool(request, &t, 0) == 1);
+	CHECK(sepia_query_param_bool(request, &y, 0) == 1);
+	CHECK(sepia_query_param_bool(request, &o, 1) == 0);
+	CHECK(sepia_query_param_bool(request, &e, 0) == 1);
+	CHECK(sepia_query_param_bool(request, &m, -1) == -1);
+	CHECK(sepia_query_param_bool(request, &none, -1) == -1);
+
+	CHECK(sepia_query_param_double(request, &d, 0) == 25.0);
+	CHECK(sepia_query_param_double(request, &i, 0) == -42.0);
+	CHECK(sepia_query_param_double(request, &x, 1.5) == 1.5);
+	CHECK(sepia_query_param_double(request, &n, 1.5) == 1.5);
+	CHECK(sepia_query_param_double(request, &none, 1.5) == 1.5);
+}
+
+int main()
+{
+	sepia_init();
+
+	lookup();
+	conversions();
+
+	return test_result("query");
+}
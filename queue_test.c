@@ -0,0 +1,116 @@
+#include "sepia_test.h"
+
+/*
+  The bounded MPMC queue of scheduler.c, which is included for its static
+  functions, so this program is linked without it. The requests in the
+  queue are numbers, they are never dereferenced.
+*/
+#include "scheduler.c"
+
+#define THREADS 4
+#define ITEMS   200000
+
+static struct worker worker;
+static unsigned char seen[THREADS * ITEMS];
+static size_t taken;
+
+static struct sepia_request * item(size_t n)
+{
+	return (struct sepia_request *) (uintptr_t) (n + 1);
+}
+
+static void init_queue()
+{
+	size_t j;
+
+	memset(&worker, 0, sizeof(worker));
+	worker.cells = GC_MALLOC(QUEUE_SIZE * sizeof(struct cell));
+	for (j = 0; j < QUEUE_SIZE; j++) {
+		worker.cells[j].sequence = j;
+	}
+}
+
+static void bounds()
+{
+	size_t n;
+
+	init_queue();
+	CHECK(dequeue(&worker) == NULL);
+
+	// full at its size, in order and empty again, twice around the cells
+	for (n = 0; n < QUEUE_SIZE; n++) {
+		CHECK(enqueue(&worker, item(n)));
+	}
+	CHECK(!enqueue(&worker, item(n)));
+	for (n = 0; n < QUEUE_SIZE / 2; n++) {
+		CHECK(dequeue(&worker) == item(n));
+	}
+	for (n = QUEUE_SIZE; n < QUEUE_SIZE * 3 / 2; n++) {
+		CHECK(enqueue(&worker, item(n)));
+	}
+	CHECK(!enqueue(&worker, item(n)));
+	for (n = QUEUE_SIZE / 2; n < QUEUE_SIZE * 3 / 2; n++) {
+		CHECK(dequeue(&worker) == item(n));
+	}
+	CHECK(dequeue(&worker) == NULL);
+}
+
+static void * produce(void * data)
+{
+	size_t n, first = (uintptr_t) data * ITEMS;
+
+	for (n = first; n < first + ITEMS; n++) {
+		while (!enqueue(&worker, item(n))) {
+			sched_yield();
+		}
+	}
+	return NULL;
+}
+
+static void * consume(void * data)
+{
+	struct sepia_request * request;
+
+	while (__atomic_load_n(&taken, __ATOMIC_RELAXED) < THREADS * ITEMS) {
+		if ((request = dequeue(&worker)) == NULL) {
+			sched_yield();
+			continue;
+		}
+		__atomic_add_fetch(&seen[(uintptr_t) request - 1], 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&taken, 1, __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+// every item is taken once by one of the consumers
+static void concurrent()
+{
+	pthread_t producers[THREADS], consumers[THREADS];
+	size_t i, once = 0;
+
+	init_queue();
+	for (i = 0; i < THREADS; i++) {
+		pthread_create(&consumers[i], NULL, consume, NULL);
+		pthread_create(&producers[i], NULL, produce, (void *) (uintptr_t) i);
+	}
+	for (i = 0; i < THREADS; i++) {
+		pthread_join(producers[i], NULL);
+		pthread_join(consumers[i], NULL);
+	}
+
+	for (i = 0; i < THREADS * ITEMS; i++) {
+		once += seen[i] == 1;
+	}
+	CHECK(once == THREADS * ITEMS);
+	CHECK(dequeue(&worker) == NULL);
+}
+
+int main()
+{
+	sepia_init();
+
+	bounds();
+	concurrent();
+
+	return test_result("queue");
+}
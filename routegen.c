@@ -0,0 +1,415 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+  sepia-routegen generates the router of a fixed set of routes at build
+  time. It reads a manifest with one route per line:
+
+    # method  path           handler       [async]
+    GET       /users/{id}    get_user
+    POST      /users         create_user   async
+
+  and writes C source with a function that mounts the handlers and
+  registers a router for them with sepia_server_router() or
+  sepia_use_router(). The router switches on the method and on the number
+  of path segments and compares the literal segments with memcmp. It
+  matches like the router of the mounts: the longest match wins, then the
+  route with a literal segment where the other has a path variable, or a
+  typed path variable where the other has an untyped one, then the first
+  one of the manifest.
+
+  Usage: sepia-routegen [-n function] manifest [output.c]
+
+  The generated function is sepia_routes() by default. Call it once, with
+  the server or NULL for the default server, before the server is started:
+
+    void sepia_routes(struct sepia_server * server);
+*/
+
+#define MAX_LINE 4096
+#define MAX_SEGMENTS 64
+
+struct route {
+	int index;
+	char * method;
+	char * path;
+	char * handler;
+	int async;
+
+	// the segments of the path without the trailing empty ones and their kinds
+	int qty;
+	char * segment[MAX_SEGMENTS];
+	int kind[MAX_SEGMENTS];
+};
+
+static const char * manifest;
+static int line_number;
+
+static void fail(const char * message, const char * detail)
+{
+	fprintf(stderr, "%s:%d: %s %s\n", manifest, line_number, message, detail);
+	exit(1);
+}
+
+static int is_identifier(const char * name)
+{
+	if (!isalpha((unsigned char) * name) && * name != '_') {
+		return 0;
+	}
+	while (* ++name != '\0') {
+		if (!isalnum((unsigned char) * name) && * name != '_') {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// the kinds of segments, in the order they are tried in
+#define LITERAL 0
+#define INT     1
+#define UUID    2
+#define ANY     3
+
+static int kind_of(const char * segment)
+{
+	const char * colon = strchr(segment, ':');
+
+	if (* segment == '\0') {
+		return ANY;
+	} else if (* segment != '{') {
+		return LITERAL;
+	} else if (colon == NULL) {
+		return ANY;
+	} else if (strcmp(colon, ":int}") == 0) {
+		return INT;
+	} else if (strcmp(colon, ":uuid}") == 0) {
+		return UUID;
+	}
+
+	fail("unknown type of path variable", segment);
+	return ANY;
+}
+
+// the checks of the typed path variables, the same as the ones of the library
+static const char * int_check =
+	"static int is_int(const_bstring segment)\n"
+	"{\n"
+	"\tconst unsigned char * digit = segment->data, * end = digit + segment->slen;\n"
+	"\tuint64_t value = 0, limit = INT64_MAX;\n\n"
+	"\tif (digit < end && (* digit == '-' || * digit == '+')) {\n"
+	"\t\tlimit += * digit++ == '-';\n"
+	"\t}\n"
+	"\tif (digit == end) {\n"
+	"\t\treturn 0;\n"
+	"\t}\n"
+	"\tfor (; digit < end; digit++) {\n"
+	"\t\tif (* digit < '0' || * digit > '9' || value > (limit - (* digit - '0')) / 10) {\n"
+	"\t\t\treturn 0;\n"
+	"\t\t}\n"
+	"\t\tvalue = value * 10 + (* digit - '0');\n"
+	"\t}\n"
+	"\treturn 1;\n"
+	"}\n\n";
+
+static const char * uuid_check =
+	"static int is_uuid(const_bstring segment)\n"
+	"{\n"
+	"\tint i;\n\n"
+	"\tif (segment->slen != 36) {\n"
+	"\t\treturn 0;\n"
+	"\t}\n"
+	"\tfor (i = 0; i < 36; i++) {\n"
+	"\t\tunsigned char c = segment->data[i];\n"
+	"\t\tif (i == 8 || i == 13 || i == 18 || i == 23 ? c != '-' : !((c >= '0' && c <= '9') || ((c | 0x20) >= 'a' && (c | 0x20) <= 'f'))) {\n"
+	"\t\t\treturn 0;\n"
+	"\t\t}\n"
+	"\t}\n"
+	"\treturn 1;\n"
+	"}\n\n";
+
+// splits the path like the mounts do, "/a/b" has the segments "", "a" and "b"
+static void split_path(struct route * route)
+{
+	char * start = strdup(route->path);
+	char * end;
+	int i;
+
+	route->qty = 0;
+	do {
+		if (route->qty == MAX_SEGMENTS) {
+			fail("too many segments in", route->path);
+		}
+
+		end = strchr(start, '/');
+		if (end != NULL) {
+			* end = '\0';
+		}
+
+		route->segment[route->qty++] = start;
+		start = end + 1;
+	} while (end != NULL);
+
+	// the router of the mounts ignores them too
+	while (route->qty > 0 && * route->segment[route->qty - 1] == '\0') {
+		route->qty--;
+	}
+
+	for (i = 0; i < route->qty; i++) {
+		route->kind[i] = kind_of(route->segment[i]);
+	}
+}
+
+static int parse_line(char * line, struct route * route)
+{
+	char * field[5];
+	int n = 0;
+	char * token = strtok(line, " \t\r\n");
+
+	while (token != NULL && * token != '#' && n < 5) {
+		field[n++] = token;
+		token = strtok(NULL, " \t\r\n");
+	}
+
+	if (n == 0) {
+		return 0;
+	}
+	if (n < 3 || n > 4 || (n == 4 && strcmp(field[3], "async") != 0)) {
+		fail("expected method, path, handler and optionally async, not", field[0]);
+	}
+	if (* field[1] != '/') {
+		fail("the path has to start with a slash:", field[1]);
+	}
+	if (!is_identifier(field[2])) {
+		fail("the handler is not a C identifier:", field[2]);
+	}
+
+	route->method = strdup(field[0]);
+	route->path = strdup(field[1]);
+	route->handler = strdup(field[2]);
+	route->async = n == 4;
+
+	split_path(route);
+	return 1;
+}
+
+static int compare_methods(const struct route * x, const struct route * y)
+{
+	size_t x_length = strlen(x->method);
+	size_t y_length = strlen(y->method);
+
+	return x_length != y_length ? (int) x_length - (int) y_length : strcmp(x->method, y->method);
+}
+
+// the order the routes of a method are tried in
+static int compare_routes(const void * a, const void * b)
+{
+	const struct route * x = a;
+	const struct route * y = b;
+	int i;
+
+	if (x->qty != y->qty) {
+		return y->qty - x->qty;
+	}
+
+	for (i = 0; i < x->qty; i++) {
+		if (x->kind[i] != y->kind[i]) {
+			return x->kind[i] - y->kind[i];
+		}
+	}
+
+	return x->index - y->index;
+}
+
+static void print_string(FILE * out, const char * string)
+{
+	fputc('"', out);
+	for (; * string != '\0'; string++) {
+		unsigned char c = * string;
+		if (c == '"' || c == '\\') {
+			fprintf(out, "\\%c", c);
+		} else if (c < 32 || c > 126) {
+			fprintf(out, "\\%03o", c);
+		} else {
+			fputc(c, out);
+		}
+	}
+	fputc('"', out);
+}
+
+static void print_matcher(FILE * out, int number, struct route * routes, int count)
+{
+	int i = 0, j, qty;
+	int max = routes[0].qty;
+
+	fprintf(out, "static struct sepia_mount * route_%d(struct bstrList * path)\n{\n", number);
+
+	if (max > 0) {
+		fprintf(out, "\tswitch (path->qty < %d ? path->qty : %d) {\n", max, max);
+
+		// every case falls through to the shorter routes, which match as prefixes
+		for (qty = max; qty > 0; qty--) {
+			int first = i;
+
+			fprintf(out, "\t\tcase %d:\n", qty);
+			for (; i < count && routes[i].qty == qty; i++) {
+				int checks = 0;
+
+				fprintf(out, "\t\t\t");
+				for (j = 0; j < qty; j++) {
+					int kind = routes[i].kind[j];
+
+					if (kind != ANY) {
+						fprintf(out, checks++ == 0 ? "if (" : " && ");
+					}
+					if (kind == LITERAL) {
+						fprintf(out, "SEGMENT(%d, ", j);
+						print_string(out, routes[i].segment[j]);
+						fprintf(out, ")");
+					} else if (kind != ANY) {
+						fprintf(out, "%s(path->entry[%d])", kind == INT ? "is_int" : "is_uuid", j);
+					}
+				}
+				fprintf(out, checks > 0 ? ") return mounts[%d];\n" : "return mounts[%d];\n", routes[i].index);
+			}
+			if (qty > 1 && i > first) {
+				fprintf(out, "\t\t\t// fall through\n");
+			}
+		}
+
+		fprintf(out, "\t\t\tbreak;\n\t}\n");
+	}
+
+	fprintf(out, i < count ? "\treturn mounts[%d];\n}\n\n" : "\treturn NULL;\n}\n\n", i < count ? routes[i].index : 0);
+}
+
+int main(int argc, char ** args)
+{
+	const char * function = "sepia_routes";
+	int i, j, count = 0, methods = 0;
+	char line[MAX_LINE];
+	FILE * in, * out = stdout;
+
+	if (argc > 2 && strcmp(args[1], "-n") == 0) {
+		function = args[2];
+		args += 2;
+		argc -= 2;
+	}
+
+	if (argc < 2 || argc > 3 || !is_identifier(function)) {
+		fprintf(stderr, "Usage: sepia-routegen [-n function] manifest [output.c]\n");
+		return 1;
+	}
+
+	manifest = args[1];
+	if ((in = fopen(manifest, "r")) == NULL) {
+		fprintf(stderr, "Could not open %s!\n", manifest);
+		return 1;
+	}
+
+	struct route * routes = NULL;
+	while (fgets(line, sizeof(line), in) != NULL) {
+		line_number++;
+		if (strchr(line, '\n') == NULL && !feof(in)) {
+			fail("the line is too long", "");
+		}
+
+		routes = realloc(routes, (count + 1) * sizeof(struct route));
+		if (parse_line(line, &routes[count])) {
+			routes[count].index = count;
+			count++;
+		}
+	}
+	fclose(in);
+
+	if (count == 0) {
+		fprintf(stderr, "%s: no routes\n", manifest);
+		return 1;
+	}
+
+	// the mounts are made in the order of the manifest, the matchers need them by the length and the name of the method
+	struct route * sorted = malloc(count * sizeof(struct route));
+	memcpy(sorted, routes, count * sizeof(struct route));
+	for (i = 1; i < count; i++) {
+		struct route route = sorted[i];
+		for (j = i; j > 0 && compare_methods(&sorted[j - 1], &route) > 0; j--) {
+			sorted[j] = sorted[j - 1];
+		}
+		sorted[j] = route;
+	}
+
+	if (argc == 3 && (out = fopen(args[2], "w")) == NULL) {
+		fprintf(stderr, "Could not write %s!\n", args[2]);
+		return 1;
+	}
+
+	fprintf(out, "/* Generated by sepia-routegen from %s, do not edit. */\n\n", manifest);
+	fprintf(out, "#include <string.h>\n#include <sepia.h>\n\n");
+	fprintf(out, "#define SEGMENT(n, s) (blength(path->entry[n]) == sizeof(s) - 1 && memcmp(path->entry[n]->data, s, sizeof(s) - 1) == 0)\n\n");
+
+	int kinds[ANY + 1] = { 0 };
+	for (i = 0; i < count; i++) {
+		for (j = 0; j < routes[i].qty; j++) {
+			kinds[routes[i].kind[j]] = 1;
+		}
+	}
+	if (kinds[INT]) {
+		fputs(int_check, out);
+	}
+	if (kinds[UUID]) {
+		fputs(uuid_check, out);
+	}
+
+	for (i = 0; i < count; i++) {
+		for (j = 0; j < i && strcmp(routes[j].handler, routes[i].handler) != 0; j++);
+		if (j == i) {
+			fprintf(out, "void %s(struct sepia_request *);\n", routes[i].handler);
+		}
+	}
+	fprintf(out, "\nstatic struct sepia_mount * mounts[%d];\n\n", count);
+
+	for (i = 0; i < count; i = j) {
+		for (j = i; j < count && compare_methods(&sorted[j], &sorted[i]) == 0; j++);
+		qsort(sorted + i, j - i, sizeof(struct route), &compare_routes);
+		print_matcher(out, methods++, sorted + i, j - i);
+	}
+
+	fprintf(out, "static struct sepia_mount * route(const_bstring method, struct bstrList * path)\n{\n");
+	fprintf(out, "\tswitch (blength(method)) {\n");
+	for (i = 0, methods = 0; i < count; i++) {
+		size_t length = strlen(sorted[i].method);
+
+		if (i > 0 && strcmp(sorted[i - 1].method, sorted[i].method) == 0) {
+			continue;
+		}
+		if (i == 0 || strlen(sorted[i - 1].method) != length) {
+			fprintf(out, i == 0 ? "\t\tcase %zu:\n" : "\t\t\tbreak;\n\t\tcase %zu:\n", length);
+		}
+
+		fprintf(out, "\t\t\tif (memcmp(method->data, ");
+		print_string(out, sorted[i].method);
+		fprintf(out, ", %zu) == 0) return route_%d(path);\n", length, methods++);
+	}
+	fprintf(out, "\t\t\tbreak;\n");
+	fprintf(out, "\t}\n\treturn NULL;\n}\n\n");
+
+	fprintf(out, "void %s(struct sepia_server * server)\n{\n", function);
+	for (i = 0; i < count; i++) {
+		fprintf(out, "\tmounts[%d] = server == NULL\n\t\t? sepia_mount%s(", i, routes[i].async ? "_async" : "");
+		print_string(out, routes[i].method);
+		fprintf(out, ", ");
+		print_string(out, routes[i].path);
+		fprintf(out, ", &%s)\n\t\t: sepia_server_mount%s(server, ", routes[i].handler, routes[i].async ? "_async" : "");
+		print_string(out, routes[i].method);
+		fprintf(out, ", ");
+		print_string(out, routes[i].path);
+		fprintf(out, ", &%s);\n", routes[i].handler);
+	}
+	fprintf(out, "\n\tif (server == NULL) {\n\t\tsepia_use_router(&route);\n\t} else {\n\t\tsepia_server_router(server, &route);\n\t}\n}\n");
+
+	if (out != stdout) {
+		fclose(out);
+	}
+	return 0;
+}
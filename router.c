@@ -0,0 +1,314 @@
+#include <string.h>
+
+#include "sepia_internal.h"
+
+/*
+  The router of a mount table. The mounts of every method are compiled into
+  a tree with one edge per path segment: the literal segments are static
+  edges, kept in a hash table of their node, the path variables share one
+  parameter edge per type. Every node that ends a mount is a prefix edge too, it
+  matches the longer paths below it. A request walks down its path segment
+  by segment, so the cost of a lookup depends on the length of the path
+  and not on the number of mounts.
+
+  The longest match wins, of matches of the same length the one with a
+  static segment where the other has a path variable, and a typed path
+  variable before an untyped one. A typed path variable only matches the
+  segments that are values of its type.
+  Of mounts with the same path the first one is used. An empty segment of
+  a mount path matches every segment, trailing ones are ignored, so "/"
+  matches all paths.
+*/
+
+struct route_node {
+	const_bstring segment;
+	uint32_t hash;
+
+	// the static edges, an open addressing table of mask + 1 slots once compiled
+	struct route_node ** children;
+	size_t count;
+	size_t mask;
+
+	// by SEPIA_VAR_ type
+	struct route_node * param[SEPIA_VAR_TYPES];
+	struct sepia_mount * mount;
+};
+
+struct route_method {
+	const_bstring method;
+	struct route_node * root;
+};
+
+struct sepia_router {
+	size_t count;
+	struct route_method method[];
+};
+
+int sepia_parse_int64(const char * data, size_t length, int64_t * value)
+{
+	uint64_t result = 0, limit = INT64_MAX;
+	size_t i = 0;
+
+	if (length > 0 && (data[0] == '-' || data[0] == '+')) {
+		if (data[0] == '-') {
+			limit = (uint64_t) INT64_MAX + 1;
+		}
+		i++;
+	}
+	if (i == length) {
+		return 0;
+	}
+
+	for (; i < length; i++) {
+		unsigned digit = (unsigned char) data[i] - '0';
+		if (digit > 9 || result > (limit - digit) / 10) {
+			return 0;
+		}
+		result = result * 10 + digit;
+	}
+
+	* value = data[0] == '-' ? (int64_t) (0 - result) : (int64_t) result;
+	return 1;
+}
+
+// 8-4-4-4-12 hexadecimal digits
+static int is_uuid(const_bstring segment)
+{
+	int i;
+
+	if (blength(segment) != 36) {
+		return 0;
+	}
+
+	for (i = 0; i < 36; i++) {
+		unsigned char c = bdata(segment)[i];
+		if (i == 8 || i == 13 || i == 18 || i == 23) {
+			if (c != '-') {
+				return 0;
+			}
+		} else if (!((c >= '0' && c <= '9') || ((c | 0x20) >= 'a' && (c | 0x20) <= 'f'))) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+int sepia_var_matches(int type, const_bstring segment)
+{
+	int64_t value;
+
+	switch (type) {
+		case SEPIA_VAR_INT:
+			return sepia_parse_int64(bdata(segment), blength(segment), &value);
+		case SEPIA_VAR_UUID:
+			return is_uuid(segment);
+		default:
+			return 1;
+	}
+}
+
+static struct route_node * new_node(const_bstring segment)
+{
+	struct route_node * node = GC_MALLOC(sizeof(struct route_node));
+
+	node->segment = segment;
+	node->hash = segment == NULL ? 0 : sepia_hash(bdata(segment), blength(segment));
+	return node;
+}
+
+static struct route_node * static_child(struct route_node * node, const_bstring segment)
+{
+	size_t i;
+
+	for (i = 0; i < node->count; i++) {
+		if (biseq(node->children[i]->segment, segment) == 1) {
+			return node->children[i];
+		}
+	}
+
+	struct route_node * child = new_node(segment);
+
+	// while compiling the edges are a list, it doubles when it is full
+	if ((node->count & (node->count - 1)) == 0) {
+		struct route_node ** children = GC_MALLOC((node->count == 0 ? 1 : node->count * 2) * sizeof(struct route_node *));
+		if (node->count > 0) {
+			memcpy(children, node->children, node->count * sizeof(struct route_node *));
+		}
+		node->children = children;
+	}
+
+	node->children[node->count++] = child;
+	return child;
+}
+
+static void insert(struct route_node * root, struct sepia_mount * mount)
+{
+	struct route_node * node = root;
+	int i, qty = mount->path->qty;
+
+	while (qty > 0 && blength(mount->path->entry[qty - 1]) == 0) {
+		qty--;
+	}
+
+	for (i = 0; i < qty; i++) {
+		const_bstring segment = mount->path->entry[i];
+
+		if (mount->path_var[i] != SEPIA_VAR_NONE || blength(segment) == 0) {
+			int type = blength(segment) == 0 ? SEPIA_VAR_STRING : mount->path_var[i];
+			if (node->param[type] == NULL) {
+				node->param[type] = new_node(NULL);
+			}
+			node = node->param[type];
+		} else {
+			node = static_child(node, segment);
+		}
+	}
+
+	if (node->mount == NULL) {
+		node->mount = mount;
+	}
+}
+
+// turns the lists of static edges into hash tables
+static void index_children(struct route_node * node)
+{
+	size_t i, size = 2;
+
+	if (node->count > 0) {
+		while (size < node->count * 2) {
+			size *= 2;
+		}
+
+		struct route_node ** table = GC_MALLOC(size * sizeof(struct route_node *));
+		for (i = 0; i < node->count; i++) {
+			size_t slot = node->children[i]->hash & (size - 1);
+			while (table[slot] != NULL) {
+				slot = (slot + 1) & (size - 1);
+			}
+			table[slot] = node->children[i];
+			index_children(node->children[i]);
+		}
+
+		node->children = table;
+		node->mask = size - 1;
+	}
+
+	for (i = SEPIA_VAR_INT; i < SEPIA_VAR_TYPES; i++) {
+		if (node->param[i] != NULL) {
+			index_children(node->param[i]);
+		}
+	}
+}
+
+struct sepia_router * sepia_router_compile(struct sepia_mount_table * table)
+{
+	size_t i, j, methods = 0;
+	size_t count = table == NULL ? 0 : table->count;
+	struct sepia_router * router = GC_MALLOC(sizeof(struct sepia_router) + count * sizeof(struct route_method));
+
+	for (i = 0; i < count; i++) {
+		struct sepia_mount * mount = table->mount[i];
+
+		for (j = 0; j < methods; j++) {
+			if (biseq(router->method[j].method, mount->method) == 1) {
+				break;
+			}
+		}
+		if (j == methods) {
+			router->method[j].method = mount->method;
+			router->method[j].root = new_node(NULL);
+			methods++;
+		}
+
+		insert(router->method[j].root, mount);
+	}
+
+	for (j = 0; j < methods; j++) {
+		index_children(router->method[j].root);
+	}
+
+	router->count = methods;
+	return router;
+}
+
+// the mount of the longest match below node, its number of segments is stored in length
+static struct sepia_mount * match(struct route_node * node, struct bstrList * path, int depth, int * length)
+{
+	struct sepia_mount * found = NULL;
+	int found_length = 0;
+
+	if (depth < path->qty) {
+		const_bstring segment = path->entry[depth];
+
+		if (node->count > 0) {
+			uint32_t hash = sepia_hash(bdata(segment), blength(segment));
+			size_t slot = hash & node->mask;
+			struct route_node * child;
+
+			while ((child = node->children[slot]) != NULL) {
+				if (child->hash == hash && biseq(child->segment, segment) == 1) {
+					found = match(child, path, depth + 1, &found_length);
+					break;
+				}
+				slot = (slot + 1) & node->mask;
+			}
+		}
+
+		// a path variable only wins if it matches more of the path
+		int type;
+		for (type = SEPIA_VAR_INT; type < SEPIA_VAR_TYPES && (found == NULL || found_length < path->qty); type++) {
+			if (node->param[type] != NULL && sepia_var_matches(type, segment)) {
+				int param_length;
+				struct sepia_mount * mount = match(node->param[type], path, depth + 1, &param_length);
+				if (mount != NULL && (found == NULL || param_length > found_length)) {
+					found = mount;
+					found_length = param_length;
+				}
+			}
+		}
+	}
+
+	if (found == NULL && node->mount != NULL) {
+		found = node->mount;
+		found_length = depth;
+	}
+
+	* length = found_length;
+	return found;
+}
+
+struct sepia_mount * sepia_router_match(struct sepia_router * router, const_bstring method, struct bstrList * path)
+{
+	size_t i;
+
+	if (method == NULL || path == NULL) {
+		return NULL;
+	}
+
+	for (i = 0; i < router->count; i++) {
+		if (biseq(router->method[i].method, method) == 1) {
+			int length;
+			return match(router->method[i].root, path, 0, &length);
+		}
+	}
+
+	return NULL;
+}
+
+struct sepia_router * sepia_router_of(struct sepia_mount_table * table)
+{
+	struct sepia_router * router = __atomic_load_n(&table->router, __ATOMIC_ACQUIRE);
+
+	if (router == NULL) {
+		struct sepia_router * expected = NULL;
+
+		// threads that compile at the same time all use the router that is stored first
+		router = sepia_router_compile(table);
+		if (!__atomic_compare_exchange_n(&table->router, &expected, router, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			router = expected;
+		}
+	}
+
+	return router;
+}
@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sepia_internal.h"
+
+/*
+  Compares the router with the linear walk over the mounts it replaced, for
+  10, 100 and 1000 routes. Link it with the objects of the library:
+
+  gcc -O2 -DGC_THREADS -pthread -I. -o router_bench router_bench.c .libs/libsepia.a -lgc -lbstr -lbson-1.0
+*/
+
+#define LOOKUPS 1000000
+
+static char * methods[] = { "GET", "POST", "PUT", "DELETE" };
+
+static void handler(struct sepia_request * request)
+{
+}
+
+// the routing before the router, the first mount that matches
+static struct sepia_mount * linear_match(struct sepia_mount_table * table, const_bstring method, struct bstrList * path)
+{
+	size_t i;
+	int j;
+
+	for (i = 0; i < table->count; i++) {
+		struct sepia_mount * mount = table->mount[i];
+
+		if (!biseq(method, mount->method) || mount->path->qty > path->qty) {
+			continue;
+		}
+		for (j = 0; j < mount->path->qty; j++) {
+			if (blength(mount->path->entry[j]) > 0 && !mount->path_var[j] && !biseq(mount->path->entry[j], path->entry[j])) {
+				break;
+			}
+		}
+		if (j == mount->path->qty) {
+			return mount;
+		}
+	}
+
+	return NULL;
+}
+
+static double run(struct sepia_mount_table * table, struct sepia_router * router, bstring * method, struct bstrList ** path, int count)
+{
+	int64_t start = sepia_now();
+	size_t found = 0;
+	int i;
+
+	for (i = 0; i < LOOKUPS; i++) {
+		int n = i % count;
+		if (router != NULL) {
+			found += sepia_router_match(router, method[n], path[n]) != NULL;
+		} else {
+			found += linear_match(table, method[n], path[n]) != NULL;
+		}
+	}
+
+	if (found != LOOKUPS) {
+		printf("Only %zu of %d requests were routed!\n", found, LOOKUPS);
+	}
+
+	return (sepia_now() - start) * 1000.0 / LOOKUPS;
+}
+
+static void bench(int routes)
+{
+	struct sepia_server * server = sepia_server_create(NULL);
+	bstring * method = GC_MALLOC(routes * sizeof(bstring));
+	struct bstrList ** path = GC_MALLOC(routes * sizeof(struct bstrList *));
+	int i;
+
+	for (i = 0; i < routes; i++) {
+		char mount[64];
+
+		// a REST like API, every resource with and without an id
+		if (i % 2 == 0) {
+			snprintf(mount, sizeof(mount), "/api/v%d/resource%d", i % 3, i / 8);
+		} else {
+			snprintf(mount, sizeof(mount), "/api/v%d/resource%d/{id}/items", i % 3, i / 8);
+		}
+		sepia_server_mount(server, methods[i % 4], mount, &handler);
+	}
+
+	// requests for the mounts in a different order
+	for (i = 0; i < routes; i++) {
+		int r = (i * 7919) % routes;
+		bstring request;
+
+		if (r % 2 == 0) {
+			request = bformat("/api/v%d/resource%d", r % 3, r / 8);
+		} else {
+			request = bformat("/api/v%d/resource%d/%d/items", r % 3, r / 8, i);
+		}
+		method[i] = bfromcstr(methods[r % 4]);
+		path[i] = sepia_split(bdata(request), blength(request), &(struct tagbstring) bsStatic("/"), 1);
+	}
+
+	struct sepia_mount_table * table = server->mounts;
+	int64_t start = sepia_now();
+	struct sepia_router * router = sepia_router_compile(table);
+	int64_t compiled = sepia_now() - start;
+
+	double linear = run(table, NULL, method, path, routes);
+	double tree = run(table, router, method, path, routes);
+
+	printf("%5d routes: linear %8.1f ns, router %8.1f ns per lookup, compiled in %ld us\n", routes, linear, tree, (long) compiled);
+}
+
+int main(int argc, char ** args)
+{
+	sepia_init();
+
+	bench(10);
+	bench(100);
+	bench(1000);
+	return 0;
+}
@@ -0,0 +1,248 @@
+#include <errno.h>
+#include <sched.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "sepia_internal.h"
+
+/*
+  One acceptor thread runs the epoll loop and collects complete requests.
+  They are pushed round robin into bounded lock-free queues, one per worker.
+  A worker takes requests from its own queue first and steals from the
+  other queues if its own one is empty. The queues are the bounded MPMC
+  queues of Dmitry Vyukov, as the acceptor and the thieves both access a
+  queue that is not their own.
+*/
+
+#define QUEUE_SIZE 1024
+
+struct cell {
+	size_t sequence;
+	struct sepia_request * request;
+};
+
+struct worker {
+	pthread_t thread;
+	int index;
+	int cpu;
+	struct sepia_scheduler * scheduler;
+
+	struct cell * cells;
+	size_t enqueue_pos;
+	char padding[64];
+	size_t dequeue_pos;
+
+	size_t handled;
+	size_t steals;
+};
+
+// the workers of a server, see sepia_server->scheduler
+struct sepia_scheduler {
+	// GC visible, the requests in the queues are only referenced from here
+	struct worker * workers;
+	int worker_count;
+	int next_worker;
+
+	// counts the queued requests, workers sleep on it
+	sem_t pending;
+};
+
+static int enqueue(struct worker * worker, struct sepia_request * request)
+{
+	struct cell * cell;
+	size_t pos = __atomic_load_n(&worker->enqueue_pos, __ATOMIC_RELAXED);
+
+	while (1) {
+		cell = &worker->cells[pos & (QUEUE_SIZE - 1)];
+		size_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+		intptr_t diff = (intptr_t) sequence - (intptr_t) pos;
+
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&worker->enqueue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if (diff < 0) {
+			return 0;
+		} else {
+			pos = __atomic_load_n(&worker->enqueue_pos, __ATOMIC_RELAXED);
+		}
+	}
+
+	cell->request = request;
+	__atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+static struct sepia_request * dequeue(struct worker * worker)
+{
+	struct cell * cell;
+	size_t pos = __atomic_load_n(&worker->dequeue_pos, __ATOMIC_RELAXED);
+
+	while (1) {
+		cell = &worker->cells[pos & (QUEUE_SIZE - 1)];
+		size_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+		intptr_t diff = (intptr_t) sequence - (intptr_t) (pos + 1);
+
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&worker->dequeue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if (diff < 0) {
+			return NULL;
+		} else {
+			pos = __atomic_load_n(&worker->dequeue_pos, __ATOMIC_RELAXED);
+		}
+	}
+
+	struct sepia_request * request = cell->request;
+	cell->request = NULL;
+	__atomic_store_n(&cell->sequence, pos + QUEUE_SIZE, __ATOMIC_RELEASE);
+	return request;
+}
+
+static void push(struct sepia_request * request)
+{
+	struct sepia_scheduler * scheduler = request->conn->server->scheduler;
+	int i;
+
+	while (1) {
+		for (i = 0; i < scheduler->worker_count; i++) {
+			struct worker * worker = &scheduler->workers[scheduler->next_worker];
+			scheduler->next_worker = (scheduler->next_worker + 1) % scheduler->worker_count;
+
+			if (enqueue(worker, request)) {
+				sem_post(&scheduler->pending);
+				return;
+			}
+		}
+		// all queues are full, wait for the workers to catch up
+		sched_yield();
+	}
+}
+
+static struct sepia_request * take(struct worker * worker)
+{
+	struct sepia_scheduler * scheduler = worker->scheduler;
+	int i;
+
+	while (1) {
+		struct sepia_request * request = dequeue(worker);
+		if (request != NULL) {
+			return request;
+		}
+
+		for (i = 1; i < scheduler->worker_count; i++) {
+			request = dequeue(&scheduler->workers[(worker->index + i) % scheduler->worker_count]);
+			if (request != NULL) {
+				__atomic_add_fetch(&worker->steals, 1, __ATOMIC_RELAXED);
+				return request;
+			}
+		}
+	}
+}
+
+static void * work(void * data)
+{
+	struct worker * worker = (struct worker *) data;
+
+	if (worker->cpu >= 0) {
+		sepia_pin_to_cpu(worker->cpu);
+	}
+
+	while (1) {
+		if (sem_wait(&worker->scheduler->pending) != 0) {
+			continue;
+		}
+
+		// the semaphore guarantees that there is a request in one of the queues
+		struct sepia_request * request = take(worker);
+		// deferred requests are resumed by sepia_request_complete()
+		if (handle_request(request)) {
+			sepia_event_resume(request->conn);
+		}
+
+		__atomic_add_fetch(&worker->handled, 1, __ATOMIC_RELAXED);
+	}
+
+	return NULL;
+}
+
+int sepia_server_scheduler_stats(struct sepia_server * server, struct sepia_worker_stats * stats, int n)
+{
+	struct sepia_scheduler * scheduler = server->scheduler;
+	int i;
+
+	if (scheduler == NULL) {
+		return 0;
+	}
+
+	for (i = 0; i < n && i < scheduler->worker_count; i++) {
+		struct worker * worker = &scheduler->workers[i];
+		size_t enqueued = __atomic_load_n(&worker->enqueue_pos, __ATOMIC_RELAXED);
+		size_t dequeued = __atomic_load_n(&worker->dequeue_pos, __ATOMIC_RELAXED);
+
+		stats[i].queue_depth = enqueued > dequeued ? enqueued - dequeued : 0;
+		stats[i].handled = __atomic_load_n(&worker->handled, __ATOMIC_RELAXED);
+		stats[i].steals = __atomic_load_n(&worker->steals, __ATOMIC_RELAXED);
+	}
+
+	return scheduler->worker_count;
+}
+
+int sepia_run_pool(struct sepia_server * server, char * ip, int port)
+{
+	int sock;
+	int nworkers = server->config.workers > 0 ? server->config.workers : 1;
+	int result = sepia_open_socket(server, ip, port, 0, &sock);
+
+	if (result != SEPIA_OK) {
+		return result;
+	}
+
+	struct sepia_scheduler * scheduler = GC_MALLOC(sizeof(struct sepia_scheduler));
+	sem_init(&scheduler->pending, 0, 0);
+	scheduler->workers = GC_MALLOC(nworkers * sizeof(struct worker));
+	scheduler->worker_count = 0;
+	scheduler->next_worker = 0;
+
+	int i;
+	size_t j;
+	for (i = 0; i < nworkers; i++) {
+		struct worker * worker = &scheduler->workers[i];
+		worker->index = i;
+		worker->cpu = server->config.cpu_affinity ? sepia_worker_cpu(i) : -1;
+		worker->scheduler = scheduler;
+		worker->cells = GC_MALLOC(QUEUE_SIZE * sizeof(struct cell));
+		for (j = 0; j < QUEUE_SIZE; j++) {
+			worker->cells[j].sequence = j;
+		}
+		worker->enqueue_pos = 0;
+		worker->dequeue_pos = 0;
+		worker->handled = 0;
+		worker->steals = 0;
+	}
+
+	if (server->config.cpu_affinity) {
+		sepia_log_placement(nworkers);
+	}
+
+	for (i = 0; i < nworkers; i++) {
+		if (pthread_create(&scheduler->workers[i].thread, NULL, work, &scheduler->workers[i]) != 0) {
+			sepia_log(LOG_ERR, "Could not create worker %d.", i);
+			break;
+		}
+		scheduler->worker_count++;
+	}
+
+	if (scheduler->worker_count == 0) {
+		close(sock);
+		return SEPIA_ERROR_SOCKET;
+	}
+
+	server->scheduler = scheduler;
+	result = sepia_event_loop(server, sock, push);
+	close(sock);
+	return result;
+}
@@ -1,71 +1,261 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
 #include <string.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/wait.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
 
-#include "sepia.h"
+#include "sepia_internal.h"
 #include "netstring.c"
 
-struct tagbstring PATH_INFO = bsStatic("PATH_INFO");
-struct tagbstring QUERY_STRING = bsStatic("QUERY_STRING");
-struct tagbstring QUERY_STRING_SPLIT_CHAR = bsStatic("&=");
-struct tagbstring CONTENT_LENGTH = bsStatic("CONTENT_LENGTH");
-struct tagbstring REQUEST_METHOD = bsStatic("REQUEST_METHOD");
+struct tagbstring PATH_SPLIT_CHAR = bsStatic("/");
+struct tagbstring NETSTRING_SPLIT_CHAR = bsStatic("\0");
 struct tagbstring HTTP_STATUS_OK = bsStatic("200 OK");
 struct tagbstring HTTP_STATUS_NOT_FOUND = bsStatic("404 Not Found");
+struct tagbstring HTTP_STATUS_SERVICE_UNAVAILABLE = bsStatic("503 Service Unavailable");
+struct tagbstring HTTP_STATUS_GATEWAY_TIMEOUT = bsStatic("504 Gateway Timeout");
 struct tagbstring HTTP_HEADER_CONTENT_TYPE = bsStatic("Content-Type");
 struct tagbstring HTTP_HEADER_CONTENT_TYPE_TEXT_PLAIN = bsStatic("text/plain");
 
+// how long a worker process may be stuck in a handler after its deadline, in microseconds
+#define STUCK_GRACE 1000000
+
 void sepia_init()
 {
 	GC_INIT();
 }
 
-struct sepia_request {
-	int status;
-	int socket;
-	struct sepia_mount * mount;
+void sepia_server_config_init(struct sepia_server_config * config)
+{
+	memset(config, 0, sizeof(struct sepia_server_config));
+	config->model = SEPIA_MODEL_FORK;
+	config->workers = 4;
+	config->protocol = SEPIA_PROTOCOL_SCGI;
+	config->backlog = 100;
+	config->read_buffer_size = 4096;
+	config->output_buffer_size = 1024;
+	config->flush_size = 16 * 1024;
+	config->max_header_size = 128 * 1024;
+	config->max_body_size = 16 * 1024 * 1024;
+	config->json_max_nesting = 1024;
+}
 
-	struct bstrList * path;
-	struct bstrList * headers;
+static const struct sepia_protocol * protocol_by_id(int protocol)
+{
+	switch (protocol) {
+		case SEPIA_PROTOCOL_FCGI:
+			return &sepia_fcgi_protocol;
+		case SEPIA_PROTOCOL_HTTP:
+			return &sepia_http_protocol;
+		case SEPIA_PROTOCOL_UWSGI:
+			return &sepia_uwsgi_protocol;
+		default:
+			return &sepia_scgi_protocol;
+	}
+}
 
-	const_bstring query_string;
-	struct bstrList * query_params;
+struct sepia_server * sepia_server_create(const struct sepia_server_config * config)
+{
+	struct sepia_server * server = GC_MALLOC(sizeof(struct sepia_server));
 
-	bstring body;
-	int body_length;
-	int received_body_length;
-};
+	if (config == NULL) {
+		sepia_server_config_init(&server->config);
+	} else {
+		server->config = * config;
+	}
+
+	server->protocol = protocol_by_id(server->config.protocol);
+	server->mounts = NULL;
+	pthread_mutex_init(&server->mounts_lock, NULL);
+	server->router = NULL;
+	server->scheduler = NULL;
+	return server;
+}
+
+// the server of the functions without a server argument
+static struct sepia_server * default_server = NULL;
+static pthread_once_t default_server_once = PTHREAD_ONCE_INIT;
+
+static void create_default_server()
+{
+	default_server = sepia_server_create(NULL);
+}
+
+static struct sepia_server * get_default_server()
+{
+	pthread_once(&default_server_once, create_default_server);
+	return default_server;
+}
+
+static struct tagbstring VAR_TYPE_INT = bsStatic(":int}");
+static struct tagbstring VAR_TYPE_UUID = bsStatic(":uuid}");
+
+// the SEPIA_VAR_ type of a segment of a mount path
+static int var_type(const_bstring segment)
+{
+	int colon;
+
+	if (blength(segment) == 0 || * bdata(segment) != '{') {
+		return SEPIA_VAR_NONE;
+	}
+	if ((colon = bstrchrp(segment, ':', 0)) == BSTR_ERR) {
+		return SEPIA_VAR_STRING;
+	}
+
+	struct tagbstring type;
+	bmid2tbstr(type, (bstring) segment, colon, blength(segment) - colon);
+
+	if (biseq(&type, &VAR_TYPE_INT) == 1) {
+		return SEPIA_VAR_INT;
+	} else if (biseq(&type, &VAR_TYPE_UUID) == 1) {
+		return SEPIA_VAR_UUID;
+	}
+
+	sepia_log(LOG_ERR, "Unknown type of path variable %s, it matches everything.", bdata(segment));
+	return SEPIA_VAR_STRING;
+}
+
+static struct sepia_mount * add_mount(struct sepia_server * server, char * method, char * path, void (* handler)(struct sepia_request *), int async)
+{
+	struct sepia_mount * mount = GC_MALLOC(sizeof(struct sepia_mount));
 
-struct sepia_mount {
-	const_bstring method;
-	struct bstrList * path;
-	char * path_var;
-	void (* handler)(struct sepia_request *);
-}; 
+	mount->handler = handler;
+	mount->async = async;
+	mount->deadline = 0;
+	mount->method = bfromcstr(method);
+	mount->path = bsplit(bfromcstr(path), '/');
+	mount->path_var = GC_MALLOC(mount->path->qty * sizeof(char));
+	mount->var_segment = GC_MALLOC_ATOMIC(mount->path->qty * sizeof(int));
+	mount->var_count = 0;
 
-static size_t mount_count = 0;
-static struct sepia_mount * mounts = NULL;
+	size_t i;
+	for (i = 0; i < mount->path->qty; i++) {
+		mount->path_var[i] = var_type(mount->path->entry[i]);
+		if (mount->path_var[i] != SEPIA_VAR_NONE) {
+			mount->var_segment[mount->var_count++] = i;
+		}
+	}
+
+	pthread_mutex_lock(&server->mounts_lock);
+
+	struct sepia_mount_table * mounts = server->mounts;
+	size_t n = mounts == NULL ? 0 : mounts->count;
+	struct sepia_mount_table * table = GC_MALLOC(sizeof(struct sepia_mount_table) + (n + 1) * sizeof(struct sepia_mount *));
+
+	if (n > 0) {
+		memcpy(table->mount, mounts->mount, n * sizeof(struct sepia_mount *));
+	}
+	table->router = NULL;
+	table->count = n + 1;
+	table->mount[n] = mount;
+
+	__atomic_store_n(&server->mounts, table, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&server->mounts_lock);
+
+	return mount;
+}
+
+struct sepia_mount * sepia_server_mount(struct sepia_server * server, char * method, char * path, void (* handler)(struct sepia_request *))
+{
+	return add_mount(server, method, path, handler, 0);
+}
+
+struct sepia_mount * sepia_server_mount_async(struct sepia_server * server, char * method, char * path, void (* handler)(struct sepia_request *))
+{
+	return add_mount(server, method, path, handler, 1);
+}
 
-#define is_path_var(x) (blength(x) > 0 && * bdata(x) == '{')
+struct sepia_mount * sepia_mount(char * method, char * path, void (* handler)(struct sepia_request *))
+{
+	return add_mount(get_default_server(), method, path, handler, 0);
+}
+
+struct sepia_mount * sepia_mount_async(char * method, char * path, void (* handler)(struct sepia_request *))
+{
+	return add_mount(get_default_server(), method, path, handler, 1);
+}
+
+void sepia_mount_deadline(struct sepia_mount * mount, int deadline_ms)
+{
+	__atomic_store_n(&mount->deadline, (int64_t) deadline_ms * 1000, __ATOMIC_RELAXED);
+}
 
-// not thread safe!
-void sepia_mount(char * method, char * path, void (* handler)(struct sepia_request *))
+void sepia_server_router(struct sepia_server * server, struct sepia_mount * (* router)(const_bstring method, struct bstrList * path))
 {
-	size_t n = mount_count;
+	__atomic_store_n(&server->router, router, __ATOMIC_RELEASE);
+}
+
+void sepia_use_router(struct sepia_mount * (* router)(const_bstring method, struct bstrList * path))
+{
+	sepia_server_router(get_default_server(), router);
+}
 
-	mount_count++;
-	mounts = GC_REALLOC(mounts, mount_count * sizeof(struct sepia_mount));
+int64_t sepia_request_deadline(struct sepia_request * request)
+{
+	return request->deadline;
+}
+
+int64_t sepia_request_time_left(struct sepia_request * request)
+{
+	if (request->deadline == 0) {
+		return INT64_MAX;
+	}
 
-	mounts[n].handler = handler;
-	mounts[n].method = bfromcstr(method);
-	mounts[n].path = bsplit(bfromcstr(path), '/');
-	mounts[n].path_var = GC_MALLOC(mounts[n].path->qty * sizeof(char));
+	return (request->deadline - sepia_now()) / 1000;
+}
 
+struct bstrList * sepia_split(const char * data, size_t length, const_bstring separators, int copy)
+{
+	unsigned char is_separator[256];
 	size_t i;
-	for (i = 0; i < mounts[n].path->qty; i++) {
-		mounts[n].path_var[i] = is_path_var(mounts[n].path->entry[i]);
+	int n, count = 1;
+
+	memset(is_separator, 0, sizeof(is_separator));
+	for (i = 0; i < blength(separators); i++) {
+		is_separator[(unsigned char) bdata(separators)[i]] = 1;
+	}
+	for (i = 0; i < length; i++) {
+		count += is_separator[(unsigned char) data[i]];
+	}
+
+	// one block for the list, the strings and the copy of the data, like the variables of uwsgi.c
+	struct bstrList * list = GC_MALLOC(sizeof(struct bstrList) + count * (sizeof(bstring) + sizeof(struct tagbstring)) + (copy ? length + 1 : 0));
+	bstring * entry = (bstring *) (list + 1);
+	struct tagbstring * strings = (struct tagbstring *) (entry + count);
+	char * text = (char *) data;
+
+	if (copy) {
+		text = (char *) (strings + count);
+		memcpy(text, data, length);
+		text[length] = '\0';
 	}
+
+	list->qty = count;
+	list->mlen = count;
+	list->entry = entry;
+
+	char * start = text;
+	for (i = 0, n = 0; i <= length; i++) {
+		if (i == length || is_separator[(unsigned char) text[i]]) {
+			blk2tbstr(strings[n], start, text + i - start);
+			entry[n] = &strings[n];
+			n++;
+			if (copy && i < length) {
+				text[i] = '\0';
+			}
+			start = text + i + 1;
+		}
+	}
+
+	return list;
 }
 
 int sepia_request_status(struct sepia_request * request)
@@ -73,14 +263,184 @@ int sepia_request_status(struct sepia_request * request)
 	return request->status;
 }
 
-const_bstring sepia_request_attribute(struct sepia_request * request, const_bstring name)
+// the names of the SEPIA_ATTR_ attributes
+static struct tagbstring attr_names[SEPIA_ATTR_COUNT] = {
+	bsStatic("REQUEST_METHOD"),
+	bsStatic("REQUEST_URI"),
+	bsStatic("PATH_INFO"),
+	bsStatic("QUERY_STRING"),
+	bsStatic("CONTENT_LENGTH"),
+	bsStatic("CONTENT_TYPE"),
+	bsStatic("SERVER_PROTOCOL"),
+	bsStatic("REMOTE_ADDR"),
+	bsStatic("REMOTE_PORT"),
+	bsStatic("SERVER_NAME"),
+	bsStatic("SERVER_PORT"),
+	bsStatic("DOCUMENT_URI"),
+	bsStatic("SCRIPT_NAME"),
+	bsStatic("HTTPS"),
+	bsStatic("HTTP_HOST"),
+	bsStatic("HTTP_USER_AGENT"),
+	bsStatic("HTTP_ACCEPT"),
+	bsStatic("HTTP_ACCEPT_ENCODING"),
+	bsStatic("HTTP_ACCEPT_LANGUAGE"),
+	bsStatic("HTTP_CONNECTION"),
+	bsStatic("HTTP_COOKIE"),
+	bsStatic("HTTP_AUTHORIZATION"),
+	bsStatic("HTTP_REFERER"),
+	bsStatic("HTTP_X_FORWARDED_FOR"),
+	bsStatic("HTTP_X_REQUEST_ID"),
+	bsStatic("HTTP_IF_NONE_MATCH"),
+	bsStatic("HTTP_IF_MODIFIED_SINCE"),
+	bsStatic("HTTP_CACHE_CONTROL"),
+	bsStatic("HTTP_EXPECT"),
+	bsStatic("HTTP_TRANSFER_ENCODING"),
+	bsStatic("HTTP_ORIGIN")
+};
+
+/*
+  A perfect hash of the attribute names: every name of attr_names has a
+  bucket of its own, other names are compared with the one in their bucket.
+  The buckets have to be computed again when a name is added.
+*/
+#define ATTR_BUCKETS 64
+
+static const unsigned char attr_buckets[ATTR_BUCKETS] = {
+	[0] = SEPIA_ATTR_HTTP_IF_MODIFIED_SINCE + 1,
+	[1] = SEPIA_ATTR_CONTENT_TYPE + 1,
+	[2] = SEPIA_ATTR_HTTP_X_FORWARDED_FOR + 1,
+	[5] = SEPIA_ATTR_HTTP_TRANSFER_ENCODING + 1,
+	[9] = SEPIA_ATTR_HTTPS + 1,
+	[12] = SEPIA_ATTR_HTTP_HOST + 1,
+	[13] = SEPIA_ATTR_HTTP_USER_AGENT + 1,
+	[14] = SEPIA_ATTR_HTTP_COOKIE + 1,
+	[17] = SEPIA_ATTR_HTTP_ACCEPT + 1,
+	[19] = SEPIA_ATTR_REQUEST_METHOD + 1,
+	[21] = SEPIA_ATTR_HTTP_CONNECTION + 1,
+	[22] = SEPIA_ATTR_SERVER_PROTOCOL + 1,
+	[23] = SEPIA_ATTR_REMOTE_ADDR + 1,
+	[24] = SEPIA_ATTR_QUERY_STRING + 1,
+	[25] = SEPIA_ATTR_HTTP_ORIGIN + 1,
+	[26] = SEPIA_ATTR_HTTP_ACCEPT_ENCODING + 1,
+	[28] = SEPIA_ATTR_DOCUMENT_URI + 1,
+	[29] = SEPIA_ATTR_REMOTE_PORT + 1,
+	[30] = SEPIA_ATTR_REQUEST_URI + 1,
+	[33] = SEPIA_ATTR_HTTP_EXPECT + 1,
+	[36] = SEPIA_ATTR_HTTP_X_REQUEST_ID + 1,
+	[37] = SEPIA_ATTR_HTTP_IF_NONE_MATCH + 1,
+	[42] = SEPIA_ATTR_SERVER_PORT + 1,
+	[43] = SEPIA_ATTR_HTTP_CACHE_CONTROL + 1,
+	[45] = SEPIA_ATTR_SERVER_NAME + 1,
+	[47] = SEPIA_ATTR_SCRIPT_NAME + 1,
+	[48] = SEPIA_ATTR_HTTP_ACCEPT_LANGUAGE + 1,
+	[52] = SEPIA_ATTR_HTTP_REFERER + 1,
+	[54] = SEPIA_ATTR_PATH_INFO + 1,
+	[55] = SEPIA_ATTR_HTTP_AUTHORIZATION + 1,
+	[62] = SEPIA_ATTR_CONTENT_LENGTH + 1,
+};
+
+static int attr_hash(const char * name, size_t length)
+{
+	return (length * 12 + name[length - 2] * 4 + name[length - 1] * 7 + name[length > 5 ? 5 : 0]) & (ATTR_BUCKETS - 1);
+}
+
+// the SEPIA_ATTR_ value of a name or -1
+static int attr_of(const char * name, size_t length)
+{
+	if (length < 2) {
+		return -1;
+	}
+
+	int attr = attr_buckets[attr_hash(name, length)] - 1;
+	if (attr < 0 || blength(&attr_names[attr]) != length || memcmp(bdata(&attr_names[attr]), name, length) != 0) {
+		return -1;
+	}
+
+	return attr;
+}
+
+uint32_t sepia_hash(const char * data, size_t length)
+{
+	uint32_t hash = 2166136261u;
+	size_t i;
+
+	// FNV-1a
+	for (i = 0; i < length; i++) {
+		hash = (hash ^ (unsigned char) data[i]) * 16777619u;
+	}
+
+	return hash;
+}
+
+// the attributes without a slot go into an open addressing table of their positions in the headers
+static void index_others(struct sepia_request * request)
+{
+	size_t i, size = 8;
+	struct bstrList * headers = request->headers;
+
+	while (headers != NULL && size < headers->qty) {
+		size *= 2;
+	}
+
+	request->others = GC_MALLOC_ATOMIC(size * sizeof(uint32_t));
+	memset(request->others, 0, size * sizeof(uint32_t));
+	request->others_mask = size - 1;
+
+	for (i = 0; headers != NULL && i + 1 < headers->qty; i += 2) {
+		bstring name = headers->entry[i];
+		if (attr_of(bdata(name), blength(name)) >= 0) {
+			continue;
+		}
+
+		size_t slot = sepia_hash(bdata(name), blength(name)) & request->others_mask;
+		while (request->others[slot] != 0 && !biseq(headers->entry[request->others[slot] - 1], name)) {
+			slot = (slot + 1) & request->others_mask;
+		}
+		// the first one of the same name wins
+		if (request->others[slot] == 0) {
+			request->others[slot] = i + 1;
+		}
+	}
+}
+
+// fills the slots of the known attributes, when the request is created
+static void index_attributes(struct sepia_request * request)
 {
 	size_t i;
+	struct bstrList * headers = request->headers;
+
+	for (i = 0; i + 1 < headers->qty; i += 2) {
+		int attr = attr_of(bdata(headers->entry[i]), blength(headers->entry[i]));
+		if (attr >= 0 && request->attr[attr] == NULL) {
+			request->attr[attr] = headers->entry[i + 1];
+		}
+	}
+}
+
+const_bstring sepia_request_attr(struct sepia_request * request, int attr)
+{
+	return attr >= 0 && attr < SEPIA_ATTR_COUNT ? request->attr[attr] : NULL;
+}
+
+const_bstring sepia_request_attribute(struct sepia_request * request, const_bstring name)
+{
+	int attr = attr_of(bdata(name), blength(name));
+
+	if (attr >= 0) {
+		return request->attr[attr];
+	}
+
+	// built on the first lookup of such a name, most requests never need it
+	if (request->others == NULL) {
+		index_others(request);
+	}
 
-	for (i = 0; i < request->headers->qty; i += 2) {
-		if (biseq(request->headers->entry[i], name)) {
-			return request->headers->entry[i + 1];
+	size_t slot = sepia_hash(bdata(name), blength(name)) & request->others_mask;
+	while (request->others[slot] != 0) {
+		if (biseq(request->headers->entry[request->others[slot] - 1], name)) {
+			return request->headers->entry[request->others[slot]];
 		}
+		slot = (slot + 1) & request->others_mask;
 	}
 
 	return NULL;
@@ -97,37 +457,20 @@ const_bstring sepia_request_method(struct sepia_request * request)
 
 const_bstring sepia_path_var(struct sepia_request * request, size_t n)
 {
-	size_t i, j = 0;
-
-	for (i = 0; i < request->mount->path->qty; i++) {
-		if (request->mount->path_var[i]) {
-			if (n == j) {
-				return request->path->entry[i];
-			} else {
-				j++;
-			}
-		}
+	if (request->mount == NULL || n >= request->mount->var_count) {
+		return NULL;
 	}
 
-	return NULL;
+	return request->path->entry[request->mount->var_segment[n]];
 }
 
-const_bstring sepia_query_param(struct sepia_request * request, const_bstring name)
+int64_t sepia_path_var_int64(struct sepia_request * request, size_t n)
 {
-	size_t i;
-	
-	if (request->query_params == NULL) {
-		request->query_params = bsplits(request->query_string, &QUERY_STRING_SPLIT_CHAR);
-		request->query_string = NULL;
-	}
-
-	for (i = 0; i < request->query_params->qty; i += 2) {
-		if (biseq(request->query_params->entry[i], name)) {
-			return request->query_params->entry[i + 1];
-		}
+	if (request->mount == NULL || request->var_int == NULL || n >= request->mount->var_count) {
+		return 0;
 	}
 
-	return NULL;
+	return request->var_int[n];
 }
 
 int sepia_data_size(struct sepia_request * request)
@@ -137,19 +480,26 @@ int sepia_data_size(struct sepia_request * request)
 
 int sepia_read_data(struct sepia_request * request, void * buffer, size_t buffer_size)
 {
-	if (request->received_body_length == request->body_length) {
+	int remaining = request->body_length - request->received_body_length;
+
+	if (remaining <= 0) {
 		return 0;
 	}
 
+	// never read into the next request of the connection
+	if (buffer_size > remaining) {
+		buffer_size = remaining;
+	}
+
 	int read;
 
-	if (request->socket > 0) {
-		read = recv(request->socket, buffer, buffer_size, 0);
-	} else {
-		read = request->body_length - request->received_body_length;
-		if (read > buffer_size) {
-			read = buffer_size;
+	if (request->body == NULL) {
+		read = sepia_connection_read(request->conn, buffer, buffer_size);
+		if (read <= 0) {
+			return read;
 		}
+	} else {
+		read = buffer_size;
 		memcpy(buffer, bdata(request->body) + request->received_body_length, read);
 	}
 
@@ -162,7 +512,7 @@ int sepia_read_data(struct sepia_request * request, void * buffer, size_t buffer
 void sepia_skip_data(struct sepia_request * request)
 {
 	int read;
-	static char buffer[SKIP_BUFFER_SIZE];
+	char buffer[SKIP_BUFFER_SIZE];
 
 	do {
 		read = sepia_read_data(request, buffer, SKIP_BUFFER_SIZE);
@@ -176,15 +526,27 @@ const_bstring sepia_read_string(struct sepia_request * request)
 	}
 
 	int length = sepia_data_size(request) - request->received_body_length;
+	struct sepia_connection * conn = request->conn;
 
-	if (length > 0) {
+	// a body that came in with the header is used where it is
+	if (length > 0 && request->received_body_length == 0 && conn != NULL && conn->length - conn->offset >= length) {
 		request->body = GC_MALLOC(sizeof(struct tagbstring));
+		btfromblk(* (request->body), conn->buffer + conn->offset, length);
+		conn->offset += length;
+		request->received_body_length = length;
+	} else if (length > 0 && conn != NULL && conn->server->config.spill_size > 0 && (size_t) length > conn->server->config.spill_size) {
+		request->body = sepia_spill_body(request);
+	} else if (length > 0) {
+		int read, received = 0;
 		char * buffer = GC_MALLOC(length);
-		if (recv(request->socket, buffer, length, MSG_WAITALL) == length) {
+
+		while (received < length && (read = sepia_read_data(request, buffer + received, length - received)) > 0) {
+			received += read;
+		}
+
+		if (received == length) {
+			request->body = GC_MALLOC(sizeof(struct tagbstring));
 			btfromblk(* (request->body), buffer, length);
-			request->received_body_length += length;
-		} else {
-			request->body = NULL;
 		}
 	}
 
@@ -195,227 +557,784 @@ struct sepia_request * sepia_fake_request(void * body, size_t body_len)
 {
 	struct sepia_request * req = GC_MALLOC(sizeof(struct sepia_request));
 	memset(req, 0, sizeof(struct sepia_request));
-	req->socket = -1;
 	req->status = SEPIA_REQUEST_READ;
 	req->body = blk2bstr(body, body_len);
 	req->body_length = body_len;
+	req->output = bfromcstr("");
 	return req;
 }
 
-static int bstr2int(const_bstring b)
+// the length of the body, empty as some gateways send it for none, -1 if it is malformed so sepia_request_valid() fails
+static int content_length(const_bstring value)
 {
-	if (b == NULL) return 0;
-	
-	size_t length = blength(b);
-	char buffer[length + 1];
-	buffer[length] = '\0';
-	memcpy(buffer, b->data, length);
-	return atoi(buffer);	
-}
+	int64_t length;
 
-#define BUFFER_SIZE 32
+	if (value == NULL || blength(value) == 0) {
+		return 0;
+	}
 
-static struct sepia_request * read_request(int socket)
-{
-	char buffer[BUFFER_SIZE];
-	int read = recv(socket, &buffer, BUFFER_SIZE, MSG_PEEK);
-	char * end_of_size = memchr(buffer, ':', read);
+	if (bdata(value)[0] < '0' || bdata(value)[0] > '9' || !sepia_parse_int64(bdata(value), blength(value), &length) || length > INT_MAX) {
+		return -1;
+	}
 
-	if (end_of_size != NULL) {
-		* end_of_size = '\0';
-		int buffer_size = atoi(buffer) + (end_of_size - buffer) + 2;
-		char * buffer = (char *) GC_MALLOC(buffer_size);
+	return (int) length;
+}
 
-		if (recv(socket, buffer, buffer_size, MSG_WAITALL) == buffer_size) {
+// the size of the SCGI header netstring, 0 if its length is incomplete and negative if malformed
+static int header_size(const char * buffer, size_t length)
+{
+	size_t i, size = 0;
 
-//			printf("%s\n", bstr2cstr(blk2bstr(buffer, buffer_size), '\n'));
+	for (i = 0; i < length && buffer[i] != ':'; i++) {
+		if (i >= 9 || buffer[i] < '0' || buffer[i] > '9') {
+			return -1;
+		}
+		size = size * 10 + (buffer[i] - '0');
+	}
 
-			size_t netstr_length;
-			char * netstr_start;
+	if (i == length) {
+		return 0;
+	}
 
-			if (netstring_read(buffer, buffer_size, &netstr_start, &netstr_length) == 0) {
-				struct tagbstring netstr;
-				blk2tbstr(netstr, netstr_start, netstr_length);
+	if (i == 0) {
+		return -1;
+	}
 
-				struct sepia_request * req = GC_MALLOC(sizeof(struct sepia_request));
-				req->status = SEPIA_REQUEST_READ;
-				req->socket = socket;
-				req->headers = bsplit(&netstr, '\0');
-				req->headers->qty--;
-				req->path = bsplit(sepia_request_attribute(req, &PATH_INFO), '/');
-				req->query_params = NULL;
-				req->query_string = sepia_request_attribute(req, &QUERY_STRING);
-				req->body = NULL;
-				req->body_length = bstr2int(sepia_request_attribute(req, &CONTENT_LENGTH));
-				req->received_body_length = 0;
+	return size + i + 2;
+}
 
-				return req;
-			}
-		}
-	}
+struct sepia_request * sepia_new_request(struct sepia_connection * conn, struct bstrList * headers)
+{
+	struct sepia_request * req = GC_MALLOC(sizeof(struct sepia_request));
+	req->status = SEPIA_REQUEST_READ;
+	req->conn = conn;
+	req->mount = NULL;
+	req->var_int = NULL;
+	req->headers = headers;
+	memset(req->attr, 0, sizeof(req->attr));
+	req->others = NULL;
+	index_attributes(req);
+
+	const_bstring path = req->attr[SEPIA_ATTR_PATH_INFO];
+	req->path = path == NULL ? NULL : sepia_split(bdata(path), blength(path), &PATH_SPLIT_CHAR, 1);
+	req->query = NULL;
+	req->query_string = req->attr[SEPIA_ATTR_QUERY_STRING];
+	req->body = NULL;
+	req->body_length = content_length(req->attr[SEPIA_ATTR_CONTENT_LENGTH]);
+	req->received_body_length = 0;
+	req->output = bfromcstralloc(conn->server->config.output_buffer_size, "");
+	req->id = 0;
+	req->deferred = 0;
+	req->deadline = 0;
+	req->flushed = 0;
+	req->overrun = 0;
+
+	// the first request of a connection has waited since the accept
+	req->arrival = conn->arrival != 0 ? conn->arrival : sepia_now();
+	req->admitted = 0;
+	conn->arrival = 0;
 
-	return NULL;
+	return req;
 }
 
-int sepia_send_status(struct sepia_request * request, const_bstring s)
+static struct sepia_request * scgi_parse(struct sepia_connection * conn, int * error)
 {
-	if (request->status != SEPIA_REQUEST_READ) {
-		return SEPIA_ERROR_STATUS_ALREADY_SEND;
+	char * buffer = conn->buffer + conn->offset;
+	int size = header_size(buffer, conn->length - conn->offset);
+
+	if (size == 0) {
+		return NULL;
+	}
+	if (size < 0 || size > conn->server->config.max_header_size) {
+		* error = 1;
+		return NULL;
+	}
+	if (size > conn->length - conn->offset) {
+		// the rest of the header is received in one go
+		sepia_connection_reserve(conn, size);
+		return NULL;
 	}
 
-	if (sepia_data_size(request) > 0) {
-		sepia_skip_data(request);
+	size_t netstr_length;
+	char * netstr_start;
+
+	if (netstring_read(buffer, size, &netstr_start, &netstr_length) != 0) {
+		* error = 1;
+		return NULL;
 	}
 
-	send(request->socket, "Status: ", 8, 0);
-	send(request->socket, bdata(s), blength(s), 0);
-	send(request->socket, "\r\n", 2, 0);
+	// the names and values are terminated by the zeros between them, so they are used where they are
+	struct bstrList * headers = sepia_split(netstr_start, netstr_length, &NETSTRING_SPLIT_CHAR, 0);
+	headers->qty--;
 
-	request->status = SEPIA_REQUEST_STATUS_SEND;
-	return SEPIA_OK;
+	conn->offset += size;
+	conn->keep_alive = 0;
+
+	return sepia_new_request(conn, headers);
 }
 
-int sepia_send_header(struct sepia_request * request, const_bstring key, const_bstring value)
+void sepia_cgi_send_status(struct sepia_request * request, const_bstring status)
 {
-	if (request->status == SEPIA_REQUEST_READ) {
-		sepia_send_status(request, &HTTP_STATUS_OK); 
-	}
+	bcatblk(request->output, "Status: ", 8);
+	bconcat(request->output, status);
+	bcatblk(request->output, "\r\n", 2);
+}
 
-	if (request->status == SEPIA_REQUEST_HEADERS_SEND) {
-		return SEPIA_ERROR_HEADERS_ALREADY_SEND;
-	}
+static void scgi_flush(struct sepia_request * request, int last)
+{
+	sepia_connection_send(request->conn, bdata(request->output), blength(request->output));
+	btrunc(request->output, 0);
+}
+
+const struct sepia_protocol sepia_scgi_protocol = {
+	scgi_parse,
+	sepia_cgi_send_status,
+	scgi_flush
+};
 
-	send(request->socket, bdata(key), blength(key), 0);
-	send(request->socket, ": ", 2, 0);
-	send(request->socket, bdata(value), blength(value), 0);
-	send(request->socket, "\r\n", 2, 0);
+void sepia_use_protocol(int protocol)
+{
+	struct sepia_server * server = get_default_server();
 
-	return SEPIA_OK;
+	server->config.protocol = protocol;
+	server->protocol = protocol_by_id(protocol);
 }
 
-void sepia_send_eohs(struct sepia_request * request)
+void sepia_use_coroutines(size_t stack_size)
 {
-	if (request->status == SEPIA_REQUEST_READ) {
-		sepia_send_status(request, &HTTP_STATUS_OK);
-	}
+	get_default_server()->config.coroutine_stack_size = stack_size;
+}
 
-	send(request->socket, "\r\n", 2, 0);
+void sepia_use_cpu_affinity(int on)
+{
+	get_default_server()->config.cpu_affinity = on;
+}
 
-	request->status = SEPIA_REQUEST_HEADERS_SEND;
+void sepia_use_body_spill(size_t size)
+{
+	get_default_server()->config.spill_size = size;
 }
 
-void sepia_send_data(struct sepia_request * request, const void * data, size_t data_len)
+void sepia_init_connection(struct sepia_connection * conn, struct sepia_server * server, int socket, size_t buffer_size)
 {
-	if (request->status != SEPIA_REQUEST_HEADERS_SEND) {
-		sepia_send_eohs(request);
+	conn->socket = socket;
+	conn->server = server;
+	conn->protocol = server->protocol;
+	conn->buffer = buffer_size > 0 ? GC_MALLOC_ATOMIC(buffer_size) : NULL;
+	conn->buffer_size = buffer_size;
+	conn->offset = 0;
+	conn->length = 0;
+	conn->output = NULL;
+	conn->keep_alive = 1;
+	conn->wait = NULL;
+	conn->complete = NULL;
+	conn->state = NULL;
+	conn->arrival = sepia_now();
+	conn->timed_out = 0;
+}
+
+void sepia_connection_expired(struct sepia_connection * conn)
+{
+	if (!conn->timed_out) {
+		conn->timed_out = 1;
+		conn->keep_alive = 0;
+		sepia_timeout_expired();
 	}
-	send(request->socket, data, data_len, 0);
 }
 
-void sepia_send_string(struct sepia_request * request, const_bstring s)
+void sepia_connection_reserve(struct sepia_connection * conn, size_t size)
 {
-	if (request->status != SEPIA_REQUEST_HEADERS_SEND) {
-		sepia_send_header(request, &HTTP_HEADER_CONTENT_TYPE, &HTTP_HEADER_CONTENT_TYPE_TEXT_PLAIN);
+	if (conn->buffer_size - conn->offset >= size) {
+		return;
 	}
 
-	sepia_send_data(request, bdata(s), blength(s));
+	size_t length = conn->length - conn->offset;
+	size_t buffer_size = conn->buffer_size > size ? conn->buffer_size : size;
+	char * buffer = GC_MALLOC_ATOMIC(buffer_size);
+
+	memcpy(buffer, conn->buffer + conn->offset, length);
+	conn->buffer = buffer;
+	conn->buffer_size = buffer_size;
+	conn->offset = 0;
+	conn->length = length;
 }
 
-void sepia_print_request(struct sepia_request * request)
+int sepia_connection_receive(struct sepia_connection * conn)
 {
-	size_t i;
-
-	bson_t * b = bson_new();
+	if (conn->length == conn->buffer_size) {
+		size_t length = conn->length - conn->offset;
+		sepia_connection_reserve(conn, length < conn->buffer_size / 2 ? conn->buffer_size : 2 * length);
+	}
 
-	for (i = 0; i < request->headers->qty; i+= 2) {
-		bson_append_utf8(b,
-			bdata(request->headers->entry[i]), blength(request->headers->entry[i]),
-			bdata(request->headers->entry[i + 1]), blength(request->headers->entry[i + 1]));
+	int received = recv(conn->socket, conn->buffer + conn->length, conn->buffer_size - conn->length, 0);
+	if (received > 0) {
+		conn->length += received;
 	}
 
-	sepia_send_json(request, b);
+	return received;
 }
 
-static int path_matches(struct bstrList * mount_path, struct bstrList * request_path)
+void sepia_connection_discard(struct sepia_connection * conn)
 {
-	if (mount_path->qty > request_path->qty) return 0;
+	char buffer[SKIP_BUFFER_SIZE];
 
-	size_t i;
-	for (i = 0; i < mount_path->qty && i < request_path->qty; i++) {
-		if (blength(mount_path->entry[i]) > 0) {
-			if (* bdata(mount_path->entry[i]) == '{') {
-				// nothing to do
-			} else {
-				if (!biseq(mount_path->entry[i], request_path->entry[i])) return 0;
+	while (recv(conn->socket, buffer, sizeof(buffer), MSG_DONTWAIT) > 0);
+}
+
+int sepia_connection_read(struct sepia_connection * conn, void * buffer, size_t length)
+{
+	if (conn->offset < conn->length) {
+		if (length > conn->length - conn->offset) {
+			length = conn->length - conn->offset;
+		}
+		memcpy(buffer, conn->buffer + conn->offset, length);
+		conn->offset += length;
+		return length;
+	}
+
+	while (!conn->timed_out) {
+		int received = recv(conn->socket, buffer, length, 0);
+		if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			if (conn->wait != NULL && conn->wait(conn, 0) == 0) {
+				continue;
 			}
+			// without a wait the socket is blocking and its receive timeout expired
+			sepia_connection_expired(conn);
+			break;
 		}
+		return received;
 	}
 
-	return 1;
+	errno = ETIMEDOUT;
+	return -1;
 }
 
-void handle_request(struct sepia_request * request)
+void sepia_connection_send(struct sepia_connection * conn, const void * buffer, size_t length)
 {
-	size_t i;
+	const char * data = buffer;
 
-	for (i = 0; i < mount_count; i++) {
-		if (biseq(sepia_request_attribute(request, &REQUEST_METHOD), mounts[i].method) && path_matches(mounts[i].path, request->path)) {
-			request->mount = &mounts[i];
-			mounts[i].handler(request);
+	if (conn->output != NULL) {
+		bcatblk(conn->output, data, length);
+		return;
+	}
 
-			if (request->status == SEPIA_REQUEST_READ) {
-				sepia_send_status(request, &HTTP_STATUS_OK);
+	while (length > 0 && !conn->timed_out) {
+		ssize_t sent = send(conn->socket, data, length, MSG_NOSIGNAL);
+		if (sent < 0) {
+			if (errno == EINTR) {
+				continue;
 			}
-			if (request->status == SEPIA_REQUEST_STATUS_SEND) {
-				sepia_send_eohs(request);
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				if (conn->wait != NULL && conn->wait(conn, 1) == 0) {
+					continue;
+				}
+				sepia_connection_expired(conn);
 			}
 			return;
 		}
+		data += sent;
+		length -= sent;
 	}
-
-	sepia_send_status(request, &HTTP_STATUS_NOT_FOUND);
-	sepia_send_eohs(request);
 }
 
-int sepia_start(char * ip, int port)
+static struct sepia_request * read_request(struct sepia_connection * conn)
 {
-	int sock;
+	int received, error = 0;
 
-	if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 1) {
-		return SEPIA_ERROR_SOCKET;
+	do {
+		struct sepia_request * request = conn->protocol->parse(conn, &error);
+		if (request != NULL && !sepia_request_valid(request)) {
+			return NULL;
+		}
+		if (request != NULL || error) {
+			return request;
+		}
+		received = sepia_connection_receive(conn);
+	} while (received > 0 || (received < 0 && errno == EINTR));
+
+	// the socket is blocking, so this is its receive timeout
+	if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		sepia_connection_expired(conn);
 	}
 
-	const int y = 1;
-	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &y, sizeof(int));
+	return NULL;
+}
 
-	struct sockaddr_in address;
-	address.sin_family = AF_INET;
-	address.sin_port = htons(port);
-	if (ip == NULL) {
-		address.sin_addr.s_addr = htonl(INADDR_ANY);
+static const struct sepia_protocol * protocol_of(struct sepia_request * request)
+{
+	return request->conn == NULL ? &sepia_scgi_protocol : request->conn->protocol;
+}
+
+struct sepia_server * sepia_request_server(struct sepia_request * request)
+{
+	return request->conn == NULL ? get_default_server() : request->conn->server;
+}
+
+int sepia_request_valid(struct sepia_request * request)
+{
+	size_t max_body_size = sepia_request_server(request)->config.max_body_size;
+
+	return request->body_length >= 0 && (max_body_size == 0 || (size_t) request->body_length <= max_body_size);
+}
+
+static int past_deadline(struct sepia_request * request)
+{
+	return request->deadline != 0 && !request->overrun && sepia_now() >= request->deadline;
+}
+
+// the deadline has passed, the response is replaced by a 504 if nothing of it is sent yet and cut off otherwise
+static void overrun(struct sepia_request * request)
+{
+	request->overrun = 1;
+	btrunc(request->output, 0);
+
+	if (!request->flushed) {
+		protocol_of(request)->send_status(request, &HTTP_STATUS_GATEWAY_TIMEOUT);
+		bcatblk(request->output, "\r\n", 2);
+	}
+	request->status = SEPIA_REQUEST_HEADERS_SEND;
+
+	if (request->conn != NULL) {
+		request->conn->keep_alive = 0;
+	}
+}
+
+static void write_data(struct sepia_request * request, const void * data, size_t data_len)
+{
+	if (request->overrun) {
+		return;
+	}
+
+	bcatblk(request->output, data, data_len);
+
+	// deferred responses are sent when they are complete, not from the thread that writes them
+	if (request->conn != NULL && !request->deferred && blength(request->output) >= request->conn->server->config.flush_size) {
+		if (past_deadline(request)) {
+			overrun(request);
+			return;
+		}
+		request->conn->protocol->flush(request, 0);
+		request->flushed = 1;
+	}
+}
+
+int sepia_send_status(struct sepia_request * request, const_bstring s)
+{
+	if (request->status != SEPIA_REQUEST_READ) {
+		return SEPIA_ERROR_STATUS_ALREADY_SEND;
+	}
+
+	if (sepia_data_size(request) > 0) {
+		sepia_skip_data(request);
+	}
+
+	protocol_of(request)->send_status(request, s);
+
+	request->status = SEPIA_REQUEST_STATUS_SEND;
+	return SEPIA_OK;
+}
+
+int sepia_send_header(struct sepia_request * request, const_bstring key, const_bstring value)
+{
+	if (request->status == SEPIA_REQUEST_READ) {
+		sepia_send_status(request, &HTTP_STATUS_OK); 
+	}
+
+	if (request->status == SEPIA_REQUEST_HEADERS_SEND) {
+		return SEPIA_ERROR_HEADERS_ALREADY_SEND;
+	}
+
+	write_data(request, bdata(key), blength(key));
+	write_data(request, ": ", 2);
+	write_data(request, bdata(value), blength(value));
+	write_data(request, "\r\n", 2);
+
+	return SEPIA_OK;
+}
+
+void sepia_send_eohs(struct sepia_request * request)
+{
+	if (request->status == SEPIA_REQUEST_READ) {
+		sepia_send_status(request, &HTTP_STATUS_OK);
+	}
+
+	write_data(request, "\r\n", 2);
+
+	request->status = SEPIA_REQUEST_HEADERS_SEND;
+}
+
+void sepia_send_data(struct sepia_request * request, const void * data, size_t data_len)
+{
+	if (request->status != SEPIA_REQUEST_HEADERS_SEND) {
+		sepia_send_eohs(request);
+	}
+	write_data(request, data, data_len);
+}
+
+void sepia_send_string(struct sepia_request * request, const_bstring s)
+{
+	if (request->status != SEPIA_REQUEST_HEADERS_SEND) {
+		sepia_send_header(request, &HTTP_HEADER_CONTENT_TYPE, &HTTP_HEADER_CONTENT_TYPE_TEXT_PLAIN);
+	}
+
+	sepia_send_data(request, bdata(s), blength(s));
+}
+
+void sepia_print_request(struct sepia_request * request)
+{
+	size_t i;
+
+	bson_t * b = bson_new();
+
+	for (i = 0; i < request->headers->qty; i+= 2) {
+		bson_append_utf8(b,
+			bdata(request->headers->entry[i]), blength(request->headers->entry[i]),
+			bdata(request->headers->entry[i + 1]), blength(request->headers->entry[i + 1]));
+	}
+
+	sepia_send_json(request, b);
+}
+
+void sepia_finish_response(struct sepia_request * request)
+{
+	if (past_deadline(request)) {
+		overrun(request);
+	}
+	if (request->overrun && request->flushed) {
+		// the end of the response is not sent, so the client sees that it is cut off
+		return;
+	}
+
+	if (request->status == SEPIA_REQUEST_READ) {
+		sepia_send_status(request, &HTTP_STATUS_OK);
+	}
+	if (request->status == SEPIA_REQUEST_STATUS_SEND) {
+		sepia_send_eohs(request);
+	}
+
+	if (request->conn != NULL) {
+		request->conn->protocol->flush(request, 1);
+	}
+}
+
+// signals the blocking servers that a deferred request is completed
+static pthread_mutex_t deferred_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t deferred_completed = PTHREAD_COND_INITIALIZER;
+
+void sepia_request_complete(struct sepia_request * request)
+{
+	if (request->conn != NULL && request->conn->complete != NULL) {
+		request->conn->complete(request);
+		return;
+	}
+
+	sepia_finish_response(request);
+
+	pthread_mutex_lock(&deferred_lock);
+	request->deferred = 0;
+	pthread_cond_broadcast(&deferred_completed);
+	pthread_mutex_unlock(&deferred_lock);
+}
+
+static void wait_for_completion(struct sepia_request * request)
+{
+	pthread_mutex_lock(&deferred_lock);
+	while (request->deferred) {
+		pthread_cond_wait(&deferred_completed, &deferred_lock);
+	}
+	pthread_mutex_unlock(&deferred_lock);
+}
+
+// the precomputed 503 of the admission control, the body is not read and the connection closed
+static void shed(struct sepia_request * request)
+{
+	protocol_of(request)->send_status(request, &HTTP_STATUS_SERVICE_UNAVAILABLE);
+	bconcat(request->output, sepia_admission_header());
+	request->status = SEPIA_REQUEST_HEADERS_SEND;
+
+	if (request->conn != NULL) {
+		request->conn->keep_alive = 0;
+		request->conn->protocol->flush(request, 1);
+	}
+}
+
+// set in the processes of sepia_start() and sepia_start_prefork(), which are killed when a handler is stuck
+static int watchdog = 0;
+
+// the process gets SIGALRM some time after the deadline, 0 stops this
+static void set_watchdog(int64_t deadline)
+{
+	struct itimerval timer;
+	memset(&timer, 0, sizeof(timer));
+
+	if (deadline != 0) {
+		int64_t left = deadline + STUCK_GRACE - sepia_now();
+		if (left < 1) {
+			left = 1;
+		}
+		timer.it_value.tv_sec = left / 1000000;
+		timer.it_value.tv_usec = left % 1000000;
+	}
+
+	setitimer(ITIMER_REAL, &timer, NULL);
+}
+
+// the mount of a request from the router of its server
+static struct sepia_mount * route(struct sepia_request * request)
+{
+	struct sepia_server * server = sepia_request_server(request);
+	struct sepia_mount * (* router)(const_bstring, struct bstrList *) = __atomic_load_n(&server->router, __ATOMIC_ACQUIRE);
+	const_bstring method = request->attr[SEPIA_ATTR_REQUEST_METHOD];
+
+	struct sepia_mount * mount = NULL;
+	int i;
+
+	if (method == NULL || request->path == NULL) {
+		return NULL;
+	}
+	if (router != NULL) {
+		mount = router(method, request->path);
+	} else {
+		struct sepia_mount_table * table = __atomic_load_n(&server->mounts, __ATOMIC_ACQUIRE);
+		if (table != NULL) {
+			mount = sepia_router_match(sepia_router_of(table), method, request->path);
+		}
+	}
+
+	// the typed path variables are checked by the router, the integers are kept
+	for (i = 0; mount != NULL && i < mount->var_count; i++) {
+		int segment = mount->var_segment[i];
+
+		if (mount->path_var[segment] == SEPIA_VAR_INT) {
+			bstring value = request->path->entry[segment];
+			if (request->var_int == NULL) {
+				request->var_int = GC_MALLOC(mount->var_count * sizeof(int64_t));
+			}
+			if (!sepia_parse_int64(bdata(value), blength(value), &request->var_int[i])) {
+				return NULL;
+			}
+		} else if (mount->path_var[segment] == SEPIA_VAR_UUID && !sepia_var_matches(SEPIA_VAR_UUID, request->path->entry[segment])) {
+			return NULL;
+		}
+	}
+
+	return mount;
+}
+
+int sepia_admit_request(struct sepia_request * request)
+{
+	if (request->admitted) {
+		return 1;
+	}
+	if (!sepia_admit(request->arrival)) {
+		shed(request);
+		return 0;
+	}
+
+	request->admitted = 1;
+	return 1;
+}
+
+int handle_request(struct sepia_request * request)
+{
+	if (!sepia_admit_request(request)) {
+		return 1;
+	}
+
+	struct sepia_mount * mount = route(request);
+
+	if (mount == NULL) {
+		sepia_send_status(request, &HTTP_STATUS_NOT_FOUND);
+		sepia_send_eohs(request);
+		sepia_finish_response(request);
+		return 1;
+	}
+
+	int64_t deadline = __atomic_load_n(&mount->deadline, __ATOMIC_RELAXED);
+	request->mount = mount;
+
+	if (deadline > 0) {
+		request->deadline = request->arrival + deadline;
+
+		// the response would be thrown away, so the handler is not called at all
+		if (past_deadline(request)) {
+			sepia_finish_response(request);
+			return 1;
+		}
+		if (watchdog) {
+			set_watchdog(request->deadline);
+		}
+	}
+
+	if (mount->async) {
+		// the request may be completed by threads that cannot wait for the socket of a coroutine
+		if (request->conn != NULL && request->conn->wait != NULL) {
+			sepia_read_string(request);
+		}
+		request->deferred = 1;
+		mount->handler(request);
+		return 0;
+	}
+
+	mount->handler(request);
+	sepia_finish_response(request);
+	return 1;
+}
+
+// the backoff of the accept loops, in microseconds
+#define ACCEPT_BACKOFF_MIN 10000
+#define ACCEPT_BACKOFF_MAX 1000000
+#define ACCEPT_LOG_INTERVAL 1000000
+
+int sepia_open_socket(struct sepia_server * server, char * ip, int port, int reuse_port, int * sock)
+{
+	const struct sepia_server_config * config = &server->config;
+
+	if ((* sock = socket(AF_INET, SOCK_STREAM, 0)) < 1) {
+		return SEPIA_ERROR_SOCKET;
+	}
+
+	const int y = 1;
+	setsockopt(* sock, SOL_SOCKET, SO_REUSEADDR, &y, sizeof(int));
+	if (reuse_port) {
+		setsockopt(* sock, SOL_SOCKET, SO_REUSEPORT, &y, sizeof(int));
+	}
+
+	// the accepted sockets inherit these options from the listening one
+	if (config->tcp_nodelay) {
+		setsockopt(* sock, IPPROTO_TCP, TCP_NODELAY, &y, sizeof(int));
+	}
+	if (config->send_buffer > 0) {
+		setsockopt(* sock, SOL_SOCKET, SO_SNDBUF, &config->send_buffer, sizeof(int));
+	}
+	if (config->receive_buffer > 0) {
+		setsockopt(* sock, SOL_SOCKET, SO_RCVBUF, &config->receive_buffer, sizeof(int));
+	}
+	if (config->defer_accept > 0) {
+		setsockopt(* sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, &config->defer_accept, sizeof(int));
+	}
+
+	struct sockaddr_in address;
+	address.sin_family = AF_INET;
+	address.sin_port = htons(port);
+	if (ip == NULL) {
+		address.sin_addr.s_addr = htonl(INADDR_ANY);
 	} else {
 		inet_aton(ip, &address.sin_addr);
 	}
 	
-	if (bind(sock, (const struct sockaddr *) &address, sizeof(address)) != 0) {
+	if (bind(* sock, (const struct sockaddr *) &address, sizeof(address)) != 0) {
+		close(* sock);
 		return SEPIA_ERROR_BIND;
 	}
 
-	if (listen(sock, 100) != 0) {
+	if (listen(* sock, config->backlog) != 0) {
+		close(* sock);
 		return SEPIA_ERROR_LISTEN;
 	}
 
+	return SEPIA_OK;
+}
+
+int sepia_accept_transient(int error)
+{
+	return error == EINTR || error == ECONNABORTED || error == EAGAIN || error == EWOULDBLOCK;
+}
+
+int64_t sepia_accept_failed(struct sepia_accept_backoff * backoff, int error)
+{
+	int64_t now = sepia_now();
+
+	backoff->failed++;
+	if (now - backoff->logged >= ACCEPT_LOG_INTERVAL) {
+		sepia_log(LOG_ERR, "Could not accept a connection (%d times), error %d.", backoff->failed, error);
+		backoff->logged = now;
+		backoff->failed = 0;
+	}
+
+	backoff->delay = backoff->delay == 0 ? ACCEPT_BACKOFF_MIN : (backoff->delay * 2 < ACCEPT_BACKOFF_MAX ? backoff->delay * 2 : ACCEPT_BACKOFF_MAX);
+	return backoff->delay;
+}
+
+// switches the receive timeout of a blocking socket between header and body, current is the one that is set
+static void receive_timeout(int socket, int phase, int * current)
+{
+	int timeout = sepia_timeout(phase);
+
+	if (timeout != * current) {
+		sepia_socket_timeout(socket, phase);
+		* current = timeout;
+	}
+}
+
+static void serve_request(struct sepia_request * request)
+{
+	if (!handle_request(request)) {
+		wait_for_completion(request);
+	}
+
+	if (watchdog && request->deadline != 0) {
+		set_watchdog(0);
+	}
+}
+
+void sepia_serve(struct sepia_server * server, int socket)
+{
+	struct sepia_connection * conn = GC_MALLOC(sizeof(struct sepia_connection));
+	struct sepia_request * req;
+	int timeout = 0;
+
+	if (sepia_timeout(SEPIA_TIMEOUT_WRITE) > 0) {
+		sepia_socket_timeout(socket, SEPIA_TIMEOUT_WRITE);
+	}
+
+	// the header is read with as much of the body as has arrived, the body is read from the buffer first
+	sepia_init_connection(conn, server, socket, server->config.read_buffer_size);
+	do {
+		receive_timeout(socket, SEPIA_TIMEOUT_HEADER, &timeout);
+		req = read_request(conn);
+		if (req == NULL) {
+			if (conn->offset < conn->length) {
+				sepia_log(LOG_ERR, "Could not read a request.");
+				sepia_connection_discard(conn);
+			}
+			break;
+		}
+		receive_timeout(socket, SEPIA_TIMEOUT_BODY, &timeout);
+		serve_request(req);
+	} while (conn->keep_alive);
+
+	close(socket);
+}
+
+static int run_fork(struct sepia_server * server, char * ip, int port)
+{
+	int sock;
+	int result = sepia_open_socket(server, ip, port, 0, &sock);
+
+	if (result != SEPIA_OK) {
+		return result;
+	}
+
+	// let the kernel reap the request processes
+	signal(SIGCHLD, SIG_IGN);
+
+	struct sepia_accept_backoff backoff = { 0, 0, 0 };
+
 	while (1) {
 		int conn = accept(sock, NULL, 0);
+		if (conn < 0) {
+			if (!sepia_accept_transient(errno)) {
+				usleep(sepia_accept_failed(&backoff, errno));
+			}
+			continue;
+		}
+		backoff.delay = 0;
+
 		if (fork() == 0) {
 			close(sock);
-			struct sepia_request * req = read_request(conn);
-			if (req == NULL) {
-				sepia_log(LOG_ERR, "Could not read a request.");
-			} else {
-				handle_request(req);
-			}
-			close(conn);
+			watchdog = 1;
+			sepia_serve(server, conn);
 			return SEPIA_OK;
 		} else {
 			close(conn);
@@ -426,3 +1345,288 @@ int sepia_start(char * ip, int port)
 	return SEPIA_OK;
 }
 
+static volatile sig_atomic_t prefork_running;
+
+// a worker that fails sooner than this after it is forked is replaced with a delay, in microseconds
+#define PREFORK_MIN_LIFETIME 1000000
+
+// the delay starts at this and doubles while the worker keeps failing, in microseconds
+#define PREFORK_RESPAWN_DELAY 100000
+#define PREFORK_RESPAWN_DELAY_MAX 10000000
+
+// how often the supervisor looks for exited workers while one waits to be replaced, in microseconds
+#define PREFORK_POLL 100000
+
+static void prefork_stop(int sig)
+{
+	prefork_running = 0;
+}
+
+static void prefork_worker(struct sepia_server * server, int sock, int cpu)
+{
+	int max_requests = server->config.max_requests;
+	int handled = 0, status = SEPIA_OK;
+	watchdog = 1;
+
+	if (cpu >= 0) {
+		sepia_pin_to_cpu(cpu);
+	}
+
+	while (prefork_running && (max_requests <= 0 || handled < max_requests)) {
+		int conn = accept(sock, NULL, 0);
+		if (conn < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			sepia_log(LOG_ERR, "Worker %d could not accept a connection.", getpid());
+			status = EXIT_FAILURE;
+			break;
+		}
+		sepia_serve(server, conn);
+		handled++;
+	}
+
+	close(sock);
+	exit(status);
+}
+
+static pid_t prefork_spawn(struct sepia_server * server, int * socks, int workers, int slot, int cpu)
+{
+	pid_t pid = fork();
+
+	if (pid == 0) {
+		int i;
+
+		// a socket that is closed for a waiting slot must not stay open in the other workers
+		for (i = 0; i < workers; i++) {
+			if (socks[i] >= 0 && socks[i] != socks[slot]) {
+				close(socks[i]);
+			}
+		}
+		prefork_worker(server, socks[slot], cpu);
+	} else if (pid < 0) {
+		sepia_log(LOG_ERR, "Could not fork a worker.");
+	}
+
+	return pid;
+}
+
+static int64_t prefork_backoff(int64_t delay)
+{
+	return delay == 0 ? PREFORK_RESPAWN_DELAY : (delay * 2 < PREFORK_RESPAWN_DELAY_MAX ? delay * 2 : PREFORK_RESPAWN_DELAY_MAX);
+}
+
+// the worker did not exit by itself after max_requests and was not replaced by the watchdog
+static int prefork_failed(int status)
+{
+	return WIFSIGNALED(status) ? WTERMSIG(status) != SIGALRM : WEXITSTATUS(status) != SEPIA_OK;
+}
+
+// the socket of a slot whose worker waits to be replaced, the listening sockets of the others take its connections
+static void prefork_close_slot(int * socks, pid_t * pids, int workers, int slot)
+{
+	int i;
+
+	for (i = 0; i < workers; i++) {
+		if (i != slot && pids[i] > 0 && socks[i] >= 0) {
+			close(socks[slot]);
+			socks[slot] = -1;
+			return;
+		}
+	}
+}
+
+static int run_prefork(struct sepia_server * server, char * ip, int port)
+{
+	int i, result;
+	int workers = server->config.workers > 0 ? server->config.workers : 1;
+	int affinity = server->config.cpu_affinity;
+	int socks[workers], cpus[workers];
+
+	// with cpu affinity every worker has a socket of its own, which the replacement of a worker takes over,
+	// while a replacement is delayed the socket is closed and opened again for it
+	for (i = 0; i < workers; i++) {
+		cpus[i] = affinity ? sepia_worker_cpu(i) : -1;
+		if (i > 0 && !affinity) {
+			socks[i] = socks[0];
+			continue;
+		}
+		result = sepia_open_socket(server, ip, port, affinity, &socks[i]);
+		if (result != SEPIA_OK) {
+			while (i-- > 0) {
+				close(socks[i]);
+			}
+			return result;
+		}
+		sepia_socket_cpu(socks[i], cpus[i]);
+	}
+
+	if (affinity) {
+		sepia_log_placement(workers);
+	}
+
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = prefork_stop;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGTERM, &action, NULL);
+	sigaction(SIGINT, &action, NULL);
+	signal(SIGCHLD, SIG_DFL);
+
+	pid_t pids[workers];
+	// when the worker of a slot was forked, and when it may be forked again after it failed
+	int64_t spawned[workers], delay[workers], respawn[workers];
+	prefork_running = 1;
+
+	for (i = 0; i < workers; i++) {
+		pids[i] = -1;
+		delay[i] = 0;
+		respawn[i] = 0;
+	}
+
+	while (prefork_running) {
+		int status, waiting = 0;
+		int64_t now = sepia_now();
+		pid_t pid = 0;
+
+		for (i = 0; i < workers; i++) {
+			if (pids[i] < 0 && respawn[i] <= now) {
+				if (socks[i] < 0) {
+					if (sepia_open_socket(server, ip, port, 1, &socks[i]) == SEPIA_OK) {
+						sepia_socket_cpu(socks[i], cpus[i]);
+					} else {
+						socks[i] = -1;
+					}
+				}
+				pids[i] = socks[i] < 0 ? -1 : prefork_spawn(server, socks, workers, i, cpus[i]);
+				spawned[i] = now;
+				if (pids[i] < 0) {
+					delay[i] = prefork_backoff(delay[i]);
+					respawn[i] = now + delay[i];
+					if (affinity && socks[i] >= 0) {
+						prefork_close_slot(socks, pids, workers, i);
+					}
+				}
+			}
+			waiting |= pids[i] < 0;
+		}
+
+		// waitpid() would block past the time a delayed worker is due, so the others are polled meanwhile
+		if (waiting) {
+			pid = waitpid(-1, &status, WNOHANG);
+			if (pid <= 0) {
+				usleep(PREFORK_POLL);
+				continue;
+			}
+		} else {
+			pid = waitpid(-1, &status, 0);
+			if (pid < 0) {
+				continue;
+			}
+		}
+
+		now = sepia_now();
+		for (i = 0; i < workers; i++) {
+			if (pids[i] != pid) {
+				continue;
+			}
+			if (WIFSIGNALED(status) && WTERMSIG(status) == SIGALRM) {
+				sepia_log(LOG_ERR, "Worker %d was stuck in a handler after its deadline and is replaced.", pid);
+			} else if (WIFSIGNALED(status)) {
+				sepia_log(LOG_ERR, "Worker %d was killed by signal %d.", pid, WTERMSIG(status));
+			}
+
+			// a worker that fails on start-up would otherwise be forked again and again
+			if (prefork_failed(status) && now - spawned[i] < PREFORK_MIN_LIFETIME) {
+				delay[i] = prefork_backoff(delay[i]);
+				sepia_log(LOG_ERR, "Worker %d failed right after it was started, it is replaced in %d ms.", pid, (int) (delay[i] / 1000));
+			} else {
+				delay[i] = 0;
+			}
+			pids[i] = -1;
+			respawn[i] = now + delay[i];
+
+			// a replacement that is forked right away takes over the socket and what is queued on it
+			if (affinity && delay[i] > 0) {
+				prefork_close_slot(socks, pids, workers, i);
+			}
+		}
+	}
+
+	for (i = 0; i < workers; i++) {
+		if (pids[i] > 0) {
+			kill(pids[i], SIGTERM);
+		}
+	}
+	while (waitpid(-1, NULL, 0) > 0 || errno == EINTR);
+
+	for (i = 0; i < (affinity ? workers : 1); i++) {
+		if (socks[i] >= 0) {
+			close(socks[i]);
+		}
+	}
+	return SEPIA_OK;
+}
+
+int sepia_server_start(struct sepia_server * server, char * ip, int port)
+{
+	struct sepia_mount_table * table = __atomic_load_n(&server->mounts, __ATOMIC_ACQUIRE);
+
+	// before the workers are forked, so they inherit it, mounts added later are compiled by the first request
+	if (table != NULL && server->router == NULL) {
+		sepia_router_of(table);
+	}
+
+	switch (server->config.model) {
+		case SEPIA_MODEL_PREFORK:
+			return run_prefork(server, ip, port);
+		case SEPIA_MODEL_EVENT:
+			return sepia_run_event(server, ip, port);
+		case SEPIA_MODEL_THREADED:
+			return sepia_run_threaded(server, ip, port);
+		case SEPIA_MODEL_POOL:
+			return sepia_run_pool(server, ip, port);
+		default:
+			return run_fork(server, ip, port);
+	}
+}
+
+static int start_default(int model, int workers, int max_requests, char * ip, int port)
+{
+	struct sepia_server * server = get_default_server();
+
+	server->config.model = model;
+	server->config.workers = workers;
+	server->config.max_requests = max_requests;
+	return sepia_server_start(server, ip, port);
+}
+
+int sepia_start(char * ip, int port)
+{
+	return start_default(SEPIA_MODEL_FORK, 0, 0, ip, port);
+}
+
+int sepia_start_prefork(char * ip, int port, int workers, int max_requests)
+{
+	return start_default(SEPIA_MODEL_PREFORK, workers, max_requests, ip, port);
+}
+
+int sepia_start_event(char * ip, int port)
+{
+	return start_default(SEPIA_MODEL_EVENT, 0, 0, ip, port);
+}
+
+int sepia_start_threaded(char * ip, int port, int nthreads)
+{
+	return start_default(SEPIA_MODEL_THREADED, nthreads, 0, ip, port);
+}
+
+int sepia_start_pool(char * ip, int port, int nworkers)
+{
+	return start_default(SEPIA_MODEL_POOL, nworkers, 0, ip, port);
+}
+
+int sepia_scheduler_stats(struct sepia_worker_stats * stats, int n)
+{
+	return sepia_server_scheduler_stats(get_default_server(), stats, n);
+}
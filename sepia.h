@@ -1,6 +1,8 @@
 #include <gc.h>
+#include <stdint.h>
 #include <stdarg.h>
 #include <syslog.h>
+#include <sys/types.h>
 #include <bstrlib.h>
 #include <libbson-1.0/bson.h>
 
@@ -21,6 +23,73 @@
   The error return value of sepia_send_header().
 */
 #define SEPIA_ERROR_HEADERS_ALREADY_SEND 5
+/*
+  The error return value of sepia_use_admission_control().
+*/
+#define SEPIA_ERROR_ADMISSION 6
+/*
+  The error return value of sepia_read_multipart().
+*/
+#define SEPIA_ERROR_MULTIPART 7
+/*
+  The error of sepia_read_json() and sepia_read_form() if the body could not
+  be read to its end, because of a timeout or a closed connection. Negative,
+  so it is not one of jsonsl_error_t.
+*/
+#define SEPIA_ERROR_READ -1
+
+/*
+  The protocols of sepia_use_protocol().
+*/
+#define SEPIA_PROTOCOL_SCGI 0
+#define SEPIA_PROTOCOL_FCGI 1
+#define SEPIA_PROTOCOL_HTTP 2
+#define SEPIA_PROTOCOL_UWSGI 3
+
+/*
+  Request attributes with a slot of their own, see sepia_request_attr().
+*/
+#define SEPIA_ATTR_REQUEST_METHOD         0
+#define SEPIA_ATTR_REQUEST_URI            1
+#define SEPIA_ATTR_PATH_INFO              2
+#define SEPIA_ATTR_QUERY_STRING           3
+#define SEPIA_ATTR_CONTENT_LENGTH         4
+#define SEPIA_ATTR_CONTENT_TYPE           5
+#define SEPIA_ATTR_SERVER_PROTOCOL        6
+#define SEPIA_ATTR_REMOTE_ADDR            7
+#define SEPIA_ATTR_REMOTE_PORT            8
+#define SEPIA_ATTR_SERVER_NAME            9
+#define SEPIA_ATTR_SERVER_PORT            10
+#define SEPIA_ATTR_DOCUMENT_URI           11
+#define SEPIA_ATTR_SCRIPT_NAME            12
+#define SEPIA_ATTR_HTTPS                  13
+#define SEPIA_ATTR_HTTP_HOST              14
+#define SEPIA_ATTR_HTTP_USER_AGENT        15
+#define SEPIA_ATTR_HTTP_ACCEPT            16
+#define SEPIA_ATTR_HTTP_ACCEPT_ENCODING   17
+#define SEPIA_ATTR_HTTP_ACCEPT_LANGUAGE   18
+#define SEPIA_ATTR_HTTP_CONNECTION        19
+#define SEPIA_ATTR_HTTP_COOKIE            20
+#define SEPIA_ATTR_HTTP_AUTHORIZATION     21
+#define SEPIA_ATTR_HTTP_REFERER           22
+#define SEPIA_ATTR_HTTP_X_FORWARDED_FOR   23
+#define SEPIA_ATTR_HTTP_X_REQUEST_ID      24
+#define SEPIA_ATTR_HTTP_IF_NONE_MATCH     25
+#define SEPIA_ATTR_HTTP_IF_MODIFIED_SINCE 26
+#define SEPIA_ATTR_HTTP_CACHE_CONTROL     27
+#define SEPIA_ATTR_HTTP_EXPECT            28
+#define SEPIA_ATTR_HTTP_TRANSFER_ENCODING 29
+#define SEPIA_ATTR_HTTP_ORIGIN            30
+#define SEPIA_ATTR_COUNT                  31
+
+/*
+  The concurrency models of a server, see struct sepia_server_config.
+*/
+#define SEPIA_MODEL_FORK     0
+#define SEPIA_MODEL_PREFORK  1
+#define SEPIA_MODEL_EVENT    2
+#define SEPIA_MODEL_THREADED 3
+#define SEPIA_MODEL_POOL     4
 
 /*
   Return values of sepia_request_status().
@@ -40,17 +109,106 @@
 
 struct sepia_mount;
 struct sepia_request;
+struct sepia_server;
+
+/*
+  The configuration of a server, see sepia_server_create(). Initialize it
+  with sepia_server_config_init() and change what has to be tuned.
+*/
+struct sepia_server_config {
+	int model;                   // one of the SEPIA_MODEL_ values, FORK by default, see the sepia_start functions
+	int workers;                 // processes of PREFORK, threads of THREADED and POOL, 4 by default
+	int max_requests;            // requests of a PREFORK worker before it is replaced, 0 (default) for no limit
+	int protocol;                // one of the SEPIA_PROTOCOL_ values, SCGI by default
+	size_t coroutine_stack_size; // EVENT runs handlers as coroutines if not 0 (default), see sepia_use_coroutines()
+	int cpu_affinity;            // pins the workers to cores if not 0 (default), see sepia_use_cpu_affinity()
+
+	int backlog;                 // of the listening socket, 100 by default
+	int tcp_nodelay;             // sets TCP_NODELAY on the connections if not 0 (default)
+	int send_buffer;             // SO_SNDBUF of the connections, 0 (default) keeps the one of the system
+	int receive_buffer;          // SO_RCVBUF of the connections, 0 (default) keeps the one of the system
+	int defer_accept;            // TCP_DEFER_ACCEPT in seconds, connections are accepted when data arrives, 0 (default) turns it off
+
+	size_t read_buffer_size;     // the receive buffer of a connection to start with, 4096 by default
+	size_t output_buffer_size;   // the buffer of a response to start with, 1024 by default
+	size_t flush_size;           // a response is sent in parts of this size while it is written, 16384 by default
+
+	size_t max_header_size;      // connections with a larger request header are closed, 128 KB by default
+	size_t max_body_size;        // connections with a larger request body are closed, 16 MB by default, 0 for no limit
+	size_t spill_size;           // sepia_read_string() keeps larger bodies in a temporary file, 0 (default) never, see sepia_use_body_spill()
+	int json_max_nesting;        // the nesting depth of sepia_read_json(), 1024 by default
+};
+
+/*
+  Statistics of a worker of sepia_start_pool(), see sepia_scheduler_stats().
+*/
+struct sepia_worker_stats {
+	size_t queue_depth; // requests waiting in the queue of the worker
+	size_t handled;     // requests handled by the worker
+	size_t steals;      // requests the worker took from the queues of other workers
+};
+
+/*
+  Statistics of the admission control, see sepia_admission_stats().
+*/
+struct sepia_admission_stats {
+	size_t admitted;    // requests passed to their handler
+	size_t shed;        // requests answered with 503
+	int overloaded;     // the smallest queueing delay of the last interval was above the target
+};
 
 /*
   Initialize. Actually this wraps GC_INIT(), so you should call it before anything.
 */
 void sepia_init();
 
+/*
+  Set the defaults of a server configuration.
+*/
+void sepia_server_config_init(struct sepia_server_config * config);
+
+/*
+  Create a server with its own mounts, the configuration is copied, NULL
+  means the defaults. Several servers can run in one process, each in a
+  thread of its own, as long as only one of them uses FORK or PREFORK:
+  they handle signals and reap child processes for the whole process.
+  sepia_use_admission_control() and sepia_use_timeouts() apply to all
+  servers.
+
+  The functions without a server (sepia_mount(), sepia_start(), ...) use a
+  default server.
+*/
+struct sepia_server * sepia_server_create(const struct sepia_server_config * config);
+
+/*
+  Like sepia_mount() and sepia_mount_async(), for the given server.
+*/
+struct sepia_mount * sepia_server_mount(struct sepia_server * server, char * method, char * path, void (* handler)(struct sepia_request *));
+struct sepia_mount * sepia_server_mount_async(struct sepia_server * server, char * method, char * path, void (* handler)(struct sepia_request *));
+
+/*
+  Like sepia_use_router(), for the given server.
+*/
+void sepia_server_router(struct sepia_server * server, struct sepia_mount * (* router)(const_bstring method, struct bstrList * path));
+
+/*
+  Run a server on the given ip and port with the concurrency model of its
+  configuration. Returns like the sepia_start functions.
+*/
+int  sepia_server_start(struct sepia_server * server, char * ip, int port);
+
+/*
+  Like sepia_scheduler_stats(), for a server with the POOL model.
+*/
+int  sepia_server_scheduler_stats(struct sepia_server * server, struct sepia_worker_stats * stats, int n);
+
 /*
   Connect a HTTP method / path (-prefix) with a request handler.
   The path can contain path variables which actual values are captured.
   Path variables must start after a slash and end before a slash or the
   end of the path. The name between { and } is not used and can be omitted.
+  A path variable can have a type: {id:int} only matches a 64 bit integer,
+  {id:uuid} only a UUID like 123e4567-e89b-12d3-a456-426614174000.
 
   Example: sepia_mount('GET', '/myApp/doSomething/{ID}', &doSomething);
 
@@ -58,28 +216,232 @@ void sepia_init();
   /myApp/doSomething/123/and/456. In each case the first and only path var will
   have the string value "123".
 
-  Please note that the first matching mount is taken. Also all mounts have to
-  be set before calling sepia_start(). If no mount matches a request, a 404
-  response is send to the client.
+  The most specific mount is taken: the one that matches the most segments
+  of the path, and at every segment a literal before a typed path variable
+  before an untyped one. Of
+  mounts with the same path the first one is taken. Mounts should be set
+  before calling sepia_start(), worker processes only see the mounts that
+  existed when they were forked. Threads see new mounts immediately. If no
+  mount matches a request, a 404 response is send to the client.
+
+  Returns the mount, see sepia_mount_deadline().
+*/
+struct sepia_mount * sepia_mount(char * method, char * path, void (* handler)(struct sepia_request *));
+
+/*
+  Like sepia_mount(), but the response is not finished when the handler
+  returns. The handler passes the request on, e.g. to another thread, and
+  the response is sent when sepia_request_complete() is called. The servers
+  of sepia_start_event() and sepia_start_pool() do not keep a thread busy
+  meanwhile, the other servers wait for the completion. The response is
+  collected until then, the request must not be used afterwards.
+*/
+struct sepia_mount * sepia_mount_async(char * method, char * path, void (* handler)(struct sepia_request *));
+
+/*
+  Give the requests of a mount a deadline of deadline_ms after their
+  arrival, 0 removes it (the default). A request that has waited past its
+  deadline is answered with 504 Gateway Timeout without calling the
+  handler. If the handler overruns it, the response is replaced by a 504,
+  or cut off and the connection closed if a part of it has been sent
+  already. The worker processes of sepia_start() and sepia_start_prefork()
+  are killed if a handler is still running a second after the deadline,
+  sepia_start_prefork() replaces them.
+*/
+void sepia_mount_deadline(struct sepia_mount * mount, int deadline_ms);
+
+/*
+  Replace the routing of the mounts by a function that returns the mount
+  for the method of a request and its path split at the slashes, NULL is
+  answered with 404. The mounts have to be made with sepia_mount() or
+  sepia_mount_async() nevertheless, but they are not compiled into a
+  router then. The sepia-routegen program generates such a function from
+  a route manifest, which registers itself with this.
+*/
+void sepia_use_router(struct sepia_mount * (* router)(const_bstring method, struct bstrList * path));
+
+/*
+  Complete the response of a request of an asynchronous handler, see
+  sepia_mount_async(). Can be called from any thread, exactly once.
+*/
+void sepia_request_complete(struct sepia_request * request);
+
+/*
+  Select the protocol spoken by the default server, one of the
+  SEPIA_PROTOCOL_ values. The default is SCGI. With FastCGI connections are
+  kept alive if the webserver asks for it and the requests of a connection
+  can be multiplexed, they are handled one after another. With HTTP the
+  servers talk to clients directly, connections are persistent and
+  pipelined requests are answered in order. Chunked request bodies are
+  collected in memory before the request is handled, requests that can
+  not be read get an error status. uwsgi is the binary
+  alternative to SCGI of nginx and Apache.
+*/
+void sepia_use_protocol(int protocol);
+
+/*
+  Run the handlers of sepia_start_event() as coroutines with stacks of
+  stack_size bytes, 0 turns this off again (the default). A handler is then
+  called as soon as the header of its request is read. Reading the body and
+  sending the response suspend it while the socket is not ready, the server
+  continues with other connections meanwhile. Applies to the default server,
+  see coroutine_stack_size of struct sepia_server_config.
+*/
+void sepia_use_coroutines(size_t stack_size);
+
+/*
+  Pin every worker of the default server to a core of its own, if on is
+  not 0, and let it take its memory from the NUMA node of that core. The
+  workers are the processes of sepia_start_prefork() and the threads of
+  sepia_start_threaded() and sepia_start_pool(). The prefork and threaded
+  workers also get a listening socket of their own (SO_REUSEPORT), which
+  receives the connections that the kernel processes on their core. With
+  more workers than cores, the cores are used round robin. The placement
+  is logged when the server starts. Off by default, see cpu_affinity of
+  struct sepia_server_config.
+*/
+void sepia_use_cpu_affinity(int on);
+
+/*
+  Let sepia_read_string() put request bodies larger than size bytes into an
+  unlinked temporary file in TMPDIR (/tmp by default) and return them as a
+  read-only mapping of it, so large uploads do not take heap memory. 0
+  turns this off again (the default). Applies to the default server, see
+  spill_size of struct sepia_server_config.
+
+  The servers of sepia_start_pool() and of sepia_start_event() without
+  coroutines receive the whole body before the handler runs, so it is in
+  memory anyway and only max_body_size limits it.
+*/
+void sepia_use_body_spill(size_t size);
+
+/*
+  Shed load when the server cannot keep up. The queueing delay of every
+  request, from its arrival until its handler would start, is tracked. If
+  it has not been below target_ms for interval_ms, requests that waited
+  longer than target_ms are answered with 503 Service Unavailable and a
+  Retry-After of retry_after seconds. Their body is not read and their
+  connection is closed. A target of 0 turns this off (the default). Call it
+  before starting a server, forked workers share the statistics. Returns
+  SEPIA_OK or SEPIA_ERROR_ADMISSION.
 */
-void sepia_mount(char * method, char * path, void (* handler)(struct sepia_request *));
+int  sepia_use_admission_control(int target_ms, int interval_ms, int retry_after);
+
+/*
+  Get the statistics of the admission control.
+*/
+void sepia_admission_stats(struct sepia_admission_stats * stats);
+
+/*
+  Close connections that stall. header_ms limits the time from waiting for
+  a request until its header is complete, body_ms and write_ms the time
+  without progress while reading the body and sending the response. 0
+  turns a timeout off (the default). The servers of sepia_start_event()
+  and sepia_start_pool() track the deadlines in a timer wheel, the other
+  servers set the timeouts of their sockets, so for them every timeout
+  limits a single wait. Call it before starting a server.
+*/
+void sepia_use_timeouts(int header_ms, int body_ms, int write_ms);
+
+/*
+  The number of connections closed because of a timeout, including the
+  ones of forked workers.
+*/
+size_t sepia_expired_connections();
 
 /*
   Start a server that listens on the given ip and port.
   Path NULL for ip to listen on all interfaces.
+  Every connection is handled by a new process.
 */
 int  sepia_start(char * ip, int port);
 
+/*
+  Start a server that listens on the given ip and port with a fixed pool of
+  worker processes. Each worker accepts and handles connections one after
+  another. Workers that die are reaped and replaced. If max_requests is
+  greater than zero, a worker is replaced after handling that many requests.
+  SIGTERM or SIGINT stop the workers and return SEPIA_OK.
+*/
+int  sepia_start_prefork(char * ip, int port, int workers, int max_requests);
+
+/*
+  Start a single threaded server that listens on the given ip and port.
+  Connections are handled with non-blocking sockets and epoll, a handler is
+  called when the header and the body of its request have been received.
+  Handlers should not block, as all connections wait for them.
+*/
+int  sepia_start_event(char * ip, int port);
+
+/*
+  Start a server with nthreads threads that each listen on their own socket
+  for the given ip and port (SO_REUSEPORT). Each thread accepts and handles
+  connections one after another, handlers have to be thread safe.
+*/
+int  sepia_start_threaded(char * ip, int port, int nthreads);
+
+/*
+  Start a server with one acceptor thread and a pool of nworkers handler
+  threads. The acceptor reads the requests like sepia_start_event() and
+  queues them at the workers, idle workers steal requests from the queues
+  of busy ones. Handlers have to be thread safe.
+*/
+int  sepia_start_pool(char * ip, int port, int nworkers);
+
+/*
+  Copy the statistics of up to n workers of sepia_start_pool() into stats.
+  Returns the number of workers.
+*/
+int  sepia_scheduler_stats(struct sepia_worker_stats * stats, int n);
+
 /*
   Retrieve the value of the n'th path var. Return NULL if not exists.
 */
 const_bstring sepia_path_var(struct sepia_request *, size_t n);
 
 /*
-  Retrieve the value of a query string parameter by name.
+  The value of the n'th path var if it is an {name:int}, it is converted
+  when the request is routed. Returns 0 for other path vars.
+*/
+int64_t sepia_path_var_int64(struct sepia_request *, size_t n);
+
+/*
+  Retrieve the value of a query string parameter by name. The value is
+  percent-decoded, a parameter without = has the empty value. Return NULL
+  if not exists.
 */
 const_bstring sepia_query_param(struct sepia_request *, const_bstring name);
 
+/*
+  The n'th value of a query string parameter that is repeated, like a in
+  a=1&a=2, and the number of its values.
+*/
+const_bstring sepia_query_param_n(struct sepia_request *, const_bstring name, size_t n);
+size_t sepia_query_param_count(struct sepia_request *, const_bstring name);
+
+/*
+  The value of a query string parameter as an integer, a boolean (1, true,
+  yes, on and the empty value are 1, 0, false, no and off are 0) or a
+  double. Returns otherwise if the parameter does not exist or has another
+  value.
+*/
+int64_t sepia_query_param_int64(struct sepia_request *, const_bstring name, int64_t otherwise);
+int  sepia_query_param_bool(struct sepia_request *, const_bstring name, int otherwise);
+double sepia_query_param_double(struct sepia_request *, const_bstring name, double otherwise);
+
+/*
+  The deadline of the request in microseconds of CLOCK_MONOTONIC, 0 if its
+  mount has none. See sepia_mount_deadline().
+*/
+int64_t sepia_request_deadline(struct sepia_request *);
+
+/*
+  The milliseconds until the deadline of the request, 0 or less if it has
+  passed and INT64_MAX if there is none. Handlers can skip work that would
+  not be finished in time or pass the rest on to the services they call.
+*/
+int64_t sepia_request_time_left(struct sepia_request *);
+
 /*
   Retrieve the status of the request handling.
 */
@@ -87,9 +449,17 @@ int  sepia_request_status(struct sepia_request *);
 
 /*
   Retrieve the value of a request attribute by name. See sepia_print_request().
+  The values of SCGI requests point into the received header, keep a copy
+  of the ones that are needed after the response is finished.
 */
 const_bstring sepia_request_attribute(struct sepia_request *, const_bstring name);
 
+/*
+  Retrieve the value of one of the SEPIA_ATTR_ attributes, without a
+  lookup by name. Returns NULL if the request does not have it.
+*/
+const_bstring sepia_request_attr(struct sepia_request *, int attr);
+
 /*
   Return the HTTP method of the request.
 */
@@ -116,16 +486,67 @@ int  sepia_read_data(struct sepia_request *, void * buffer, size_t buffer_size);
 */
 const_bstring sepia_read_string(struct sepia_request *);
 
+/*
+  Write the body of an HTTP request to a file or a pipe. It is moved from
+  the socket with splice() and not copied into the process. Returns the
+  number of bytes written or -1 for an error. The servers of
+  sepia_start_pool() and of sepia_start_event() without coroutines have
+  received the body already, it is written from memory there.
+
+  Note that you should only use one of the _read_ methods.
+*/
+ssize_t sepia_read_to_fd(struct sepia_request *, int fd);
+
+/*
+  The callbacks of sepia_read_multipart(), each of them may be NULL. They
+  get the data pointer given to sepia_read_multipart() and return 0 to go
+  on, any other value stops the parser and is returned by it.
+*/
+struct sepia_multipart_handler {
+	int (* header)(void * data, const_bstring name, const_bstring value);  // a header of the next part, only valid during the call
+	int (* part)(void * data, int * fd);                                    // the headers of a part are complete, set fd to have the content written there instead
+	int (* content)(void * data, const char * buffer, size_t length);       // the next piece of the content of the part
+	int (* end)(void * data);                                               // the part is complete
+};
+
+/*
+  Read a multipart/form-data (or any other multipart) body part by part.
+  The body goes through a buffer of bounded size, whatever the size of the
+  upload, and the content of a part is handed to the callbacks or written
+  to the file descriptor of its part callback as it arrives. Returns
+  SEPIA_OK, SEPIA_ERROR_MULTIPART if the request has no boundary, the body
+  is malformed or truncated or writing a part failed, or the value of the
+  callback that stopped it.
+
+  Note that you should only use one of the _read_ methods.
+*/
+int  sepia_read_multipart(struct sepia_request *, const struct sepia_multipart_handler * handler, void * data);
+
 /*
   Read the body of the HTTP request as JSON. Returns NULL if unsuccessful,
   if there was an error and the second argument is not NULL, it will be
-  passed there. See jsonsl_error_t in jsonsl.h. If the return value is NULL
-  and there is no error, then the body was truncated somewhere.
+  passed there. See jsonsl_error_t in jsonsl.h and SEPIA_ERROR_READ. If the
+  return value is NULL and there is no error, then the body was truncated
+  somewhere.
 
   Note that you should only use one of the _read_ methods.
 */
 bson_t * sepia_read_json(struct sepia_request *, int * error);
 
+/*
+  Read an application/x-www-form-urlencoded body into a BSON document of
+  strings. The values of a name that occurs more than once are an array,
+  in the order of the body. Returns NULL if unsuccessful, errors are
+  reported like with sepia_read_json(): JSONSL_ERROR_PERCENT_BADHEX for a
+  malformed escape, JSONSL_ERROR_FOUND_NULL_BYTE for a name with an
+  encoded zero and SEPIA_ERROR_READ if the body could not be read. If the
+  return value is NULL and there is no error, then the body was truncated
+  somewhere.
+
+  Note that you should only use one of the _read_ methods.
+*/
+bson_t * sepia_read_form(struct sepia_request *, int * error);
+
 /*
   Send an HTTP status. The status includes the number and the describing string.
   You can call this method only ones, it is omitable if the status is "200 OK".
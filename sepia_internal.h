@@ -0,0 +1,517 @@
+#ifndef __SEPIA_INTERNAL_H
+#define __SEPIA_INTERNAL_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "sepia.h"
+
+/*
+  Definitions shared by the request handling in sepia.c, the protocols and
+  the different server implementations. Not installed.
+*/
+
+struct sepia_protocol;
+struct sepia_coroutine;
+struct sepia_scheduler;
+struct sepia_router;
+struct sepia_query;
+
+struct sepia_mount_table {
+	// compiled from the mounts before the first request, see router.c
+	struct sepia_router * router;
+	size_t count;
+	struct sepia_mount * mount[];
+};
+
+struct sepia_server {
+	struct sepia_server_config config;
+	const struct sepia_protocol * protocol;
+
+	// replaced as a whole on every mount, so request threads never see a partial update
+	struct sepia_mount_table * mounts;
+	pthread_mutex_t mounts_lock;
+
+	// set by sepia_server_router(), replaces the router of the mounts
+	struct sepia_mount * (* router)(const_bstring method, struct bstrList * path);
+
+	// the workers of the POOL model, see scheduler.c
+	struct sepia_scheduler * scheduler;
+};
+
+struct sepia_connection {
+	int socket;
+	struct sepia_server * server;
+	const struct sepia_protocol * protocol;
+
+	// received data, buffer[offset] to buffer[length - 1] is not consumed yet
+	char * buffer;
+	size_t buffer_size;
+	size_t offset;
+	size_t length;
+
+	// if not NULL, the data to send is collected here instead of being sent
+	bstring output;
+
+	// set by the protocol, if zero the connection is closed after the current request
+	int keep_alive;
+
+	// if not NULL, called when the non-blocking socket is not ready to read or write (writing is 1), returns -1 if the connection timed out meanwhile
+	int (* wait)(struct sepia_connection *, int writing);
+
+	// if not NULL, sepia_request_complete() passes deferred requests to it instead of sending the response itself
+	void (* complete)(struct sepia_request *);
+
+	// protocol specific state
+	void * state;
+
+	// when the connection was accepted, until its first request is created
+	int64_t arrival;
+
+	// set when a timeout expired, reading and sending fail from then on
+	int timed_out;
+};
+
+struct sepia_request {
+	int status;
+	struct sepia_connection * conn;
+	struct sepia_mount * mount;
+
+	struct bstrList * path;
+	struct bstrList * headers;
+
+	// the values of the {name:int} path variables by number, set when the mount is found
+	int64_t * var_int;
+
+	// the values of the SEPIA_ATTR_ attributes, NULL if missing
+	const_bstring attr[SEPIA_ATTR_COUNT];
+	// the other attributes, the position of their name in headers + 1 by hash, NULL until the first lookup
+	uint32_t * others;
+	size_t others_mask;
+
+	const_bstring query_string;
+	// the parameters of the query string, indexed on the first lookup, see query.c
+	struct sepia_query * query;
+
+	bstring body;
+	int body_length;
+	int received_body_length;
+
+	// the response before it is framed by the protocol
+	bstring output;
+
+	// protocol specific request id
+	int id;
+
+	// set while the response of an asynchronous handler is not complete
+	int deferred;
+
+	// when the request was ready to be handled, in microseconds of sepia_now()
+	int64_t arrival;
+	// set when the admission control has let the request in
+	int admitted;
+
+	// when the response has to be complete, 0 if there is no deadline
+	int64_t deadline;
+	// set when a part of the response has been passed to the protocol
+	int flushed;
+	// set when the deadline has passed, the rest of the response is dropped
+	int overrun;
+};
+
+// the types of the path variables of a mount, in the order they are tried in
+#define SEPIA_VAR_NONE   0
+#define SEPIA_VAR_INT    1
+#define SEPIA_VAR_UUID   2
+#define SEPIA_VAR_STRING 3
+#define SEPIA_VAR_TYPES  4
+
+struct sepia_mount {
+	const_bstring method;
+	struct bstrList * path;
+	// the SEPIA_VAR_ type of every segment of the path, NONE for literals
+	char * path_var;
+	// the segments of the path variables by number
+	int * var_segment;
+	int var_count;
+	void (* handler)(struct sepia_request *);
+	int async;
+
+	// in microseconds after the arrival of a request, 0 if there is none
+	int64_t deadline;
+};
+
+struct sepia_protocol {
+	/*
+	  Parse the next request from the received data of the connection and
+	  consume its header. Returns NULL if more data is needed, error is set to
+	  a non-zero value if the data is malformed. If the body of the returned
+	  request is NULL, it follows in the received data of the connection.
+	*/
+	struct sepia_request * (* parse)(struct sepia_connection *, int * error);
+
+	/*
+	  Append the status line of the response to the output of the request.
+	*/
+	void (* send_status)(struct sepia_request *, const_bstring status);
+
+	/*
+	  Send the output of the request with the framing of the protocol and
+	  clear it. If last is not zero, the response is complete.
+	*/
+	void (* flush)(struct sepia_request *, int last);
+};
+
+extern const struct sepia_protocol sepia_scgi_protocol;
+extern const struct sepia_protocol sepia_fcgi_protocol;
+extern const struct sepia_protocol sepia_http_protocol;
+extern const struct sepia_protocol sepia_uwsgi_protocol;
+
+/*
+  Create a listening socket on ip and port with the backlog and the socket
+  options of the server, with SO_REUSEPORT if reuse_port is not zero.
+  Returns SEPIA_OK or one of the SEPIA_ERROR_ values.
+*/
+int  sepia_open_socket(struct sepia_server * server, char * ip, int port, int reuse_port, int * sock);
+
+/*
+  The backoff of an accept loop. Errors like EMFILE or ENOBUFS last until
+  connections are closed, so after one the loop waits before it accepts
+  again, starting with 10 ms and doubling up to 1 s while they go on. The
+  delay is set back to 0 after a connection was accepted.
+*/
+struct sepia_accept_backoff {
+	int64_t delay;
+	int64_t logged;
+	int failed;
+};
+
+/*
+  Returns 1 if accept() can be tried again right away after error.
+*/
+int  sepia_accept_transient(int error);
+
+/*
+  Log the error of accept() at most once a second and return how long to
+  wait before the next accept() in microseconds.
+*/
+int64_t sepia_accept_failed(struct sepia_accept_backoff * backoff, int error);
+
+/*
+  Initialize a connection of a server for a socket, with a receive buffer
+  of buffer_size bytes.
+*/
+void sepia_init_connection(struct sepia_connection * conn, struct sepia_server * server, int socket, size_t buffer_size);
+
+/*
+  Make room for at least size unconsumed bytes in the receive buffer. The
+  buffer is replaced, not moved, so requests can keep pointing into it.
+*/
+void sepia_connection_reserve(struct sepia_connection * conn, size_t size);
+
+/*
+  Receive more data into the buffer of the connection, it is enlarged if it
+  is full. Returns the result of recv().
+*/
+int  sepia_connection_receive(struct sepia_connection * conn);
+
+/*
+  Read up to length bytes, the received data of the connection first.
+*/
+int  sepia_connection_read(struct sepia_connection * conn, void * buffer, size_t length);
+
+/*
+  Send data as it is, or append it to the output of the connection.
+*/
+void sepia_connection_send(struct sepia_connection * conn, const void * data, size_t length);
+
+/*
+  Read and drop what is already received before the connection is closed,
+  unread data would make the close reset the connection before the client
+  has read the last response. Does not wait for more.
+*/
+void sepia_connection_discard(struct sepia_connection * conn);
+
+/*
+  Create a request of a connection, which must not be NULL, from its
+  header attributes (name, value, name, ...).
+*/
+struct sepia_request * sepia_new_request(struct sepia_connection * conn, struct bstrList * headers);
+
+/*
+  Split length bytes of data at every one of the separators. The strings of
+  the list are views (tagbstring) and allocated in one block with it. If
+  copy is not zero, the block holds a copy of the data with the separators
+  replaced by zeros, otherwise the strings point into data itself.
+*/
+struct bstrList * sepia_split(const char * data, size_t length, const_bstring separators, int copy);
+
+/*
+  FNV-1a hash of length bytes of data.
+*/
+uint32_t sepia_hash(const char * data, size_t length);
+
+/*
+  Compile the mounts of a table into a router.
+*/
+struct sepia_router * sepia_router_compile(struct sepia_mount_table * table);
+
+/*
+  The router of a table, it is compiled and stored in the table on the
+  first call.
+*/
+struct sepia_router * sepia_router_of(struct sepia_mount_table * table);
+
+/*
+  Find the mount for a method and a split request path, NULL if there is
+  none.
+*/
+struct sepia_mount * sepia_router_match(struct sepia_router * router, const_bstring method, struct bstrList * path);
+
+/*
+  Returns 1 if a segment of a request path is a value of the SEPIA_VAR_ type.
+*/
+int  sepia_var_matches(int type, const_bstring segment);
+
+/*
+  Parse length bytes of data as a decimal 64 bit integer with an optional
+  sign. Returns 0 if they are something else or out of range.
+*/
+int  sepia_parse_int64(const char * data, size_t length, int64_t * value);
+
+/*
+  Percent-decode length bytes of data into out, + is decoded to a space.
+  Returns the decoded length, which is never more than length. A malformed
+  escape is copied as it is, malformed is set to 1 then if it is not NULL.
+*/
+size_t sepia_url_decode(const char * data, size_t length, char * out, int * malformed);
+
+/*
+  Read the rest of the body of a request into a temporary file and return
+  a mapping of it, NULL if that fails.
+*/
+bstring sepia_spill_body(struct sepia_request * request);
+
+/*
+  Write all of data to fd, returns 0 or -1 if write() failed.
+*/
+int  sepia_write_all(int fd, const char * data, size_t length);
+
+/*
+  Returns 0 if the body of a parsed request is malformed or larger than the
+  server allows, the connection is closed then.
+*/
+int  sepia_request_valid(struct sepia_request * request);
+
+/*
+  The server a request was received by, the default server for requests
+  without a connection.
+*/
+struct sepia_server * sepia_request_server(struct sepia_request * request);
+
+/*
+  Append the CGI Status header to the output, for protocols that do not
+  have their own status line.
+*/
+void sepia_cgi_send_status(struct sepia_request * request, const_bstring status);
+
+/*
+  Append a HTTP/1.1 status line to the output.
+*/
+void sepia_http_send_status(struct sepia_request * request, const_bstring status);
+
+/*
+  Read requests from a blocking connection of a server and handle them
+  until the protocol does not keep the connection alive, then close it.
+*/
+void sepia_serve(struct sepia_server * server, int socket);
+
+/*
+  Run the epoll loop of the EVENT model on a listening socket. If hand_off
+  is not NULL, it is called with every complete request instead of
+  handling it in the loop. The socket of the request is blocking then. The
+  receiver has to pass the connection to sepia_event_resume() after the
+  request is handled.
+*/
+int  sepia_event_loop(struct sepia_server * server, int sock, void (* hand_off)(struct sepia_request *));
+
+/*
+  Run the loop of the EVENT model with io_uring instead of epoll. Returns
+  -1 if io_uring is not available, otherwise like sepia_event_loop().
+*/
+int  sepia_uring_loop(struct sepia_server * server, int sock);
+
+/*
+  Run a server with the EVENT, THREADED or POOL model, see sepia_server_start().
+*/
+int  sepia_run_event(struct sepia_server * server, char * ip, int port);
+int  sepia_run_threaded(struct sepia_server * server, char * ip, int port);
+int  sepia_run_pool(struct sepia_server * server, char * ip, int port);
+
+/*
+  Return a connection to the epoll loop, which continues to read from it if
+  it is kept alive and closes it otherwise. Can be called from any thread.
+*/
+void sepia_event_resume(struct sepia_connection * conn);
+
+/*
+  Run function as a coroutine with a stack of stack_size bytes until it
+  yields or finishes. Returns NULL if it has finished, otherwise it is
+  continued with sepia_coroutine_resume(). A coroutine belongs to the
+  thread that started it.
+*/
+struct sepia_coroutine * sepia_coroutine_start(size_t stack_size, void (* function)(void *), void * data);
+
+/*
+  Continue a coroutine until it yields again. Returns 1 if it has finished.
+*/
+int  sepia_coroutine_resume(struct sepia_coroutine * coroutine);
+
+/*
+  Suspend the running coroutine.
+*/
+void sepia_coroutine_yield();
+
+/*
+  Returns 1 if called from a coroutine.
+*/
+int  sepia_coroutine_running();
+
+/*
+  The CPU of the index-th worker with cpu_affinity, the CPUs the process
+  may run on are used round robin. Returns -1 if they are unknown.
+*/
+int  sepia_worker_cpu(int index);
+
+/*
+  The NUMA node of a CPU, 0 without NUMA.
+*/
+int  sepia_cpu_node(int cpu);
+
+/*
+  Pin the calling thread to a CPU and prefer the memory of its NUMA node
+  for it. Returns the node or -1 if the thread could not be pinned.
+*/
+int  sepia_pin_to_cpu(int cpu);
+
+/*
+  Ask the kernel to queue the connections that are processed on cpu at
+  this listening socket (SO_INCOMING_CPU), for per-core SO_REUSEPORT
+  listeners.
+*/
+void sepia_socket_cpu(int socket, int cpu);
+
+/*
+  Log the CPUs and NUMA nodes of the process and where the workers run.
+*/
+void sepia_log_placement(int workers);
+
+/*
+  Microseconds of the monotonic clock.
+*/
+int64_t sepia_now();
+
+/*
+  Decide if a request that arrived at the given time is handled, returns 0
+  if it is shed. See sepia_use_admission_control().
+*/
+int  sepia_admit(int64_t arrival);
+
+/*
+  The headers of the 503 response of shed requests, including the empty line.
+*/
+const_bstring sepia_admission_header();
+
+/*
+  The timeouts of sepia_use_timeouts().
+*/
+#define SEPIA_TIMEOUT_HEADER 0
+#define SEPIA_TIMEOUT_BODY   1
+#define SEPIA_TIMEOUT_WRITE  2
+
+/*
+  The timeout of a phase in milliseconds, 0 if there is none.
+*/
+int  sepia_timeout(int phase);
+
+/*
+  Set the timeout of a phase as receive (header, body) or send (write)
+  timeout of a blocking socket.
+*/
+void sepia_socket_timeout(int socket, int phase);
+
+/*
+  Count a connection that is closed because of a timeout.
+*/
+void sepia_timeout_expired();
+
+/*
+  Mark a connection as timed out and count it, once. It is not kept alive.
+*/
+void sepia_connection_expired(struct sepia_connection * conn);
+
+/*
+  A timer of a timer wheel, embedded into the object it belongs to.
+*/
+struct sepia_timer {
+	struct sepia_timer * next;
+	struct sepia_timer ** prev; // NULL if the timer is not set
+	uint64_t expires;           // in ticks
+};
+
+struct sepia_timer_wheel;
+
+// microseconds per tick of the timer wheels
+#define SEPIA_TIMER_TICK 100000
+#define SEPIA_TIMER_LEVELS 4
+
+/*
+  Create a timer wheel that starts at now (see sepia_now()). A wheel is not
+  thread safe, it belongs to one event loop.
+*/
+struct sepia_timer_wheel * sepia_timer_wheel_create(int64_t now);
+
+void sepia_timer_init(struct sepia_timer * timer);
+
+/*
+  Set or move a timer to expire at deadline (see sepia_now()), at the end
+  of its tick.
+*/
+void sepia_timer_set(struct sepia_timer_wheel * wheel, struct sepia_timer * timer, int64_t deadline);
+
+/*
+  Remove a timer from the wheel, if it is set.
+*/
+void sepia_timer_cancel(struct sepia_timer_wheel * wheel, struct sepia_timer * timer);
+
+/*
+  Advance the wheel to now and call expired with every timer that is due.
+*/
+void sepia_timer_advance(struct sepia_timer_wheel * wheel, int64_t now, void (* expired)(struct sepia_timer *));
+
+/*
+  The number of timers that are set.
+*/
+size_t sepia_timer_count(struct sepia_timer_wheel * wheel);
+
+/*
+  Find the mount of a request, call its handler and finish the response.
+  Returns 0 if the handler is asynchronous and the response is deferred
+  until sepia_request_complete() is called, 1 otherwise.
+*/
+int  handle_request(struct sepia_request *);
+
+/*
+  Run the admission control for a request once. Returns 0 if it is shed,
+  its 503 is passed to the protocol then and the connection is not kept
+  alive, so the body does not have to be read.
+*/
+int  sepia_admit_request(struct sepia_request *);
+
+/*
+  Send the status and the end of headers if the handler has not done so
+  and the rest of the response.
+*/
+void sepia_finish_response(struct sepia_request * request);
+
+#endif
@@ -0,0 +1,100 @@
+#ifndef __SEPIA_TEST_H
+#define __SEPIA_TEST_H
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "sepia_internal.h"
+
+/*
+  What the tests share. Every *_test.c is a program of its own that checks
+  one part of the library through its internal interface and exits with
+  the number of failed checks, see TESTS in Makefile.am.
+*/
+
+static int test_failures = 0;
+
+#define CHECK(condition) do { \
+	if (!(condition)) { \
+		printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+		test_failures++; \
+	} \
+} while (0)
+
+// a string of the library, which may be NULL, equals a C string
+#define CHECK_STRING(string, expected) CHECK((string) != NULL && biseqcstr((string), (expected)))
+
+/*
+  A server speaking one of the SEPIA_PROTOCOL_ values, with the default
+  configuration otherwise.
+*/
+static inline struct sepia_server * test_server(int protocol)
+{
+	struct sepia_server_config config;
+
+	sepia_server_config_init(&config);
+	config.protocol = protocol;
+	return sepia_server_create(&config);
+}
+
+/*
+  Append data to the received data of a connection, as if it came from its
+  socket.
+*/
+static inline void test_receive(struct sepia_connection * conn, const void * data, size_t length)
+{
+	sepia_connection_reserve(conn, conn->length - conn->offset + length);
+	memcpy(conn->buffer + conn->length, data, length);
+	conn->length += length;
+}
+
+/*
+  A connection of a server that has received length bytes of data. The
+  socket may be -1, what the protocol sends is collected in the output of
+  the connection then.
+*/
+static inline struct sepia_connection * test_connection(struct sepia_server * server, int socket, const void * data, size_t length)
+{
+	struct sepia_connection * conn = GC_MALLOC(sizeof(struct sepia_connection));
+
+	sepia_init_connection(conn, server, socket, server->config.read_buffer_size);
+	if (socket < 0) {
+		conn->output = bfromcstr("");
+	}
+	test_receive(conn, data, length);
+	return conn;
+}
+
+/*
+  A request of a connection with the attributes given as name, value, ...
+  and NULL.
+*/
+static inline struct sepia_request * test_request(struct sepia_connection * conn, ...)
+{
+	struct bstrList * headers = bstrListCreate();
+	const char * string;
+	va_list args;
+
+	va_start(args, conn);
+	while ((string = va_arg(args, const char *)) != NULL) {
+		if (headers->qty == headers->mlen) {
+			bstrListAlloc(headers, headers->mlen * 2 + 2);
+		}
+		headers->entry[headers->qty++] = bfromcstr(string);
+	}
+	va_end(args);
+
+	return sepia_new_request(conn, headers);
+}
+
+/*
+  Print the result of a test program and return its exit status.
+*/
+static inline int test_result(const char * name)
+{
+	printf("%s: %s\n", name, test_failures == 0 ? "ok" : "FAILED");
+	return test_failures;
+}
+
+#endif
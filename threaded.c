@@ -0,0 +1,96 @@
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "sepia_internal.h"
+
+/*
+  A server with one thread per listening socket. All sockets are bound to the
+  same port with SO_REUSEPORT, so the kernel distributes the connections and
+  the threads do not share an accept queue. Threads are created through the
+  libgc wrapper (GC_THREADS), so their stacks are scanned by the collector.
+  With cpu_affinity, a thread runs on the core whose connections its socket
+  receives.
+*/
+
+struct listener {
+	struct sepia_server * server;
+	int sock;
+	int cpu;
+};
+
+static void * accept_loop(void * data)
+{
+	struct listener * listener = (struct listener *) data;
+	int sock = listener->sock;
+
+	if (listener->cpu >= 0) {
+		sepia_pin_to_cpu(listener->cpu);
+	}
+
+	struct sepia_accept_backoff backoff = { 0, 0, 0 };
+
+	while (1) {
+		int conn = accept(sock, NULL, 0);
+		if (conn < 0) {
+			if (!sepia_accept_transient(errno)) {
+				usleep(sepia_accept_failed(&backoff, errno));
+			}
+			continue;
+		}
+
+		backoff.delay = 0;
+		sepia_serve(listener->server, conn);
+	}
+
+	return NULL;
+}
+
+int sepia_run_threaded(struct sepia_server * server, char * ip, int port)
+{
+	int i, result = SEPIA_OK;
+	int nthreads = server->config.workers > 0 ? server->config.workers : 1;
+	int socks[nthreads];
+	pthread_t threads[nthreads];
+	struct listener listeners[nthreads];
+
+	for (i = 0; i < nthreads; i++) {
+		result = sepia_open_socket(server, ip, port, 1, &socks[i]);
+		if (result != SEPIA_OK) {
+			break;
+		}
+		listeners[i].cpu = server->config.cpu_affinity ? sepia_worker_cpu(i) : -1;
+		sepia_socket_cpu(socks[i], listeners[i].cpu);
+	}
+
+	if (result != SEPIA_OK) {
+		while (i-- > 0) {
+			close(socks[i]);
+		}
+		return result;
+	}
+
+	if (server->config.cpu_affinity) {
+		sepia_log_placement(nthreads);
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		listeners[i].server = server;
+		listeners[i].sock = socks[i];
+		if (pthread_create(&threads[i], NULL, accept_loop, &listeners[i]) != 0) {
+			sepia_log(LOG_ERR, "Could not create thread %d.", i);
+			close(socks[i]);
+			socks[i] = -1;
+		}
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		if (socks[i] >= 0) {
+			pthread_join(threads[i], NULL);
+			close(socks[i]);
+		}
+	}
+
+	return SEPIA_OK;
+}
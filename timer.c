@@ -0,0 +1,222 @@
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+
+#include "sepia_internal.h"
+
+/*
+  The timeouts of connections. The event loops keep a deadline per
+  connection in a hierarchical timer wheel: 256 slots of one tick and three
+  levels of 64 slots that cover 256, 256 * 64 and 256 * 64 * 64 ticks. A
+  timer is put into the slot of its expiry on the finest level that reaches
+  that far, the slots of a coarser level are distributed to the finer ones
+  when the level below has turned once. Setting and cancelling a timer is a
+  list operation, the loops advance the wheel once per tick.
+
+  The blocking servers use the socket timeouts instead.
+*/
+
+#define ROOT_BITS  8
+#define LEVEL_BITS 6
+#define ROOT_SIZE  (1 << ROOT_BITS)
+#define LEVEL_SIZE (1 << LEVEL_BITS)
+
+struct timeouts {
+	int timeout[3];
+	size_t expired;
+};
+
+// shared with forked workers, so they count into the same number
+static struct timeouts * timeouts = NULL;
+
+void sepia_use_timeouts(int header_ms, int body_ms, int write_ms)
+{
+	if (timeouts == NULL) {
+		timeouts = mmap(NULL, sizeof(struct timeouts), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (timeouts == MAP_FAILED) {
+			timeouts = GC_MALLOC_UNCOLLECTABLE(sizeof(struct timeouts));
+		}
+	}
+
+	timeouts->timeout[SEPIA_TIMEOUT_HEADER] = header_ms;
+	timeouts->timeout[SEPIA_TIMEOUT_BODY] = body_ms;
+	timeouts->timeout[SEPIA_TIMEOUT_WRITE] = write_ms;
+}
+
+int sepia_timeout(int phase)
+{
+	return timeouts == NULL ? 0 : timeouts->timeout[phase];
+}
+
+void sepia_timeout_expired()
+{
+	if (timeouts != NULL) {
+		__atomic_add_fetch(&timeouts->expired, 1, __ATOMIC_RELAXED);
+	}
+}
+
+size_t sepia_expired_connections()
+{
+	return timeouts == NULL ? 0 : __atomic_load_n(&timeouts->expired, __ATOMIC_RELAXED);
+}
+
+void sepia_socket_timeout(int socket, int phase)
+{
+	int timeout = sepia_timeout(phase);
+	struct timeval tv;
+
+	// zero means no timeout for the socket too
+	tv.tv_sec = timeout / 1000;
+	tv.tv_usec = (timeout % 1000) * 1000;
+	setsockopt(socket, SOL_SOCKET, phase == SEPIA_TIMEOUT_WRITE ? SO_SNDTIMEO : SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+struct sepia_timer_wheel {
+	uint64_t tick;
+	size_t count;
+
+	struct sepia_timer * root[ROOT_SIZE];
+	struct sepia_timer * level[SEPIA_TIMER_LEVELS - 1][LEVEL_SIZE];
+};
+
+struct sepia_timer_wheel * sepia_timer_wheel_create(int64_t now)
+{
+	struct sepia_timer_wheel * wheel = GC_MALLOC(sizeof(struct sepia_timer_wheel));
+
+	wheel->tick = now / SEPIA_TIMER_TICK;
+	wheel->count = 0;
+	return wheel;
+}
+
+static void link_timer(struct sepia_timer_wheel * wheel, struct sepia_timer * timer)
+{
+	uint64_t expires = timer->expires;
+	uint64_t delta = expires - wheel->tick;
+	struct sepia_timer ** slot = NULL;
+	int i;
+
+	if (expires < wheel->tick) {
+		slot = &wheel->root[wheel->tick & (ROOT_SIZE - 1)];
+	} else if (delta < ROOT_SIZE) {
+		slot = &wheel->root[expires & (ROOT_SIZE - 1)];
+	} else {
+		for (i = 0; i < SEPIA_TIMER_LEVELS - 1; i++) {
+			int shift = ROOT_BITS + i * LEVEL_BITS;
+			if (delta < (uint64_t) 1 << (shift + LEVEL_BITS) || i == SEPIA_TIMER_LEVELS - 2) {
+				// beyond the last level, the timer is put into its last slot and placed again from there
+				if (delta >= (uint64_t) 1 << (shift + LEVEL_BITS)) {
+					expires = wheel->tick + ((uint64_t) 1 << (shift + LEVEL_BITS)) - 1;
+				}
+				slot = &wheel->level[i][(expires >> shift) & (LEVEL_SIZE - 1)];
+				break;
+			}
+		}
+	}
+
+	timer->next = * slot;
+	timer->prev = slot;
+	if (timer->next != NULL) {
+		timer->next->prev = &timer->next;
+	}
+	* slot = timer;
+}
+
+static void unlink_timer(struct sepia_timer * timer)
+{
+	* timer->prev = timer->next;
+	if (timer->next != NULL) {
+		timer->next->prev = timer->prev;
+	}
+	timer->next = NULL;
+	timer->prev = NULL;
+}
+
+void sepia_timer_init(struct sepia_timer * timer)
+{
+	timer->next = NULL;
+	timer->prev = NULL;
+	timer->expires = 0;
+}
+
+void sepia_timer_set(struct sepia_timer_wheel * wheel, struct sepia_timer * timer, int64_t deadline)
+{
+	if (timer->prev != NULL) {
+		unlink_timer(timer);
+	} else {
+		wheel->count++;
+	}
+
+	// rounded up, so a timer never expires early, a deadline that has passed expires with the next tick
+	timer->expires = (deadline + SEPIA_TIMER_TICK - 1) / SEPIA_TIMER_TICK;
+	if (timer->expires < wheel->tick) {
+		timer->expires = wheel->tick;
+	}
+
+	link_timer(wheel, timer);
+}
+
+void sepia_timer_cancel(struct sepia_timer_wheel * wheel, struct sepia_timer * timer)
+{
+	if (timer->prev != NULL) {
+		unlink_timer(timer);
+		wheel->count--;
+	}
+}
+
+// distributes a slot of a coarser level to the finer ones
+static void cascade(struct sepia_timer_wheel * wheel, struct sepia_timer ** slot)
+{
+	struct sepia_timer * timer = * slot;
+	* slot = NULL;
+
+	while (timer != NULL) {
+		struct sepia_timer * next = timer->next;
+		link_timer(wheel, timer);
+		timer = next;
+	}
+}
+
+void sepia_timer_advance(struct sepia_timer_wheel * wheel, int64_t now, void (* expired)(struct sepia_timer *))
+{
+	uint64_t tick = now / SEPIA_TIMER_TICK;
+
+	if (wheel->count == 0) {
+		wheel->tick = tick + 1;
+		return;
+	}
+
+	while (wheel->tick <= tick) {
+		int i, index = wheel->tick & (ROOT_SIZE - 1);
+
+		if (index == 0) {
+			for (i = 0; i < SEPIA_TIMER_LEVELS - 1; i++) {
+				int slot = (wheel->tick >> (ROOT_BITS + i * LEVEL_BITS)) & (LEVEL_SIZE - 1);
+				cascade(wheel, &wheel->level[i][slot]);
+				if (slot != 0) {
+					break;
+				}
+			}
+		}
+
+		// the callback may cancel the other due timers and set timers, which go to the next tick at the earliest
+		struct sepia_timer * due = wheel->root[index];
+		wheel->root[index] = NULL;
+		if (due != NULL) {
+			due->prev = &due;
+		}
+		wheel->tick++;
+
+		while (due != NULL) {
+			struct sepia_timer * timer = due;
+			unlink_timer(timer);
+			wheel->count--;
+			expired(timer);
+		}
+	}
+}
+
+size_t sepia_timer_count(struct sepia_timer_wheel * wheel)
+{
+	return wheel->count;
+}
@@ -0,0 +1,180 @@
+#include <stdlib.h>
+
+#include "sepia_test.h"
+
+/*
+  The timer wheel of timer.c: timers on all levels that are set, moved and
+  cancelled while the wheel advances in steps of one tick and in jumps,
+  none of them expires before its deadline or later than the advance that
+  reaches the tick of it.
+*/
+
+#define TICK SEPIA_TIMER_TICK
+#define TIMERS 2000
+
+struct item {
+	struct sepia_timer timer;
+	int64_t deadline;
+	// the tick the timer is due at, a deadline that has passed is due with the next one
+	int64_t due;
+	int expired;
+
+	// cancelled or set again by the callback when it expires
+	struct item * cancel;
+	struct item * set;
+};
+
+static struct sepia_timer_wheel * wheel;
+static struct item items[TIMERS];
+
+// the times of the last advance and of the one before, the next tick of the wheel
+static int64_t now, before, next_tick;
+static size_t expired_count;
+
+static void set(struct item * item, int64_t deadline)
+{
+	item->deadline = deadline;
+	item->due = (deadline + TICK - 1) / TICK;
+	if (item->due < next_tick) {
+		item->due = next_tick;
+	}
+	item->expired = 0;
+	sepia_timer_set(wheel, &item->timer, deadline);
+}
+
+static void expired(struct sepia_timer * timer)
+{
+	struct item * item = (struct item *) timer;
+
+	CHECK(!item->expired);
+	// never early and not later than the advance that reached its tick
+	CHECK(item->deadline <= now && item->due <= now / TICK);
+	CHECK(before / TICK < item->due);
+
+	item->expired = 1;
+	expired_count++;
+
+	if (item->cancel != NULL) {
+		sepia_timer_cancel(wheel, &item->cancel->timer);
+		item->cancel = NULL;
+	}
+	if (item->set != NULL) {
+		set(item->set, now + TICK);
+		item->set = NULL;
+	}
+}
+
+static void advance(int64_t time)
+{
+	before = now;
+	now = time;
+	next_tick = now / TICK + 1;
+	sepia_timer_advance(wheel, now, expired);
+}
+
+static void create(int64_t start)
+{
+	now = before = start;
+	next_tick = start / TICK;
+	wheel = sepia_timer_wheel_create(start);
+	expired_count = 0;
+}
+
+// the timers that are set but have not expired are the ones the wheel counts
+static size_t pending()
+{
+	size_t i, count = 0;
+
+	for (i = 0; i < TIMERS; i++) {
+		count += items[i].timer.prev != NULL;
+		CHECK(items[i].timer.prev == NULL || !items[i].expired);
+	}
+	return count;
+}
+
+static void random_timers()
+{
+	int64_t start = 1700000000LL * 1000000 + 12345;
+	int64_t ranges[] = { 3 * TICK, 300 * TICK, 20000 * TICK, 300000LL * TICK };
+	size_t i, step;
+
+	srand(1);
+	create(start);
+
+	for (i = 0; i < TIMERS; i++) {
+		sepia_timer_init(&items[i].timer);
+		set(&items[i], start + rand() % ranges[i % 4]);
+	}
+	CHECK(sepia_timer_count(wheel) == TIMERS);
+
+	for (step = 0; expired_count < TIMERS; step++) {
+		struct item * item = &items[rand() % TIMERS];
+
+		// moved, cancelled and set again while the wheel turns
+		if (step % 7 == 0 && item->timer.prev != NULL) {
+			set(item, now + rand() % ranges[rand() % 4]);
+		} else if (step % 11 == 0 && item->timer.prev != NULL) {
+			sepia_timer_cancel(wheel, &item->timer);
+			sepia_timer_cancel(wheel, &item->timer);
+			set(item, now + rand() % ranges[rand() % 2]);
+		}
+
+		advance(now + (step % 100 == 0 ? rand() % (5000LL * TICK) : rand() % (3 * TICK)));
+		CHECK(sepia_timer_count(wheel) == pending());
+	}
+
+	CHECK(sepia_timer_count(wheel) == 0);
+}
+
+static void callbacks()
+{
+	int64_t start = 12345;
+
+	create(start);
+
+	// due in the same tick, the first one to expire cancels the other
+	set(&items[0], start + TICK);
+	set(&items[1], start + TICK);
+	items[0].cancel = &items[1];
+	items[1].cancel = &items[0];
+
+	// a timer that is set by the callback expires with a later advance
+	set(&items[2], start + 2 * TICK);
+	items[2].set = &items[3];
+
+	advance(start + 3 * TICK);
+	CHECK(expired_count == 2);
+	CHECK(items[0].expired != items[1].expired);
+	CHECK(items[2].expired && !items[3].expired);
+	CHECK(sepia_timer_count(wheel) == 1);
+
+	// the end of the tick after the one it was set in
+	advance(now + TICK);
+	CHECK(!items[3].expired);
+	advance(now + TICK);
+	CHECK(items[3].expired);
+	CHECK(sepia_timer_count(wheel) == 0);
+
+	// beyond the last level and an advance over all of it
+	int64_t far = now + ((int64_t) 1 << 27) * TICK;
+	set(&items[4], far);
+	set(&items[5], now - TICK);
+	advance(now);
+	CHECK(!items[5].expired);
+	advance(now + TICK);
+	CHECK(items[5].expired && !items[4].expired);
+	advance(far - TICK);
+	CHECK(!items[4].expired);
+	advance(far + TICK);
+	CHECK(items[4].expired);
+}
+
+int main()
+{
+	sepia_init();
+
+	random_timers();
+	callbacks();
+
+	return test_result("timer");
+}
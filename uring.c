@@ -0,0 +1,754 @@
+#ifdef HAVE_LINUX_IO_URING_H
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "sepia_internal.h"
+
+/*
+  The single threaded server of sepia_start_event() on top of io_uring
+  instead of epoll. Accepts, receives, sends and closes are submitted to
+  the ring and the submissions of one round are passed to the kernel with
+  the same system call that waits for the next completions. Every
+  connection has at most one operation in flight.
+
+  The first receive buffer of a connection is a slot of one area that is
+  registered with the ring, so these reads do not have to map the buffer
+  every time. Larger requests get a buffer of their own. A request body
+  in a slot is copied, one in a buffer of its own is used in place and
+  that buffer is replaced instead of rewound afterwards. The socket of a
+  connection is closed when the send of its last response has completed
+  with everything written.
+
+  If the kernel takes no more entries because the completion queue is
+  full, the completions are moved to a backlog, which the loop handles
+  before the ring.
+
+  Deferred responses are completed by other threads, they pass the
+  connection back through a list and an eventfd that is read by the ring.
+
+  The timeouts are tracked in a timer wheel like in event.c, a timeout
+  operation of the ring wakes the loop every tick while timers are set. The
+  socket of an expired connection is shut down, so its pending operation
+  fails and the connection is closed.
+
+  When accepting fails with an error like EMFILE, the next accept is only
+  submitted after a timeout operation for the backoff has completed.
+
+  The ring is used through the kernel interface directly, liburing is not
+  needed.
+*/
+
+#define RING_ENTRIES 256
+#define BUFFER_SLOTS 1024
+#define OUTPUT_BUFFER_SIZE 4096
+
+// the operation is stored in the lower bits of the user data, the socket above
+#define OP_ACCEPT 0
+#define OP_RECEIVE 1
+#define OP_SEND 2
+#define OP_CLOSE 3
+#define OP_WAKEUP 4
+#define OP_TICK 5
+#define OP_ACCEPT_RETRY 6
+#define OP_BITS 3
+
+struct ring {
+	int fd;
+
+	unsigned * sq_head;
+	unsigned * sq_tail;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	unsigned sq_local_tail;
+	struct io_uring_sqe * sqes;
+
+	unsigned * cq_head;
+	unsigned * cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe * cqes;
+
+	struct sepia_server * server;
+
+	// the kernel only knows the sockets, so the connections have to stay reachable for the GC here
+	struct connection ** connections;
+	size_t connections_size;
+
+	// the registered area, never collected as the kernel keeps writing into it
+	char * slots;
+	size_t slot_size;
+	int free_slots[BUFFER_SLOTS];
+	int free_slot_count;
+
+	// connections of completed deferred requests
+	struct connection ** completed;
+	size_t completed_count;
+	size_t completed_size;
+	pthread_mutex_t completed_lock;
+	int wakeup;
+	uint64_t wakeup_count;
+
+	// completions taken off the ring while entries were reserved
+	struct io_uring_cqe * backlog;
+	size_t backlog_start;
+	size_t backlog_count;
+	size_t backlog_size;
+
+	// set when io_uring_enter() has failed, the entries are prepared in discarded then and the loop ends
+	int failed;
+	struct io_uring_sqe discarded;
+
+	// NULL if there are no timeouts
+	struct sepia_timer_wheel * wheel;
+	int ticking;
+
+	struct sepia_accept_backoff accept_backoff;
+	struct __kernel_timespec accept_delay;
+};
+
+struct connection {
+	// first member, the requests point to it
+	struct sepia_connection base;
+	struct ring * ring;
+
+	// a request waiting for its body
+	struct sepia_request * request;
+	// the output is the response of a request, not an answer of the protocol
+	int responding;
+	size_t written;
+
+	// the slot of the registered area or -1
+	int slot;
+	// a request body points into the buffer, so it is replaced instead of rewound
+	int shared;
+
+	// the request waiting for sepia_request_complete()
+	struct sepia_request * handled;
+
+	// the timeout of the pending operation
+	struct sepia_timer timer;
+	// when the header of the next request has to be complete, 0 until the connection waits for it
+	int64_t header_deadline;
+};
+
+static struct __kernel_timespec tick = { 0, SEPIA_TIMER_TICK * 1000 };
+
+static int setup_ring(struct ring * ring)
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+
+	ring->fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+	if (ring->fd < 0) {
+		return -1;
+	}
+
+	size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+	if ((params.features & IORING_FEAT_SINGLE_MMAP) && cq_size > sq_size) {
+		sq_size = cq_size;
+	}
+
+	char * sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	char * cq = sq;
+
+	if (sq != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+		cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	}
+
+	ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+
+	if (sq == MAP_FAILED || cq == MAP_FAILED || ring->sqes == MAP_FAILED) {
+		close(ring->fd);
+		return -1;
+	}
+
+	ring->sq_head = (unsigned *) (sq + params.sq_off.head);
+	ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+	ring->sq_mask = * (unsigned *) (sq + params.sq_off.ring_mask);
+	ring->sq_entries = params.sq_entries;
+	ring->sq_local_tail = * ring->sq_tail;
+
+	// the entries are always used in order
+	unsigned i, * array = (unsigned *) (sq + params.sq_off.array);
+	for (i = 0; i < params.sq_entries; i++) {
+		array[i] = i;
+	}
+
+	ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+	ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+	ring->cq_mask = * (unsigned *) (cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+	return 0;
+}
+
+static void register_slots(struct ring * ring)
+{
+	struct iovec area;
+
+	ring->slot_size = ring->server->config.read_buffer_size;
+	ring->slots = GC_MALLOC_ATOMIC_UNCOLLECTABLE(BUFFER_SLOTS * ring->slot_size);
+	area.iov_base = ring->slots;
+	area.iov_len = BUFFER_SLOTS * ring->slot_size;
+
+	// fails if the area is larger than RLIMIT_MEMLOCK, every read uses a buffer of its own then
+	if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, &area, 1) != 0) {
+		GC_FREE(ring->slots);
+		ring->slots = NULL;
+		return;
+	}
+
+	for (ring->free_slot_count = 0; ring->free_slot_count < BUFFER_SLOTS; ring->free_slot_count++) {
+		ring->free_slots[ring->free_slot_count] = BUFFER_SLOTS - 1 - ring->free_slot_count;
+	}
+}
+
+// submits everything that was prepared and waits for wait completions, returns -1 if the ring cannot be used anymore
+static int submit(struct ring * ring, unsigned wait)
+{
+	__atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+	// also the entries the kernel did not take with an earlier call
+	unsigned count = ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+	int result = syscall(__NR_io_uring_enter, ring->fd, count, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	return result < 0 && errno != EINTR && errno != EBUSY && errno != EAGAIN ? -1 : 0;
+}
+
+// moves the completions to the backlog, so the kernel can post those it holds back and take entries again
+static void drain_completions(struct ring * ring)
+{
+	unsigned head = * ring->cq_head;
+	unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+	while (head != tail) {
+		if (ring->backlog_start + ring->backlog_count == ring->backlog_size) {
+			size_t size = ring->backlog_count * 2 > RING_ENTRIES ? ring->backlog_count * 2 : RING_ENTRIES;
+			struct io_uring_cqe * backlog = GC_MALLOC_ATOMIC(size * sizeof(struct io_uring_cqe));
+
+			memcpy(backlog, ring->backlog + ring->backlog_start, ring->backlog_count * sizeof(struct io_uring_cqe));
+			ring->backlog = backlog;
+			ring->backlog_start = 0;
+			ring->backlog_size = size;
+		}
+		ring->backlog[ring->backlog_start + ring->backlog_count++] = ring->cqes[head++ & ring->cq_mask];
+	}
+
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+// takes the next completion, those of the backlog came first, returns 0 if there is none
+static int next_completion(struct ring * ring, struct io_uring_cqe * cqe)
+{
+	if (ring->backlog_count > 0) {
+		* cqe = ring->backlog[ring->backlog_start++];
+		if (--ring->backlog_count == 0) {
+			ring->backlog_start = 0;
+		}
+		return 1;
+	}
+
+	unsigned head = * ring->cq_head;
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+		return 0;
+	}
+
+	* cqe = ring->cqes[head & ring->cq_mask];
+	__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+// makes sure that the next count entries can be prepared without submitting in between
+static void reserve_sqes(struct ring * ring, unsigned count)
+{
+	while (!ring->failed && ring->sq_local_tail + count - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) > ring->sq_entries) {
+		// the kernel does not take entries while it cannot post their completions
+		drain_completions(ring);
+		if (submit(ring, 0) != 0) {
+			ring->failed = 1;
+		}
+	}
+}
+
+static struct io_uring_sqe * next_sqe(struct ring * ring, int op, int socket)
+{
+	reserve_sqes(ring, 1);
+
+	struct io_uring_sqe * sqe = &ring->discarded;
+	if (!ring->failed) {
+		sqe = &ring->sqes[ring->sq_local_tail & ring->sq_mask];
+		ring->sq_local_tail++;
+	}
+
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->fd = socket;
+	sqe->user_data = ((__u64) socket << OP_BITS) | op;
+	return sqe;
+}
+
+static void set_connection(struct ring * ring, int socket, struct connection * conn)
+{
+	if (socket >= ring->connections_size) {
+		size_t size = ring->connections_size == 0 ? 1024 : ring->connections_size;
+		while (size <= socket) {
+			size *= 2;
+		}
+		ring->connections = GC_REALLOC(ring->connections, size * sizeof(struct connection *));
+		memset(ring->connections + ring->connections_size, 0, (size - ring->connections_size) * sizeof(struct connection *));
+		ring->connections_size = size;
+	}
+
+	ring->connections[socket] = conn;
+}
+
+static void complete_request(struct sepia_request * request)
+{
+	struct ring * ring = ((struct connection *) request->conn)->ring;
+
+	pthread_mutex_lock(&ring->completed_lock);
+
+	if (ring->completed_count == ring->completed_size) {
+		ring->completed_size = ring->completed_size == 0 ? 64 : ring->completed_size * 2;
+		ring->completed = GC_REALLOC(ring->completed, ring->completed_size * sizeof(struct connection *));
+	}
+	ring->completed[ring->completed_count++] = (struct connection *) request->conn;
+
+	pthread_mutex_unlock(&ring->completed_lock);
+
+	uint64_t one = 1;
+	write(ring->wakeup, &one, sizeof(one));
+}
+
+static struct connection * add_connection(struct ring * ring, int socket)
+{
+	struct connection * conn = GC_MALLOC(sizeof(struct connection));
+
+	if (ring->free_slot_count > 0) {
+		sepia_init_connection(&conn->base, ring->server, socket, 0);
+		conn->slot = ring->free_slots[--ring->free_slot_count];
+		conn->base.buffer = ring->slots + conn->slot * ring->slot_size;
+		conn->base.buffer_size = ring->slot_size;
+	} else {
+		sepia_init_connection(&conn->base, ring->server, socket, ring->server->config.read_buffer_size);
+		conn->slot = -1;
+	}
+	conn->ring = ring;
+
+	conn->base.output = bfromcstralloc(OUTPUT_BUFFER_SIZE, "");
+	conn->request = NULL;
+	conn->responding = 0;
+	conn->written = 0;
+	conn->handled = NULL;
+	conn->base.complete = complete_request;
+	sepia_timer_init(&conn->timer);
+	conn->header_deadline = 0;
+
+	set_connection(ring, socket, conn);
+	return conn;
+}
+
+static void accept_connection(struct ring * ring, int sock)
+{
+	next_sqe(ring, OP_ACCEPT, sock)->opcode = IORING_OP_ACCEPT;
+}
+
+// submits the next accept after delay microseconds
+static void delay_accept(struct ring * ring, int64_t delay)
+{
+	struct io_uring_sqe * sqe = next_sqe(ring, OP_ACCEPT_RETRY, 0);
+
+	ring->accept_delay.tv_sec = delay / 1000000;
+	ring->accept_delay.tv_nsec = (delay % 1000000) * 1000;
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->fd = -1;
+	sqe->addr = (__u64) (uintptr_t) &ring->accept_delay;
+	sqe->len = 1;
+}
+
+static void cancel_timer(struct connection * conn)
+{
+	if (conn->ring->wheel != NULL) {
+		sepia_timer_cancel(conn->ring->wheel, &conn->timer);
+	}
+}
+
+// wakes the loop after a tick to advance the timer wheel
+static void start_tick(struct ring * ring)
+{
+	struct io_uring_sqe * sqe = next_sqe(ring, OP_TICK, 0);
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->fd = -1;
+	sqe->addr = (__u64) (uintptr_t) &tick;
+	sqe->len = 1;
+	ring->ticking = 1;
+}
+
+// sets the timer of the operation that is submitted for a connection
+static void arm_timer(struct ring * ring, struct connection * conn, int phase)
+{
+	int timeout = sepia_timeout(phase);
+
+	if (timeout <= 0) {
+		sepia_timer_cancel(ring->wheel, &conn->timer);
+		return;
+	}
+
+	int64_t deadline = sepia_now() + (int64_t) timeout * 1000;
+	if (phase == SEPIA_TIMEOUT_HEADER) {
+		if (conn->header_deadline == 0) {
+			conn->header_deadline = deadline;
+		}
+		deadline = conn->header_deadline;
+	}
+
+	sepia_timer_set(ring->wheel, &conn->timer, deadline);
+
+	if (!ring->ticking) {
+		start_tick(ring);
+	}
+}
+
+static void expire(struct sepia_timer * timer)
+{
+	struct connection * conn = (struct connection *) ((char *) timer - offsetof(struct connection, timer));
+
+	sepia_connection_expired(&conn->base);
+	shutdown(conn->base.socket, SHUT_RDWR);
+}
+
+static void remove_connection(struct connection * conn)
+{
+	struct ring * ring = conn->ring;
+
+	cancel_timer(conn);
+	if (conn->slot >= 0) {
+		ring->free_slots[ring->free_slot_count++] = conn->slot;
+	}
+	ring->connections[conn->base.socket] = NULL;
+}
+
+static void close_connection(struct ring * ring, struct connection * conn)
+{
+	next_sqe(ring, OP_CLOSE, conn->base.socket)->opcode = IORING_OP_CLOSE;
+}
+
+static void receive(struct ring * ring, struct connection * conn)
+{
+	struct sepia_connection * base = &conn->base;
+
+	if (base->offset == base->length && !conn->shared) {
+		base->offset = base->length = 0;
+	} else if (base->length == base->buffer_size) {
+		size_t length = base->length - base->offset;
+		sepia_connection_reserve(base, length < base->buffer_size / 2 ? base->buffer_size : 2 * length);
+		conn->shared = 0;
+	}
+
+	struct io_uring_sqe * sqe = next_sqe(ring, OP_RECEIVE, base->socket);
+	sqe->addr = (__u64) (uintptr_t) (base->buffer + base->length);
+	sqe->len = base->buffer_size - base->length;
+
+	if (conn->slot >= 0 && base->buffer == ring->slots + conn->slot * ring->slot_size) {
+		sqe->opcode = IORING_OP_READ_FIXED;
+		sqe->buf_index = 0;
+	} else {
+		sqe->opcode = IORING_OP_RECV;
+	}
+
+	if (ring->wheel != NULL) {
+		arm_timer(ring, conn, conn->request != NULL ? SEPIA_TIMEOUT_BODY : SEPIA_TIMEOUT_HEADER);
+	}
+}
+
+static void send_output(struct ring * ring, struct connection * conn)
+{
+	bstring output = conn->base.output;
+	struct io_uring_sqe * sqe = next_sqe(ring, OP_SEND, conn->base.socket);
+
+	sqe->opcode = IORING_OP_SEND;
+	sqe->addr = (__u64) (uintptr_t) (bdata(output) + conn->written);
+	sqe->len = blength(output) - conn->written;
+	sqe->msg_flags = MSG_NOSIGNAL;
+
+	if (ring->wheel != NULL) {
+		arm_timer(ring, conn, SEPIA_TIMEOUT_WRITE);
+	}
+}
+
+static int body_complete(struct connection * conn)
+{
+	struct sepia_request * request = conn->request;
+
+	return request->body != NULL || request->body_length <= 0
+		|| conn->base.length - conn->base.offset >= request->body_length;
+}
+
+// returns 1 if the response is deferred
+static int dispatch(struct connection * conn)
+{
+	struct sepia_request * request = conn->request;
+	conn->request = NULL;
+
+	if (request->body == NULL && request->body_length > 0) {
+		char * body = conn->base.buffer + conn->base.offset;
+
+		// a slot is read into again by later connections, so the body gets a copy of its own
+		if (conn->slot >= 0 && conn->base.buffer == conn->ring->slots + conn->slot * conn->ring->slot_size) {
+			request->body = blk2bstr(body, request->body_length);
+		} else {
+			request->body = GC_MALLOC(sizeof(struct tagbstring));
+			blk2tbstr(* (request->body), body, request->body_length);
+			conn->shared = 1;
+		}
+		conn->base.offset += request->body_length;
+	}
+
+	if (!handle_request(request)) {
+		cancel_timer(conn);
+		conn->handled = request;
+		return 1;
+	}
+
+	conn->responding = 1;
+	return 0;
+}
+
+// parse and handle what is received, then submit the next operation of the connection
+static void process(struct ring * ring, struct connection * conn)
+{
+	if (conn->request == NULL) {
+		int error = 0;
+		conn->request = conn->base.protocol->parse(&conn->base, &error);
+		if (conn->request != NULL) {
+			conn->header_deadline = 0;
+		}
+
+		if (error || (conn->request != NULL && !sepia_request_valid(conn->request))) {
+			sepia_log(LOG_ERR, "Could not read a request.");
+			// an error status of the protocol is still sent, then the connection is closed
+			if (blength(conn->base.output) > 0) {
+				conn->request = NULL;
+				conn->base.keep_alive = 0;
+				conn->responding = 1;
+				send_output(ring, conn);
+				return;
+			}
+			close_connection(ring, conn);
+			return;
+		}
+	}
+
+	if (conn->request != NULL && body_complete(conn)) {
+		if (dispatch(conn)) {
+			return;
+		}
+	} else if (conn->request != NULL && !sepia_admit_request(conn->request)) {
+		// a shed request is answered before its body is received, the connection is closed then
+		conn->request = NULL;
+		conn->responding = 1;
+	} else if (conn->request != NULL) {
+		sepia_connection_reserve(&conn->base, conn->request->body_length);
+	} else if (conn->base.length - conn->base.offset >= ring->server->config.max_header_size) {
+		sepia_log(LOG_ERR, "Could not read a request.");
+		close_connection(ring, conn);
+		return;
+	}
+
+	if (blength(conn->base.output) > 0) {
+		send_output(ring, conn);
+	} else {
+		receive(ring, conn);
+	}
+}
+
+static void wait_for_wakeup(struct ring * ring)
+{
+	struct io_uring_sqe * sqe = next_sqe(ring, OP_WAKEUP, ring->wakeup);
+	sqe->opcode = IORING_OP_READ;
+	sqe->addr = (__u64) (uintptr_t) &ring->wakeup_count;
+	sqe->len = sizeof(ring->wakeup_count);
+}
+
+// sends the responses that were completed by other threads
+static void resume_connections(struct ring * ring)
+{
+	pthread_mutex_lock(&ring->completed_lock);
+	size_t i, n = ring->completed_count;
+	struct connection * list[n];
+	memcpy(list, ring->completed, n * sizeof(struct connection *));
+	memset(ring->completed, 0, n * sizeof(struct connection *));
+	ring->completed_count = 0;
+	pthread_mutex_unlock(&ring->completed_lock);
+
+	for (i = 0; i < n; i++) {
+		struct connection * conn = list[i];
+
+		sepia_finish_response(conn->handled);
+		conn->handled->deferred = 0;
+		conn->handled = NULL;
+
+		conn->responding = 1;
+		send_output(ring, conn);
+	}
+
+	wait_for_wakeup(ring);
+}
+
+static void complete(struct ring * ring, struct io_uring_cqe * cqe, int sock)
+{
+	int op = cqe->user_data & ((1 << OP_BITS) - 1);
+	int socket = cqe->user_data >> OP_BITS;
+	int result = cqe->res;
+
+	if (op == OP_ACCEPT) {
+		if (result >= 0) {
+			ring->accept_backoff.delay = 0;
+			receive(ring, add_connection(ring, result));
+		} else if (!sepia_accept_transient(-result)) {
+			delay_accept(ring, sepia_accept_failed(&ring->accept_backoff, -result));
+			return;
+		}
+		accept_connection(ring, sock);
+		return;
+	}
+
+	if (op == OP_ACCEPT_RETRY) {
+		accept_connection(ring, sock);
+		return;
+	}
+
+	if (op == OP_WAKEUP) {
+		resume_connections(ring);
+		return;
+	}
+
+	if (op == OP_TICK) {
+		ring->ticking = 0;
+		sepia_timer_advance(ring->wheel, sepia_now(), expire);
+		if (sepia_timer_count(ring->wheel) > 0) {
+			start_tick(ring);
+		}
+		return;
+	}
+
+	struct connection * conn = socket < ring->connections_size ? ring->connections[socket] : NULL;
+	if (conn == NULL) {
+		return;
+	}
+
+	if (op == OP_CLOSE) {
+		remove_connection(conn);
+
+	} else if (result == -EINTR || result == -EAGAIN) {
+		if (op == OP_RECEIVE) {
+			receive(ring, conn);
+		} else {
+			send_output(ring, conn);
+		}
+
+	} else if (op == OP_RECEIVE) {
+		// data that arrives after the shutdown is still received
+		if (result <= 0 || conn->base.timed_out) {
+			close_connection(ring, conn);
+			return;
+		}
+		conn->base.length += result;
+		process(ring, conn);
+
+	} else if (op == OP_SEND) {
+		if (result < 0 || conn->base.timed_out) {
+			close_connection(ring, conn);
+			return;
+		}
+		conn->written += result;
+		if (conn->written < blength(conn->base.output)) {
+			send_output(ring, conn);
+			return;
+		}
+		btrunc(conn->base.output, 0);
+		conn->written = 0;
+
+		// the last response is sent completely
+		if (conn->responding && !conn->base.keep_alive) {
+			sepia_connection_discard(&conn->base);
+			close_connection(ring, conn);
+			return;
+		}
+		conn->responding = 0;
+		process(ring, conn);
+	}
+}
+
+int sepia_uring_loop(struct sepia_server * server, int sock)
+{
+	// the connections point to it
+	struct ring * ring = GC_MALLOC(sizeof(struct ring));
+
+	if (setup_ring(ring) != 0) {
+		return -1;
+	}
+
+	ring->wakeup = eventfd(0, 0);
+	if (ring->wakeup < 0) {
+		close(ring->fd);
+		return -1;
+	}
+
+	ring->server = server;
+	ring->connections = NULL;
+	ring->connections_size = 0;
+	ring->slots = NULL;
+	ring->free_slot_count = 0;
+	ring->completed = NULL;
+	ring->completed_count = 0;
+	ring->completed_size = 0;
+	pthread_mutex_init(&ring->completed_lock, NULL);
+	ring->backlog = NULL;
+	ring->backlog_start = 0;
+	ring->backlog_count = 0;
+	ring->backlog_size = 0;
+	ring->failed = 0;
+	ring->wheel = NULL;
+	ring->ticking = 0;
+	memset(&ring->accept_backoff, 0, sizeof(ring->accept_backoff));
+
+	if (sepia_timeout(SEPIA_TIMEOUT_HEADER) > 0 || sepia_timeout(SEPIA_TIMEOUT_BODY) > 0 || sepia_timeout(SEPIA_TIMEOUT_WRITE) > 0) {
+		ring->wheel = sepia_timer_wheel_create(sepia_now());
+	}
+
+	register_slots(ring);
+	accept_connection(ring, sock);
+	wait_for_wakeup(ring);
+
+	while (1) {
+		if (ring->failed || submit(ring, 1) != 0) {
+			sepia_log(LOG_ERR, "Waiting for completions failed.");
+			break;
+		}
+
+		// handling a completion can move the others to the backlog, so they are taken one by one
+		struct io_uring_cqe cqe;
+		while (!ring->failed && next_completion(ring, &cqe)) {
+			complete(ring, &cqe, sock);
+		}
+	}
+
+	close(ring->wakeup);
+	close(ring->fd);
+	pthread_mutex_destroy(&ring->completed_lock);
+	return SEPIA_OK;
+}
+
+#endif
@@ -0,0 +1,106 @@
+#include <string.h>
+
+#include "sepia_internal.h"
+
+/*
+  The uwsgi protocol of nginx and Apache (mod_proxy_uwsgi). A request starts
+  with a 4 byte header, modifier1, the size of the variables as 16 bit
+  little endian and modifier2. The variables are pairs of 16 bit length
+  prefixed keys and values, so they are indexed without looking at their
+  content. The body follows the variables, the response starts with a HTTP
+  status line and ends with the connection.
+*/
+
+#define UWSGI_HEADER_SIZE 4
+#define UWSGI_MODIFIER_VARS 0
+
+#define read_uint16(p) ((p)[0] | ((p)[1] << 8))
+
+// counts the key value pairs, -1 if they do not fit the block exactly
+static int count_vars(const unsigned char * vars, size_t size)
+{
+	const unsigned char * p = vars;
+	const unsigned char * end = vars + size;
+	int count = 0;
+
+	while (p < end) {
+		if (end - p < 2 || end - p - 2 < read_uint16(p)) {
+			return -1;
+		}
+		p += 2 + read_uint16(p);
+		count++;
+	}
+
+	return count % 2 == 0 ? count : -1;
+}
+
+static struct sepia_request * uwsgi_parse(struct sepia_connection * conn, int * error)
+{
+	if (conn->length - conn->offset < UWSGI_HEADER_SIZE) {
+		return NULL;
+	}
+
+	unsigned char * header = (unsigned char *) conn->buffer + conn->offset;
+	size_t size = read_uint16(header + 1);
+
+	if (header[0] != UWSGI_MODIFIER_VARS) {
+		* error = 1;
+		return NULL;
+	}
+
+	if (conn->length - conn->offset < UWSGI_HEADER_SIZE + size) {
+		sepia_connection_reserve(conn, UWSGI_HEADER_SIZE + size);
+		return NULL;
+	}
+
+	unsigned char * vars = header + UWSGI_HEADER_SIZE;
+	int i, count = count_vars(vars, size);
+
+	if (count < 0) {
+		* error = 1;
+		return NULL;
+	}
+
+	/*
+	  One block for the list, the strings and their data. The data is copied
+	  with a terminating zero after every string, the lengths are dropped, so
+	  it fits into the size of the variables.
+	*/
+	struct bstrList * headers = GC_MALLOC(sizeof(struct bstrList) + count * (sizeof(bstring) + sizeof(struct tagbstring)) + size);
+	bstring * entry = (bstring *) (headers + 1);
+	struct tagbstring * strings = (struct tagbstring *) (entry + count);
+	unsigned char * data = (unsigned char *) (strings + count);
+
+	headers->qty = count;
+	headers->mlen = count;
+	headers->entry = entry;
+
+	for (i = 0; i < count; i++) {
+		size_t length = read_uint16(vars);
+		memcpy(data, vars + 2, length);
+		data[length] = '\0';
+
+		blk2tbstr(strings[i], data, length);
+		entry[i] = &strings[i];
+
+		vars += 2 + length;
+		data += length + 1;
+	}
+
+	conn->offset += UWSGI_HEADER_SIZE + size;
+	conn->keep_alive = 0;
+
+	return sepia_new_request(conn, headers);
+}
+
+static void uwsgi_flush(struct sepia_request * request, int last)
+{
+	sepia_connection_send(request->conn, bdata(request->output), blength(request->output));
+	btrunc(request->output, 0);
+}
+
+const struct sepia_protocol sepia_uwsgi_protocol = {
+	uwsgi_parse,
+	sepia_http_send_status,
+	uwsgi_flush
+};